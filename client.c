@@ -7,18 +7,7 @@
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <stdbool.h>
-
-#define MAX_NAME 50
-#define MAX_DATA 1024
-#define MAX_LINE 1200
-
-typedef struct {
-    unsigned int type;
-    unsigned int size;
-    unsigned char source[MAX_NAME];
-    unsigned char data[MAX_DATA];
-} Message;
-
+#include "message.h"
 
 
 int sockfd = -1;
@@ -26,78 +15,33 @@ char client_id[MAX_NAME] = {0};
 char current_session[MAX_NAME] = {0};
 bool insession = false;
 int logged_in = 0;
+int wire_mode = WIRE_BINARY;   // -t switches to the text format for older servers
 pthread_mutex_t sockfd_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-void serialize_message(Message *msg, char *buffer) {
-    snprintf(buffer, MAX_LINE, "%u:%u:%s:%s\n", 
-             msg->type, msg->size, msg->source, msg->data);
-}
-
-// Revised read_line to skip empty lines
-ssize_t read_line(int sockfd, char *buffer, size_t maxlen) {
-    size_t n = 0;
-    char c;
-    while (n < maxlen - 1) {
-        ssize_t rc = recv(sockfd, &c, 1, 0);
-        if (rc == 1) {
-            if (c == '\n' && n == 0) continue; // Skip empty lines
-            buffer[n++] = c;
-            if (c == '\n') break;
-        } else if (rc == 0) {
-            break; // Connection closed
-        } else {
-            return -1; // Error
-        }
-    }
-    buffer[n] = '\0';
-    return n;
-}
-
-void deserialize_message(char *buffer, Message *msg) {
-    // Reset fields to avoid leftovers
-    memset(msg, 0, sizeof(Message));
-    
-    // Split the buffer into tokens
-    char *token = strtok(buffer, ":");
-    if (token) msg->type = atoi(token);
-    
-    token = strtok(NULL, ":");
-    if (token) msg->size = atoi(token);
-    
-    token = strtok(NULL, ":");
-    if (token) strncpy(msg->source, token, MAX_NAME);
-    else strncpy(msg->source, "client", MAX_NAME);
-    // Get remaining data (including spaces)
-    token = strtok(NULL, "\n"); // Read until newline
-    if (token) {
-        strncpy(msg->data, token, MAX_DATA);
-    } else {
-        strncpy(msg->data, msg->source, MAX_DATA); // Ensure empty string if no data
-    }
-
-    // Debug: Print parsed message
-    //printf("DEBUG: Parsed message - type=%u, size=%u, source='%s', data='%s'\n",
-           //msg->type, msg->size, msg->source, msg->data);
-}
+int send_message(Message *msg);
 
 void *receive_handler(void *arg) {
-    char buffer[MAX_LINE];
-    Message msg;
+    static InBuf in;
+    MessageView msg;
+    int listing = 0;           // In the middle of a paged QUERY reply
 
+    inbuf_init(&in);
     while (1) {
-        memset(buffer, 0, sizeof(buffer));
-        ssize_t n = read_line(sockfd, buffer, sizeof(buffer));
-        if (n <= 0) {
-            printf("\nConnection lost\n");
+        int rc = inbuf_next(&in, &msg);
+        if (rc == 0) {
+            if (inbuf_fill(&in, sockfd) <= 0) {
+                printf("\nConnection lost\n");
+                close(sockfd);
+                exit(EXIT_FAILURE);
+            }
+            continue;
+        }
+        if (rc < 0) {
+            printf("\nMalformed message from server\n");
             close(sockfd);
             exit(EXIT_FAILURE);
         }
-        buffer[strcspn(buffer, "\n")] = '\0';
-        
-        // Debug print raw message
-        //printf("DEBUG RAW: %s\n", buffer);
-        
-        deserialize_message(buffer, &msg);
+        if (msg.type == 0 && msg.data_len == 0) continue; // Skip empty lines
 
         switch (msg.type) {
             case 2:  // LO_ACK
@@ -140,8 +84,8 @@ void *receive_handler(void *arg) {
             case 11: // MESSAGE
                 printf("[%s] %s\n", msg.source, msg.data);
                 break;
-            case 13: // QU_ACK
-                printf("=== Server Status ===\n");
+            case 13: // QU_ACK, one page of the listing
+                if (!listing) printf("=== Server Status ===\n");
                 char *p = msg.data;
                 while (*p) {
                     if (*p == '~') {
@@ -151,8 +95,31 @@ void *receive_handler(void *arg) {
                     }
                     p++;
                 }
-                printf("\n");
+                // More to come: ask for the next page where this one ended.
+                listing = strncmp(msg.source, "next=", 5) == 0;
+                if (listing) {
+                    Message next = {0};
+                    next.type = 12;
+                    strncpy((char *)next.source, client_id, MAX_NAME - 1);
+                    strncpy((char *)next.data, msg.source + 5, MAX_DATA - 1);
+                    send_message(&next);
+                } else {
+                    printf("\n");
+                }
+                break;
+            case 16: // SUB_ACK
+                printf("Presence events %s\n", msg.data);
                 break;
+            case 17: // Presence event
+                printf("* %s %s\n", msg.source, msg.data);
+                break;
+            case 18: { // PING: the server checks the connection is alive
+                Message pong = {0};
+                pong.type = 19;
+                strncpy((char *)pong.source, client_id, MAX_NAME - 1);
+                send_message(&pong);
+                break;
+            }
             default:
                 printf("Received unknown message type: %u\n", msg.type);
         }
@@ -161,11 +128,11 @@ void *receive_handler(void *arg) {
 }
 
 int send_message(Message *msg) {
-    char buffer[MAX_LINE];
-    serialize_message(msg, buffer);
+    char buffer[MAX_FRAME];
+    size_t len = serialize_message(msg, buffer, wire_mode);
     
     pthread_mutex_lock(&sockfd_mutex);
-    int result = send(sockfd, buffer, strlen(buffer), 0);
+    int result = send(sockfd, buffer, len, 0);
     pthread_mutex_unlock(&sockfd_mutex);
     
     return result;
@@ -178,10 +145,17 @@ void trim_newline(char *str) {
     }
 }
 
-int main() {
+int main(int argc, char *argv[]) {
     pthread_t recv_thread;
     char input[MAX_DATA];
 
+    if (argc > 1 && strcmp(argv[1], "-t") == 0) {
+        wire_mode = WIRE_TEXT;
+    } else if (argc > 1) {
+        fprintf(stderr, "Usage: %s [-t]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
     printf("Client started. Type /login to begin.\n");
 
     while (1) {
@@ -270,16 +244,24 @@ int main() {
             }
 
             char *session_id = strtok(NULL, " ");
+            char *history = strtok(NULL, " "); // Messages kept for later joiners
+            char *history_bytes = history ? strtok(NULL, " ") : NULL; // And their bytes at most
             if (!session_id) {
-                printf("Usage: /createsession <session_id>\n");
+                printf("Usage: /createsession <session_id> [history [bytes]]\n");
                 continue;
             }
 
             Message msg = {0};
             msg.type = 9; // NEW_SESS
-            msg.size = strlen(session_id);
+            if (history_bytes) {
+                snprintf((char *)msg.data, MAX_DATA, "%s %s %s", session_id, history, history_bytes);
+            } else if (history) {
+                snprintf((char *)msg.data, MAX_DATA, "%s %s", session_id, history);
+            } else {
+                strncpy(msg.data, session_id, MAX_DATA);
+            }
+            msg.size = strlen((char *)msg.data);
             strncpy(msg.source, client_id, MAX_NAME);
-            strncpy(msg.data, session_id, MAX_DATA);
             send_message(&msg);
 
         } else if (strcmp(command, "/joinsession") == 0) {
@@ -322,6 +304,15 @@ int main() {
             strncpy(msg.source, client_id, MAX_NAME);
             send_message(&msg);
 
+        } else if (strcmp(command, "/subscribe") == 0) {
+            // Who comes online or goes, and who joins or leaves our session
+            char *arg = strtok(NULL, " ");
+            Message msg = {0};
+            msg.type = 15;
+            strncpy(msg.source, client_id, MAX_NAME);
+            if (arg) strncpy(msg.data, arg, MAX_DATA - 1);
+            send_message(&msg);
+
         } else if (strcmp(command, "/quit") == 0) {
             if (logged_in) {
                 Message msg = {0};
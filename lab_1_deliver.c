@@ -3,6 +3,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include "probe.h"
 
 #define BUFFER_SIZE 1024
 
@@ -36,12 +37,25 @@ int main(int argc, char *argv[]) {
     }
 
     // Prompt the user for a message
-    printf("Enter message (e.g., ftp <file name>): ");
+    printf("Enter message (e.g., ftp <file name> or probe): ");
     fgets(buffer, BUFFER_SIZE, stdin);
     buffer[strcspn(buffer, "\n")] = '\0'; // Remove trailing newline
 
-    // Check if the file exists
+    // Probe mode: measure the path instead of asking for a transfer
     char *command = strtok(buffer, " ");
+    if (command != NULL && strcmp(command, "probe") == 0) {
+        struct path_estimate est;
+        int result = probe_path(sockfd, &server_addr, &est);
+        if (result < 0) {
+            printf("No probe was answered.\n");
+        } else {
+            print_path_estimate(&est);
+        }
+        close(sockfd);
+        return result < 0 ? EXIT_FAILURE : 0;
+    }
+
+    // Check if the file exists
     char *filename = strtok(NULL, " ");
     if (command == NULL || filename == NULL || strcmp(command, "ftp") != 0) {
         printf("Invalid command format.\n");
@@ -3,6 +3,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include "probe.h"
 
 #define BUFFER_SIZE 1024
 
@@ -48,6 +49,9 @@ int main(int argc, char *argv[]) {
             continue;
         }
         buffer[n] = '\0'; // Null-terminate the received message
+
+        // Path probes are answered silently, there may be dozens of them.
+        if (answer_probe(sockfd, buffer, n, &client_addr, addr_len)) continue;
         printf("Received message: %s\n", buffer);
 
         // Process the message
@@ -1,50 +1,154 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/stat.h>
 #include <errno.h>
-#include "packet.h"   // This header defines struct packet with a char *filename
+#include <fcntl.h>
+#include <poll.h>
+#include "lab_3_transfer.h"
+#include "probe.h"
 #include <math.h>
 
-#define BUFFER_SIZE 1300       // Enough space for header + file data
-#define MAX_FILEDATA_SIZE 1000 // Maximum file data bytes per packet
-#define FILENAME_SIZE 100      // Maximum filename length for input
-#define ALPHA 0.125
-#define BETA 0.25
+#define MIN_PROBED_WINDOW 8    // Smallest probed window, leaves room for SACK loss detection
+#define PROBE_LOSSY 0.10       // Probed loss rate above which fragments are halved
+
+static int sockfd;
+static int file_fd;
+
+static double clock_ms(void *ctx) {
+    (void)ctx;
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return now.tv_sec * 1000.0 + now.tv_usec / 1000.0;
+}
+
+// One sendmmsg batch for a fan-out, a plain sendto otherwise.
+static void send_frame(void *ctx, const struct sockaddr_in *to, int count, const char *buffer, int len) {
+    (void)ctx;
+    if (count == 1) {
+        sendto(sockfd, buffer, len, 0, (const struct sockaddr *)to, sizeof(*to));
+        return;
+    }
+    struct mmsghdr msgs[MAX_RECEIVERS];
+    struct iovec iov = { .iov_base = (void *)buffer, .iov_len = len };
+    for (int i = 0; i < count; i++) {
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_name = (void *)&to[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(to[i]);
+        msgs[i].msg_hdr.msg_iov = &iov;
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    for (int sent = 0; sent < count; ) {
+        int n = sendmmsg(sockfd, msgs + sent, count - sent, 0);
+        if (n <= 0) {
+            perror("sendmmsg");
+            break;
+        }
+        sent += n;
+    }
+}
+
+static int read_file(void *ctx, unsigned long long offset, char *buffer, unsigned int len) {
+    (void)ctx;
+    int n = pread(file_fd, buffer, len, offset);
+    if (n < 0) perror("Failed to read file");
+    return n;
+}
+
+// Filesystems without SEEK_DATA report everything as data.
+static long long next_data(void *ctx, unsigned long long offset) {
+    (void)ctx;
+    off_t data = lseek(file_fd, offset, SEEK_DATA);
+    if (data < 0) return errno == ENXIO ? -1 : (long long)offset; // ENXIO: only a hole left up to EOF
+    return data;
+}
+
+// Seed a receiver's RTT estimator from a path probe, and shrink the window
+// and fragment size to what that path can carry: about twice its
+// bandwidth-delay product, and smaller fragments on a lossy path so each
+// loss costs less to repair.
+static void apply_probe(struct peer *p, const struct path_estimate *est, struct sender_config *cfg) {
+    sender_set_rtt(p, est->avg_rtt, fmax(est->jitter, est->avg_rtt - est->min_rtt), cfg->min_rto);
+
+    if (est->loss_rate > PROBE_LOSSY && cfg->frag_size > MAX_FILEDATA_SIZE / 2) {
+        cfg->frag_size = MAX_FILEDATA_SIZE / 2;
+    }
+    if (est->bandwidth > 0) {
+        double bdp = est->bandwidth * est->min_rtt / 1000.0 / cfg->frag_size;
+        unsigned int probed = (unsigned int)ceil(2 * bdp);
+        if (probed < MIN_PROBED_WINDOW) probed = MIN_PROBED_WINDOW;
+        if (probed < cfg->window) cfg->window = probed;
+    }
+}
 
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <server address> <server port>\n", argv[0]);
+    // Either one receiver, a fan-out list of receivers, or a multicast group
+    // with the number of receivers expected to join it.
+    // -p probes each path first and starts the transfer from what it found.
+    int expected = 0;
+    int probe = 0;
+    int argi = 1;
+    while (argi < argc && argv[argi][0] == '-') {
+        if (strcmp(argv[argi], "-p") == 0) {
+            probe = 1;
+            argi++;
+        } else if (strcmp(argv[argi], "-r") == 0 && argi + 1 < argc) {
+            expected = atoi(argv[argi + 1]);
+            argi += 2;
+        } else {
+            break;
+        }
+    }
+    if (argc - argi < 2 || (argc - argi) % 2 != 0 || (argc - argi) / 2 > MAX_RECEIVERS) {
+        fprintf(stderr, "Usage: %s [-p] <server address> <server port> [<server address> <server port> ...]\n"
+                        "       %s -r <receivers> <multicast group> <port>\n", argv[0], argv[0]);
         exit(EXIT_FAILURE);
     }
-    const char *server_ip = argv[1];
-    int server_port = atoi(argv[2]);
-    int sockfd;
-    struct sockaddr_in server_addr;
-    socklen_t addr_len = sizeof(server_addr);
     char buffer[BUFFER_SIZE];
     char filename_new[FILENAME_SIZE];
 
-    if (server_port <= 0) {
-        fprintf(stderr, "Invalid port number: %d\n", server_port);
-        exit(EXIT_FAILURE);
-    }
-
     // Create UDP socket.
     if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
         perror("Socket creation failed");
         exit(EXIT_FAILURE);
     }
 
-    // Configure server address.
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(server_port);
-    if (inet_pton(AF_INET, server_ip, &server_addr.sin_addr) <= 0) {
-        perror("Invalid address/Address not supported");
+    struct sender sender;
+    struct sender_config cfg;
+    struct sender_io io = { NULL, clock_ms, send_frame, read_file, next_data };
+    sender_config_defaults(&cfg);
+    sender_init(&sender, &io, &cfg);
+
+    // Configure the receiver addresses.
+    for (; argi < argc; argi += 2) {
+        struct sockaddr_in server_addr;
+        int server_port = atoi(argv[argi + 1]);
+        if (server_port <= 0) {
+            fprintf(stderr, "Invalid port number: %d\n", server_port);
+            exit(EXIT_FAILURE);
+        }
+        memset(&server_addr, 0, sizeof(server_addr));
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_port = htons(server_port);
+        if (inet_pton(AF_INET, argv[argi], &server_addr.sin_addr) <= 0) {
+            perror("Invalid address/Address not supported");
+            close(sockfd);
+            exit(EXIT_FAILURE);
+        }
+        if (IN_MULTICAST(ntohl(server_addr.sin_addr.s_addr))) {
+            // Receivers are learned from their handshake answers.
+            sender_set_group(&sender, &server_addr, expected);
+        } else {
+            sender_add_peer(&sender, &server_addr);
+        }
+    }
+    if (sender.multicast && (sender.num_peers > 0 || expected <= 0)) {
+        fprintf(stderr, "A multicast group needs -r <receivers> and no other addresses\n");
         close(sockfd);
         exit(EXIT_FAILURE);
     }
@@ -71,145 +175,77 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    // Initial handshake: send "ftp" and wait for response.
-    const char *init_message = "ftp";
-    struct timeval start, end;
-    gettimeofday(&start, NULL);
-    sendto(sockfd, init_message, strlen(init_message), 0, (struct sockaddr *)&server_addr, addr_len);
-
-    int n = recvfrom(sockfd, buffer, BUFFER_SIZE - 1, 0, (struct sockaddr *)&server_addr, &addr_len);
-    if (n < 0) {
-        perror("Failed to receive response");
-        close(sockfd);
-        exit(EXIT_FAILURE);
-    }
-    buffer[n] = '\0';
-    gettimeofday(&end, NULL);
-
-    // Calculate RTT in milliseconds.
-    double rtt = (end.tv_sec - start.tv_sec) * 1000.0;
-    rtt += (end.tv_usec - start.tv_usec) / 1000.0;
-    printf("Server response: %s\n", buffer);
-    printf("Round Trip Time (RTT): %.3f ms\n", rtt);
-
-    // Open the file in binary mode.
-    FILE *file = fopen(filename_new, "rb");
-    if (!file) {
+    // Open the file.
+    file_fd = open(filename_new, O_RDONLY);
+    if (file_fd < 0) {
         perror("Failed to open file");
         close(sockfd);
         exit(EXIT_FAILURE);
     }
     struct stat st;
-    if (stat(filename_new, &st) < 0) {
+    if (fstat(file_fd, &st) < 0) {
         perror("Failed to get file stats");
-        fclose(file);
+        close(file_fd);
         close(sockfd);
         exit(EXIT_FAILURE);
     }
-    unsigned int total_frag = (st.st_size + MAX_FILEDATA_SIZE - 1) / MAX_FILEDATA_SIZE;
-
-    // Retransmission loop: set dynamic timeout (e.g., 2x measured RTT).
-    double estRtt = rtt; //set initial est to rtt
-    double devRtt = rtt/2; //set initial devRTT to half of measured rtt
-    double timeout = estRtt + 4*devRtt; 
-    printf("\tInitial timeout set to: %.3f ms\n", timeout);
-    //perror("test");
-    // Send file fragments.
-    for (unsigned int frag_no = 1; frag_no <= total_frag; frag_no++) {
-        struct packet pkt;
-        pkt.total_frag = total_frag;
-        pkt.frag_no = frag_no;
-        pkt.size = fread(pkt.filedata, 1, MAX_FILEDATA_SIZE, file);
-        printf("test");
-        // Dynamically allocate memory for the filename and copy it.
-        pkt.filename = malloc(strlen(filename_new) + 1);
-        if (!pkt.filename) {
-            perror("Memory allocation error");
-            fclose(file);
-            close(sockfd);
-            exit(EXIT_FAILURE);
-        }
-        strcpy(pkt.filename, filename_new);
-        //printf("test");
-        // Serialize header into buffer.
-        int header_len = snprintf(buffer, BUFFER_SIZE, "%u:%u:%u:%s:",
-                                    pkt.total_frag, pkt.frag_no, pkt.size, pkt.filename);
-        if (header_len < 0 || header_len >= BUFFER_SIZE) {
-            fprintf(stderr, "Error creating header\n");
-            free(pkt.filename);
-            fclose(file);
-            close(sockfd);
-            exit(EXIT_FAILURE);
-        }
-        // Append the binary file data right after the header.
-        memcpy(buffer + header_len, pkt.filedata, pkt.size);
-        int total_packet_len = header_len + pkt.size;
-        
-        //perror("test");
-        // int retransmission_count = 0;
-        // const int MAX_RETRANSMISSIONS = 10;
-        // while (retransmission_count < MAX_RETRANSMISSIONS) {
-        //     sendto(sockfd, buffer, total_packet_len, 0, (struct sockaddr *)&server_addr, addr_len);
-            
-        //     // Set timeout as before...
-        //     setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-            
-        //     n = recvfrom(sockfd, buffer, BUFFER_SIZE - 1, 0, NULL, NULL);
-        //     if (n > 0 && strstr(buffer, "ACK") != NULL) {
-        //         // ACK received: break out of the loop.
-        //         break;
-        //     } else {
-        //         retransmission_count++;
-        //         printf("Timeout or no ACK for fragment %u (attempt %d). Retransmitting...\n", frag_no, retransmission_count);
-        //     }
-        // }
-
-        // if (retransmission_count == MAX_RETRANSMISSIONS) {
-        //     fprintf(stderr, "Max retransmissions reached for fragment %u. Aborting file transfer.\n", frag_no);
-        //     exit(EXIT_FAILURE);
-        // }
-        while (1) {
-            gettimeofday(&start, NULL);
-            sendto(sockfd, buffer, total_packet_len, 0, (struct sockaddr *)&server_addr, addr_len);
-            gettimeofday(&end, NULL);
-            int to_sec = (int)(timeout / 1000);
-            int to_usec = (int)((timeout - to_sec * 1000) * 1000);
-            struct timeval t;
-            t.tv_sec = to_sec;
-            t.tv_usec = to_usec;
-            setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &t, sizeof(t));
-            n = recvfrom(sockfd, buffer, BUFFER_SIZE - 1, 0, NULL, NULL);
-            //perror("test");
-            rtt = (end.tv_sec - start.tv_sec) * 1000.0;
-            rtt += (end.tv_usec - start.tv_usec) / 1000.0;
-
-            estRtt = (1 - ALPHA) * estRtt + ALPHA * rtt;
-            devRtt = (1-BETA) * devRtt + BETA * fabs(rtt - estRtt);
-
-            // int to_sec = (int)(timeout / 1000);
-            // int to_usec = (int)((timeout - to_sec * 1000) * 1000);
-            // struct timeval t;
-            // t.tv_sec = to_sec;
-            // t.tv_usec = to_usec;
-            // setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &t, sizeof(t));
-            if (n > 0 && strstr(buffer, "ACK") != NULL) {
-                printf("Received ACK for fragment %u\n", pkt.frag_no);
-                timeout = estRtt + 4*devRtt; //update the timeout
-                printf("\tTimeout updated to: %.3f ms\n", timeout);
-                break;
-            } else {
-                printf("Timeout for fragment %u. Retransmitting...\n", pkt.frag_no);
-                printf("\tTimeout reached: %.3f ms\n", timeout);
+    // Probe every unicast path; the transfer is sized for the worst one.
+    if (probe && sender.multicast) {
+        printf("Probing is skipped for a multicast group, its receivers are not known yet.\n");
+    } else if (probe) {
+        for (int i = 0; i < sender.num_peers; i++) {
+            struct peer *p = &sender.peers[i];
+            struct path_estimate est;
+            printf("Probing %s:%d...\n", inet_ntoa(p->addr.sin_addr), ntohs(p->addr.sin_port));
+            if (probe_path(sockfd, &p->addr, &est) < 0) {
+                printf("No probe was answered, starting blind.\n");
+                continue;
             }
+            print_path_estimate(&est);
+            apply_probe(p, &est, &sender.cfg);
+        }
+        printf("Starting with window %u, fragment size %u\n", sender.cfg.window, sender.cfg.frag_size);
+    }
 
-            timeout = estRtt + 4*devRtt; //update the timeout
-            printf("\tTimeout updated to: %.3f ms\n", timeout);
+    sender_start(&sender, filename_new, st.st_size);
+    while (!sender_done(&sender)) {
+        // Wait for an ACK, at most until the next timer runs out.
+        double wait = MAX_RTO;
+        double deadline = sender_deadline(&sender);
+        if (deadline >= 0) wait = deadline - clock_ms(NULL);
+        struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+        int ready = poll(&pfd, 1, wait > 0 ? (int)ceil(wait) : 0);
+        if (ready < 0 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+        if (ready <= 0) {
+            sender_on_timer(&sender);
+            continue;
         }
-        free(pkt.filename);
+
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        int n = recvfrom(sockfd, buffer, BUFFER_SIZE - 1, 0, (struct sockaddr *)&from, &from_len);
+        if (n <= 0) continue;
+        buffer[n] = '\0';
+        sender_on_packet(&sender, &from, buffer, n);
     }
 
-    printf("File transfer completed successfully.\n");
-    fclose(file);
+    int failed = sender_failed(&sender);
+    close(file_fd);
     close(sockfd);
+    if (sender.error) {
+        return EXIT_FAILURE;
+    }
+    if (sender.num_peers == 0) {
+        fprintf(stderr, "No receiver answered the handshake.\n");
+        return EXIT_FAILURE;
+    }
+    if (failed > 0) {
+        fprintf(stderr, "File transfer failed for %d of %d receivers.\n", failed, sender.num_peers);
+        return EXIT_FAILURE;
+    }
+    printf("File transfer completed successfully.\n");
     return 0;
 }
@@ -9,3 +9,40 @@ struct packet {
     char *filename;   // Dynamically allocated filename string.
     char filedata[MAX_FILEDATA_SIZE];
 };
+
+#define PROTOCOL_VERSION 1
+#define DEFAULT_WINDOW 16      // Segments in flight before the first ACK
+#define MAX_WINDOW 64          // Largest window either side will agree to
+#define MAX_SACK_BLOCKS 4      // Ranges a receiver reports above its cumulative ACK
+#define ACK_DELAY_MS 20        // Longest a receiver holds back an ACK
+
+// Feature flags carried in the handshake. A receiver answers with the subset
+// it supports, and only that subset is used for the transfer.
+#define FEAT_SACK     0x1
+#define FEAT_FEC      0x2
+#define FEAT_COMPRESS 0x4
+#define FEAT_CHECKSUM 0x8
+#define FEAT_SPARSE   0x10     // Receiver understands HOLE frames
+
+// Handshake frame, sent by the sender ahead of (not instead of) the first
+// window of data:
+//     "HS:<version>:<file size>:<fragment size>:<window>:<flags>:<filename>"
+// The receiver answers "HSACK:<version>:<window>:<flags>" with the window and
+// flags it accepted, or "HSNAK:<reason>" to refuse the transfer.
+struct handshake {
+    unsigned int version;
+    unsigned long long file_size;
+    unsigned int frag_size;
+    unsigned int window;
+    unsigned int flags;
+    char filename[FILENAME_SIZE];
+};
+
+// Hole extent, sent instead of data for fragments that lie entirely in a hole
+// of a sparse file (only once FEAT_SPARSE has been negotiated):
+//     "HOLE:<total_frag>:<first frag>:<last frag>:<filename>"
+// It takes the place of fragments first..last and is ACKed as <last frag>.
+
+// Receiver ACK: "ACK <n> <window> [<first>-<last> ...]". Fragments up to n are
+// written, up to <window> segments may be in flight, and the optional ranges
+// (at most MAX_SACK_BLOCKS, only with FEAT_SACK) are held above n.
@@ -1,28 +1,98 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <arpa/inet.h>
 #include <time.h>
-#include "packet.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <math.h>
+#include "lab_3_transfer.h"
+#include "probe.h"
 
-#define BUFFER_SIZE 1300       // Must be large enough for header plus file data.
 #define DROP_THRESHOLD 0.95    // Simulate dropping 70% of packets.
-#define MAX_FILEDATA_SIZE 1000 // Assumed maximum file data per packet from packet.h
+
+static int sockfd;
+static int fd = -1;
+static char current_filename[150] = ""; // Buffer for storing the output file name.
+
+static double clock_ms(void *ctx) {
+    (void)ctx;
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return now.tv_sec * 1000.0 + now.tv_usec / 1000.0;
+}
+
+static void send_frame(void *ctx, const struct sockaddr_in *to, const char *buffer, int len) {
+    (void)ctx;
+    sendto(sockfd, buffer, len, 0, (const struct sockaddr *)to, sizeof(*to));
+}
+
+// Open the output file for a new transfer. Reserve the whole file up front
+// so it is laid out contiguously instead of growing one write at a time; not
+// every filesystem supports this.
+static void open_transfer(void *ctx, const char *filename, unsigned long long file_size) {
+    (void)ctx;
+    if (fd >= 0) close(fd);
+    snprintf(current_filename, sizeof(current_filename), "received_%s", filename);
+    fd = open(current_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("Failed to open file for writing");
+        exit(EXIT_FAILURE);
+    }
+    if (file_size > 0 && fallocate(fd, 0, 0, file_size) < 0) {
+        perror("Preallocation failed, continuing without it");
+    }
+}
+
+static void write_file(void *ctx, unsigned long long offset, const char *data, unsigned int size) {
+    (void)ctx;
+    if (pwrite(fd, data, size, offset) < 0) {
+        perror("Failed to write file");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void punch_hole(void *ctx, unsigned long long offset, unsigned long long len) {
+    (void)ctx;
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) < 0 &&
+        errno != EOPNOTSUPP) {
+        perror("Failed to punch hole");
+    }
+}
+
+static void finish_transfer(void *ctx, unsigned long long file_size) {
+    (void)ctx;
+    // A trailing hole leaves nothing written at the end of the file.
+    if (file_size > 0 && ftruncate(fd, file_size) < 0) {
+        perror("Failed to set file size");
+    }
+    printf("File transfer complete. File saved as: %s\n", current_filename);
+    close(fd);
+    fd = -1;
+}
+
+// Fragment number of a data frame or hole extent, 0 for anything else.
+static unsigned int data_frame(const char *buffer) {
+    unsigned int total, frag;
+    if (sscanf(buffer, "HOLE:%u:%u:", &total, &frag) == 2) return frag;
+    if (sscanf(buffer, "%u:%u:", &total, &frag) == 2) return frag;
+    return 0;
+}
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <UDP listen port>\n", argv[0]);
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "Usage: %s <UDP listen port> [<multicast group>]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
     int udp_port = atoi(argv[1]);
-    int sockfd;
     char buffer[BUFFER_SIZE];
     struct sockaddr_in server_addr, client_addr;
     socklen_t addr_len = sizeof(client_addr);
-    FILE *file = NULL;
-    char current_filename[150] = ""; // Buffer for storing the output file name.
 
     if (udp_port <= 0) {
         fprintf(stderr, "Invalid port number: %d\n", udp_port);
@@ -44,6 +114,12 @@ int main(int argc, char *argv[]) {
     server_addr.sin_addr.s_addr = INADDR_ANY;
     server_addr.sin_port = htons(udp_port);
 
+    // Receivers of one multicast distribution may share a host and a port.
+    if (argc == 3) {
+        int opt = 1;
+        setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    }
+
     // Bind the socket.
     if (bind(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
         perror("Bind failed");
@@ -51,113 +127,67 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
+    // Join the multicast group the sender distributes to.
+    if (argc == 3) {
+        struct ip_mreq mreq;
+        memset(&mreq, 0, sizeof(mreq));
+        mreq.imr_interface.s_addr = INADDR_ANY;
+        if (inet_pton(AF_INET, argv[2], &mreq.imr_multiaddr) <= 0 ||
+            setsockopt(sockfd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+            perror("Failed to join multicast group");
+            close(sockfd);
+            exit(EXIT_FAILURE);
+        }
+    }
+
     printf("Server listening on port %d\n", udp_port);
 
-    // Initial handshake: wait for client to send "ftp" message.
-    int n = recvfrom(sockfd, buffer, BUFFER_SIZE - 1, 0, (struct sockaddr *)&client_addr, &addr_len);
-    if (n < 0) {
-        perror("Failed to receive initial message");
-        close(sockfd);
+    struct receiver *receiver = malloc(sizeof(*receiver));
+    struct receiver_config cfg;
+    struct receiver_io io = { NULL, clock_ms, send_frame, open_transfer, write_file, punch_hole, finish_transfer };
+    if (!receiver) {
+        perror("malloc");
         exit(EXIT_FAILURE);
     }
-    buffer[n] = '\0';
-    printf("Received initial message: %s\n", buffer);
-    // Reply with "yes" to allow file transfer.
-    sendto(sockfd, "yes", 3, 0, (struct sockaddr *)&client_addr, addr_len);
+    receiver_config_defaults(&cfg);
+    receiver_init(receiver, &io, &cfg);
+
+    while (!receiver_finished(receiver)) {
+        int wait = -1;
+        double deadline = receiver_deadline(receiver);
+        if (deadline >= 0) {
+            double left = deadline - clock_ms(NULL);
+            wait = left > 0 ? (int)ceil(left) : 0;
+        }
+        struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+        int ready = poll(&pfd, 1, wait);
+        if (ready == 0) {
+            receiver_on_timer(receiver);
+            continue;
+        }
 
-    unsigned int expected_frag = 1;
-    while (1) {
         memset(buffer, 0, BUFFER_SIZE);
-        n = recvfrom(sockfd, buffer, BUFFER_SIZE, 0, (struct sockaddr *)&client_addr, &addr_len);
+        int n = recvfrom(sockfd, buffer, BUFFER_SIZE - 1, 0, (struct sockaddr *)&client_addr, &addr_len);
         if (n <= 0) {
             perror("Failed to receive packet");
             continue;
         }
-        // Parse the header.
-        struct packet pkt;
-        char temp_filename[150];  // Temporary storage for the filename.
-        int parsed = sscanf(buffer, "%u:%u:%u:%99[^:]:", 
-                            &pkt.total_frag, &pkt.frag_no, &pkt.size, temp_filename);
-        if (parsed < 4) {
-            fprintf(stderr, "Malformed packet received. Skipping...\n");
-            continue;
-        }
-        // Allocate memory for the filename.
-        pkt.filename = malloc(strlen(temp_filename) + 1);
-        if (!pkt.filename) {
-            perror("Memory allocation error");
-            continue;
-        }
-        strcpy(pkt.filename, temp_filename);
-
-        // Compute header length using snprintf.
-        int header_len = snprintf(NULL, 0, "%u:%u:%u:%s:", 
-                                  pkt.total_frag, pkt.frag_no, pkt.size, pkt.filename);
-        if (header_len < 0 || header_len >= BUFFER_SIZE) {
-            fprintf(stderr, "Header length error. Skipping packet.\n");
-            free(pkt.filename);
-            continue;
-        }
-        if (pkt.size > MAX_FILEDATA_SIZE) {
-            fprintf(stderr, "Packet size too large. Skipping packet.\n");
-            free(pkt.filename);
-            continue;
-        }
-        // Copy the file data from the correct offset.
-        memcpy(pkt.filedata, buffer + header_len, pkt.size);
+
+        // Senders may measure the path before (or while) sending.
+        if (answer_probe(sockfd, buffer, n, &client_addr, addr_len)) continue;
 
         // Simulate packet drop: generate a random number in [0,1)
+        unsigned int frag_no = data_frame(buffer);
         double r = (double)rand() / RAND_MAX;
-        if (r < DROP_THRESHOLD) {
-            printf("Simulated drop for fragment %u\n", pkt.frag_no);
-            free(pkt.filename);
+        if (frag_no > 0 && !receiver->done && r < DROP_THRESHOLD) {
+            printf("Simulated drop for fragment %u\n", frag_no);
             continue; // Skip processing this packet; no ACK is sent.
         }
 
-        //printf("\tTesting\n");
-        // If this is the first fragment, open the file.
-        if (pkt.frag_no == 1) {
-            snprintf(current_filename, sizeof(current_filename), "received_%s", pkt.filename);
-            if (file) fclose(file);
-            file = fopen(current_filename, "wb");
-            if (!file) {
-                perror("Failed to open file for writing");
-                free(pkt.filename);
-                exit(EXIT_FAILURE);
-            }
-            printf("Receiving file: %s (Total Fragments: %u)\n", current_filename, pkt.total_frag);
-            expected_frag = 1;
-        }
-
-        // Check for expected fragment.
-        if (pkt.frag_no != expected_frag) {
-            fprintf(stderr, "Unexpected fragment %u (expected %u). Skipping...\n", pkt.frag_no, expected_frag);
-            free(pkt.filename);
-            continue;
-        }
-
-        // Write file data.
-        fwrite(pkt.filedata, 1, pkt.size, file);
-        printf("Received and wrote fragment %u of %u\n", pkt.frag_no, pkt.total_frag);
-
-        // Send ACK.
-        char ack[20];
-        snprintf(ack, sizeof(ack), "ACK %u", pkt.frag_no);
-        sendto(sockfd, ack, strlen(ack), 0, (struct sockaddr *)&client_addr, addr_len);
-        printf("Sent ACK for fragment %u\n", pkt.frag_no);
-
-        expected_frag++;
-        free(pkt.filename); // Free the allocated memory for the filename.
-
-        // If this is the last fragment, close the file.
-        if (pkt.frag_no == pkt.total_frag) {
-            printf("File transfer complete. File saved as: %s\n", current_filename);
-            fclose(file);
-            file = NULL;
-            break;
-        }
+        receiver_on_packet(receiver, &client_addr, buffer, n);
     }
 
+    free(receiver);
     close(sockfd);
     return 0;
 }
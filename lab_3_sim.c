@@ -0,0 +1,525 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "lab_3_transfer.h"
+
+// Discrete-event simulator for the lab_3 transfer protocol. The real sender
+// and receiver state machines run against a virtual clock and a modeled
+// link, so a sweep over window, RTO and fragment size takes seconds and the
+// same seed always gives the same result.
+//
+// Link model: the sender's uplink serializes every frame at the link rate
+// (a fan-out pays once per receiver, multicast once in total) behind a
+// drop-tail queue, then each receiver's path adds its propagation delay,
+// independent loss and occasional reordering. ACKs come back over a
+// per-receiver path with the same parameters.
+
+#define MAX_LIST 16
+#define MAX_STEPS 20000000UL   // Events per run before it counts as stuck
+#define MAX_VIRTUAL_MS 600000.0
+#define FRAME_OVERHEAD 28      // IP and UDP headers, counted against the link rate
+#define SIM_PORT 4000
+
+struct link_model {
+    double rate;               // bytes per ms
+    double delay;              // one-way, ms
+    double loss;               // per frame
+    double reorder;            // chance a frame is held back up to another delay
+    double queue;              // longest queueing delay before tail drop, ms
+};
+
+// A frame on its way to a node.
+struct event {
+    double time;
+    unsigned long seq;         // Breaks ties in send order, for determinism
+    int node;                  // 0 is the sender, 1..N the receivers
+    int from;
+    int len;
+    char data[BUFFER_SIZE];
+};
+
+struct sim_receiver {
+    struct receiver *r;
+    char *out;
+    int finished_file;
+    unsigned long long final_size;
+};
+
+struct sim {
+    double now;
+    unsigned long long rng;
+    struct link_model link;
+    struct event **heap;
+    int heap_len, heap_cap;
+    unsigned long seq;
+    double sender_busy;        // Sender uplink free again at
+    double *receiver_busy;     // Per receiver uplink
+    int nodes;                 // Receivers
+    int multicast;
+    struct sender *sender;
+    struct sim_receiver *receivers;
+    const char *file;
+    unsigned long long file_size;
+    unsigned long long hole_start, hole_end; // Sparse region of the file, empty if equal
+    unsigned long frames, drops;
+};
+
+struct run_result {
+    int ok;
+    double ms;
+    unsigned long originals, repairs, timeouts, frames, drops;
+};
+
+// xorshift64*: small, fast and the same everywhere.
+static double sim_random(struct sim *sim) {
+    sim->rng ^= sim->rng >> 12;
+    sim->rng ^= sim->rng << 25;
+    sim->rng ^= sim->rng >> 27;
+    return (double)((sim->rng * 2685821657736338717ULL) >> 11) / 9007199254740992.0;
+}
+
+static int event_before(const struct event *a, const struct event *b) {
+    return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+static void heap_push(struct sim *sim, struct event *ev) {
+    if (sim->heap_len == sim->heap_cap) {
+        sim->heap_cap = sim->heap_cap ? sim->heap_cap * 2 : 256;
+        sim->heap = realloc(sim->heap, sim->heap_cap * sizeof(*sim->heap));
+        if (!sim->heap) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    int i = sim->heap_len++;
+    while (i > 0 && event_before(ev, sim->heap[(i - 1) / 2])) {
+        sim->heap[i] = sim->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    sim->heap[i] = ev;
+}
+
+static struct event *heap_pop(struct sim *sim) {
+    struct event *top = sim->heap[0];
+    struct event *last = sim->heap[--sim->heap_len];
+    int i = 0;
+    while (1) {
+        int child = 2 * i + 1;
+        if (child >= sim->heap_len) break;
+        if (child + 1 < sim->heap_len && event_before(sim->heap[child + 1], sim->heap[child])) child++;
+        if (!event_before(sim->heap[child], last)) break;
+        sim->heap[i] = sim->heap[child];
+        i = child;
+    }
+    if (sim->heap_len > 0) sim->heap[i] = last;
+    return top;
+}
+
+static struct sockaddr_in node_addr(int node) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(node == 0 ? 0x0a000001 : 0x0a000100 + node); // 10.0.0.1, 10.0.1.<node>
+    addr.sin_port = htons(SIM_PORT + node);
+    return addr;
+}
+
+// Node behind an address, -1 for the multicast group.
+static int addr_node(const struct sockaddr_in *addr) {
+    if (IN_MULTICAST(ntohl(addr->sin_addr.s_addr))) return -1;
+    return ntohs(addr->sin_port) - SIM_PORT;
+}
+
+// Queue a frame on an uplink behind whatever is already waiting there.
+// Returns when it has left, or -1 if the queue was full.
+static double serialize(struct sim *sim, double *busy, int len) {
+    double start = *busy > sim->now ? *busy : sim->now;
+    if (start - sim->now > sim->link.queue) return -1; // Tail drop
+    *busy = start + (len + FRAME_OVERHEAD) / sim->link.rate;
+    return *busy;
+}
+
+static void propagate(struct sim *sim, double departed, int from, int node, const char *buf, int len) {
+    sim->frames++;
+    if (departed < 0 || sim_random(sim) < sim->link.loss) {
+        sim->drops++;
+        return;
+    }
+    struct event *ev = malloc(sizeof(*ev));
+    if (!ev) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    ev->time = departed + sim->link.delay;
+    if (sim_random(sim) < sim->link.reorder) ev->time += sim_random(sim) * sim->link.delay;
+    ev->seq = sim->seq++;
+    ev->node = node;
+    ev->from = from;
+    ev->len = len;
+    memcpy(ev->data, buf, len);
+    ev->data[len] = '\0';
+    heap_push(sim, ev);
+}
+
+static double sim_now(void *ctx) {
+    return ((struct sim *)ctx)->now;
+}
+
+static void sender_send(void *ctx, const struct sockaddr_in *to, int count, const char *buf, int len) {
+    struct sim *sim = ctx;
+    for (int i = 0; i < count; i++) {
+        int node = addr_node(&to[i]);
+        double departed = serialize(sim, &sim->sender_busy, len);
+        if (node >= 1 && node <= sim->nodes) {
+            propagate(sim, departed, 0, node, buf, len);
+        } else if (node < 0) {
+            // One copy on the uplink, fanned out by the network.
+            for (int n = 1; n <= sim->nodes; n++) propagate(sim, departed, 0, n, buf, len);
+        }
+    }
+}
+
+static int sender_read(void *ctx, unsigned long long offset, char *buf, unsigned int len) {
+    struct sim *sim = ctx;
+    if (offset >= sim->file_size) return 0;
+    if (len > sim->file_size - offset) len = sim->file_size - offset;
+    memcpy(buf, sim->file + offset, len);
+    return len;
+}
+
+static long long sender_next_data(void *ctx, unsigned long long offset) {
+    struct sim *sim = ctx;
+    if (offset >= sim->hole_start && offset < sim->hole_end) {
+        return sim->hole_end >= sim->file_size ? -1 : (long long)sim->hole_end;
+    }
+    return offset;
+}
+
+// Receiver callbacks get their sim_receiver as context; they reach the sim
+// through the global below.
+static struct sim *current;
+
+static double receiver_now(void *ctx) {
+    (void)ctx;
+    return current->now;
+}
+
+static void receiver_send(void *ctx, const struct sockaddr_in *to, const char *buf, int len) {
+    struct sim_receiver *sr = ctx;
+    int node = (int)(sr - current->receivers) + 1;
+    (void)to;
+    double departed = serialize(current, &current->receiver_busy[node - 1], len);
+    propagate(current, departed, node, 0, buf, len);
+}
+
+static void receiver_open(void *ctx, const char *filename, unsigned long long file_size) {
+    struct sim_receiver *sr = ctx;
+    (void)filename;
+    (void)file_size;
+    memset(sr->out, 0, current->file_size);
+}
+
+static void receiver_write(void *ctx, unsigned long long offset, const char *buf, unsigned int len) {
+    struct sim_receiver *sr = ctx;
+    if (offset + len <= current->file_size) memcpy(sr->out + offset, buf, len);
+}
+
+static void receiver_punch(void *ctx, unsigned long long offset, unsigned long long len) {
+    struct sim_receiver *sr = ctx;
+    if (offset + len <= current->file_size) memset(sr->out + offset, 0, len);
+}
+
+static void receiver_finish(void *ctx, unsigned long long file_size) {
+    struct sim_receiver *sr = ctx;
+    sr->finished_file = 1;
+    sr->final_size = file_size;
+}
+
+// One complete transfer to every receiver.
+static struct run_result run_transfer(struct sim *sim, const struct sender_config *scfg,
+                                      const struct receiver_config *rcfg) {
+    struct run_result res;
+    memset(&res, 0, sizeof(res));
+    current = sim;
+    sim->now = 0;
+    sim->sender_busy = 0;
+    sim->frames = sim->drops = 0;
+    for (int i = 0; i < sim->nodes; i++) sim->receiver_busy[i] = 0;
+
+    struct sender_io sio = { sim, sim_now, sender_send, sender_read, sender_next_data };
+    sender_init(sim->sender, &sio, scfg);
+    if (sim->multicast) {
+        struct sockaddr_in group;
+        memset(&group, 0, sizeof(group));
+        group.sin_family = AF_INET;
+        group.sin_addr.s_addr = htonl(0xef010101); // 239.1.1.1
+        group.sin_port = htons(SIM_PORT);
+        sender_set_group(sim->sender, &group, sim->nodes);
+    } else {
+        for (int i = 1; i <= sim->nodes; i++) {
+            struct sockaddr_in addr = node_addr(i);
+            sender_add_peer(sim->sender, &addr);
+        }
+    }
+    for (int i = 0; i < sim->nodes; i++) {
+        struct sim_receiver *sr = &sim->receivers[i];
+        struct receiver_io rio = { sr, receiver_now, receiver_send, receiver_open, receiver_write,
+                                   receiver_punch, receiver_finish };
+        receiver_init(sr->r, &rio, rcfg);
+        sr->finished_file = 0;
+        sr->final_size = 0;
+        memset(sr->out, 0xff, sim->file_size); // Anything not written shows up as corrupt
+    }
+
+    if (sender_start(sim->sender, "sim.bin", sim->file_size) < 0) return res;
+    struct sockaddr_in sender_addr = node_addr(0);
+    unsigned long steps = 0;
+    while (!sender_done(sim->sender) && sim->now < MAX_VIRTUAL_MS && steps++ < MAX_STEPS) {
+        // Earliest timer of any node, then whatever arrives first.
+        int timer_node = -1;
+        double timer = -1;
+        double deadline = sender_deadline(sim->sender);
+        if (deadline >= 0) {
+            timer = deadline;
+            timer_node = 0;
+        }
+        for (int i = 0; i < sim->nodes; i++) {
+            deadline = receiver_deadline(sim->receivers[i].r);
+            if (deadline >= 0 && (timer < 0 || deadline < timer)) {
+                timer = deadline;
+                timer_node = i + 1;
+            }
+        }
+        if (timer_node >= 0 && (sim->heap_len == 0 || timer <= sim->heap[0]->time)) {
+            if (timer > sim->now) sim->now = timer;
+            if (timer_node == 0) {
+                sender_on_timer(sim->sender);
+            } else {
+                receiver_on_timer(sim->receivers[timer_node - 1].r);
+            }
+            continue;
+        }
+        if (sim->heap_len == 0) break; // Nothing left to happen.
+
+        struct event *ev = heap_pop(sim);
+        sim->now = ev->time;
+        if (ev->node == 0) {
+            struct sockaddr_in from = node_addr(ev->from);
+            sender_on_packet(sim->sender, &from, ev->data, ev->len);
+        } else {
+            receiver_on_packet(sim->receivers[ev->node - 1].r, &sender_addr, ev->data, ev->len);
+        }
+        free(ev);
+    }
+    while (sim->heap_len > 0) free(heap_pop(sim));
+
+    res.ms = sim->now;
+    res.originals = sim->sender->originals;
+    res.repairs = sim->sender->repairs;
+    res.timeouts = sim->sender->timeouts;
+    res.frames = sim->frames;
+    res.drops = sim->drops;
+    res.ok = sender_done(sim->sender) && !sim->sender->error && sender_failed(sim->sender) == 0 &&
+             sim->sender->num_peers == sim->nodes;
+    for (int i = 0; res.ok && i < sim->nodes; i++) {
+        struct sim_receiver *sr = &sim->receivers[i];
+        if (!sr->finished_file || memcmp(sr->out, sim->file, sim->file_size) != 0) res.ok = 0;
+    }
+    return res;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// "4,8,16" into values, returns how many.
+static int parse_list(const char *arg, double *values) {
+    int count = 0;
+    char copy[256];
+    snprintf(copy, sizeof(copy), "%s", arg);
+    for (char *tok = strtok(copy, ","); tok && count < MAX_LIST; tok = strtok(NULL, ",")) {
+        values[count++] = atof(tok);
+    }
+    return count;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -n <runs>          transfers per parameter combination (100)\n"
+            "  -s <seed>          first seed, run i uses seed + i (1)\n"
+            "  -z <bytes>         file size (100000)\n"
+            "  -S                 make the middle half of the file a hole\n"
+            "  -N <receivers>     receivers (1)\n"
+            "  -m                 multicast instead of fan-out\n"
+            "  -b <Mbit/s>        link rate (100)\n"
+            "  -d <ms>            one-way delay (10)\n"
+            "  -l <fraction>      loss per frame (0.01)\n"
+            "  -o <fraction>      frames reordered (0)\n"
+            "  -q <ms>            queueing before tail drop (50)\n"
+            "  -w <list>          windows in segments (%d)\n"
+            "  -R <list>          minimum RTOs in ms (%.0f)\n"
+            "  -f <list>          fragment sizes (%d)\n"
+            "  -a <list>          receiver ACK delays in ms (%d)\n"
+            "  -v                 trace every event of a single run\n",
+            prog, DEFAULT_WINDOW, MIN_RTO, MAX_FILEDATA_SIZE, ACK_DELAY_MS);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int runs = 100;
+    unsigned long long seed = 1;
+    unsigned long long file_size = 100000;
+    int sparse = 0;
+    int verbose = 0;
+    struct sim sim;
+    memset(&sim, 0, sizeof(sim));
+    sim.nodes = 1;
+    double mbit = 100;
+    sim.link.delay = 10;
+    sim.link.loss = 0.01;
+    sim.link.reorder = 0;
+    sim.link.queue = 50;
+    double windows[MAX_LIST] = { DEFAULT_WINDOW }, rtos[MAX_LIST] = { MIN_RTO };
+    double frags[MAX_LIST] = { MAX_FILEDATA_SIZE }, ack_delays[MAX_LIST] = { ACK_DELAY_MS };
+    int num_windows = 1, num_rtos = 1, num_frags = 1, num_ack_delays = 1;
+
+    for (int i = 1; i < argc; i++) {
+        const char *opt = argv[i];
+        if (strcmp(opt, "-S") == 0) { sparse = 1; continue; }
+        if (strcmp(opt, "-m") == 0) { sim.multicast = 1; continue; }
+        if (strcmp(opt, "-v") == 0) { verbose = 1; continue; }
+        if (opt[0] != '-' || strlen(opt) != 2 || i + 1 >= argc) usage(argv[0]);
+        const char *val = argv[++i];
+        switch (opt[1]) {
+        case 'n': runs = atoi(val); break;
+        case 's': seed = strtoull(val, NULL, 10); break;
+        case 'z': file_size = strtoull(val, NULL, 10); break;
+        case 'N': sim.nodes = atoi(val); break;
+        case 'b': mbit = atof(val); break;
+        case 'd': sim.link.delay = atof(val); break;
+        case 'l': sim.link.loss = atof(val); break;
+        case 'o': sim.link.reorder = atof(val); break;
+        case 'q': sim.link.queue = atof(val); break;
+        case 'w': num_windows = parse_list(val, windows); break;
+        case 'R': num_rtos = parse_list(val, rtos); break;
+        case 'f': num_frags = parse_list(val, frags); break;
+        case 'a': num_ack_delays = parse_list(val, ack_delays); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (runs <= 0 || sim.nodes <= 0 || sim.nodes > MAX_RECEIVERS || mbit <= 0) usage(argv[0]);
+    for (int i = 0; i < num_windows; i++) {
+        if (windows[i] < 1 || windows[i] > MAX_WINDOW) {
+            fprintf(stderr, "Windows must be between 1 and %d segments\n", MAX_WINDOW);
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < num_frags; i++) {
+        if (frags[i] < 1 || frags[i] > MAX_FILEDATA_SIZE) {
+            fprintf(stderr, "Fragment sizes must be between 1 and %d bytes\n", MAX_FILEDATA_SIZE);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (verbose) runs = 1;
+    sim.link.rate = mbit * 1000000 / 8 / 1000;
+
+    // The file to send: random bytes, optionally with a hole in the middle.
+    char *file = malloc(file_size + 1);
+    if (!file) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    sim.rng = seed * 0x9e3779b97f4a7c15ULL + 1;
+    for (unsigned long long i = 0; i < file_size; i++) file[i] = (char)(sim_random(&sim) * 256);
+    if (sparse) {
+        sim.hole_start = file_size / 4;
+        sim.hole_end = file_size - file_size / 4;
+        memset(file + sim.hole_start, 0, sim.hole_end - sim.hole_start);
+    }
+    sim.file = file;
+    sim.file_size = file_size;
+
+    sim.sender = malloc(sizeof(*sim.sender));
+    sim.receivers = calloc(sim.nodes, sizeof(*sim.receivers));
+    sim.receiver_busy = calloc(sim.nodes, sizeof(*sim.receiver_busy));
+    double *times = malloc(runs * sizeof(*times));
+    if (!sim.sender || !sim.receivers || !sim.receiver_busy || !times) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < sim.nodes; i++) {
+        sim.receivers[i].r = malloc(sizeof(struct receiver));
+        sim.receivers[i].out = malloc(file_size + 1);
+        if (!sim.receivers[i].r || !sim.receivers[i].out) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    printf("%llu bytes%s to %d receiver%s (%s), %.1f Mbit/s, %.1f ms delay, loss %.3f, reorder %.3f, queue %.0f ms\n",
+           file_size, sparse ? " (sparse)" : "", sim.nodes, sim.nodes == 1 ? "" : "s",
+           sim.multicast ? "multicast" : "fan-out", mbit, sim.link.delay, sim.link.loss,
+           sim.link.reorder, sim.link.queue);
+    printf("%6s %7s %5s %6s %6s %6s %9s %9s %9s %9s %8s %8s %8s\n", "window", "min_rto", "frag", "ackdly",
+           "runs", "failed", "mean_ms", "p50_ms", "p95_ms", "kB/s", "repairs", "timeouts", "frames");
+
+    clock_t started = clock();
+    long total_runs = 0;
+    for (int wi = 0; wi < num_windows; wi++)
+    for (int ri = 0; ri < num_rtos; ri++)
+    for (int fi = 0; fi < num_frags; fi++)
+    for (int ai = 0; ai < num_ack_delays; ai++) {
+        struct sender_config scfg;
+        struct receiver_config rcfg;
+        sender_config_defaults(&scfg);
+        receiver_config_defaults(&rcfg);
+        scfg.window = (unsigned int)windows[wi];
+        scfg.min_rto = rtos[ri];
+        scfg.frag_size = (unsigned int)frags[fi];
+        rcfg.ack_delay = ack_delays[ai];
+        scfg.verbose = rcfg.verbose = verbose;
+
+        int failed = 0, done = 0;
+        double sum = 0;
+        unsigned long repairs = 0, timeouts = 0, frames = 0;
+        for (int run = 0; run < runs; run++) {
+            sim.rng = (seed + run) * 0x9e3779b97f4a7c15ULL + 1;
+            struct run_result res = run_transfer(&sim, &scfg, &rcfg);
+            total_runs++;
+            repairs += res.repairs;
+            timeouts += res.timeouts;
+            frames += res.frames;
+            if (!res.ok) {
+                failed++;
+                continue;
+            }
+            times[done++] = res.ms;
+            sum += res.ms;
+        }
+        qsort(times, done, sizeof(*times), compare_double);
+        double mean = done ? sum / done : 0;
+        printf("%6u %7.1f %5u %6.1f %6d %6d %9.1f %9.1f %9.1f %9.1f %8.1f %8.1f %8.1f\n",
+               scfg.window, scfg.min_rto, scfg.frag_size, rcfg.ack_delay, runs, failed, mean,
+               done ? times[done / 2] : 0, done ? times[(int)(done * 0.95)] : 0,
+               mean > 0 ? file_size / mean : 0, (double)repairs / runs, (double)timeouts / runs,
+               (double)frames / runs);
+    }
+    printf("Simulated %ld transfers in %.2f s\n", total_runs, (double)(clock() - started) / CLOCKS_PER_SEC);
+
+    for (int i = 0; i < sim.nodes; i++) {
+        free(sim.receivers[i].r);
+        free(sim.receivers[i].out);
+    }
+    free(sim.receivers);
+    free(sim.receiver_busy);
+    free(sim.sender);
+    free(sim.heap);
+    free(times);
+    free(file);
+    return 0;
+}
@@ -0,0 +1,709 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <arpa/inet.h>
+#include "lab_3_transfer.h"
+
+#define ALPHA 0.125
+#define BETA 0.25
+
+// Progress and warnings, only printed by drivers that ask for them.
+#define LOG(cfg, ...) do { if ((cfg).verbose) printf(__VA_ARGS__); } while (0)
+#define WARN(cfg, ...) do { if ((cfg).verbose) fprintf(stderr, __VA_ARGS__); } while (0)
+
+void sender_config_defaults(struct sender_config *cfg) {
+    cfg->window = DEFAULT_WINDOW;
+    cfg->frag_size = MAX_FILEDATA_SIZE;
+    cfg->flags = FEAT_SPARSE | FEAT_SACK;
+    cfg->initial_rto = INITIAL_RTO;
+    cfg->min_rto = MIN_RTO;
+    cfg->verbose = 1;
+}
+
+void sender_init(struct sender *s, const struct sender_io *io, const struct sender_config *cfg) {
+    memset(s, 0, sizeof(*s));
+    s->io = *io;
+    s->cfg = *cfg;
+}
+
+static int peer_active(const struct peer *p) {
+    return !p->finished && !p->given_up;
+}
+
+static struct peer *find_peer(struct sender *s, const struct sockaddr_in *addr) {
+    for (int i = 0; i < s->num_peers; i++) {
+        if (s->peers[i].addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+            s->peers[i].addr.sin_port == addr->sin_port) {
+            return &s->peers[i];
+        }
+    }
+    return NULL;
+}
+
+struct peer *sender_add_peer(struct sender *s, const struct sockaddr_in *addr) {
+    if (s->num_peers == MAX_RECEIVERS) return NULL;
+    struct peer *p = &s->peers[s->num_peers++];
+    memset(p, 0, sizeof(*p));
+    p->addr = *addr;
+    p->rwnd = MAX_WINDOW;
+    p->timeout = s->cfg.initial_rto;
+    p->timer = s->io.now(s->io.ctx);
+    if (!s->multicast) s->expected = s->num_peers;
+    return p;
+}
+
+void sender_set_group(struct sender *s, const struct sockaddr_in *group, int expected) {
+    s->multicast = 1;
+    s->group_addr = *group;
+    s->expected = expected;
+}
+
+void sender_set_rtt(struct peer *p, double est_rtt, double dev_rtt, double min_rto) {
+    p->estRtt = est_rtt;
+    p->devRtt = dev_rtt;
+    p->have_rtt = 1;
+    p->timeout = fmax(p->estRtt + 4 * p->devRtt, min_rto);
+}
+
+// Send a frame to every receiver at once: a single datagram to the multicast
+// group, or one batch over the fan-out list.
+static void send_to_all(struct sender *s, const char *buffer, int len) {
+    if (s->multicast) {
+        s->io.send(s->io.ctx, &s->group_addr, 1, buffer, len);
+        return;
+    }
+    struct sockaddr_in to[MAX_RECEIVERS];
+    int count = 0;
+    for (int i = 0; i < s->num_peers; i++) {
+        if (peer_active(&s->peers[i])) to[count++] = s->peers[i].addr;
+    }
+    if (count > 0) s->io.send(s->io.ctx, to, count, buffer, len);
+}
+
+// Resend the segment in window slot idx to one receiver and restart its timer.
+static void repair(struct sender *s, struct peer *p, unsigned int idx) {
+    struct slot *sl = &s->slots[idx];
+    p->repaired[idx] = 1;
+    p->timer = s->io.now(s->io.ctx);
+    s->io.send(s->io.ctx, &p->addr, 1, sl->buffer, sl->len);
+    s->repairs++;
+    LOG(s->cfg, "Repaired fragment %u for %s:%d\n", sl->first_frag,
+        inet_ntoa(p->addr.sin_addr), ntohs(p->addr.sin_port));
+}
+
+// Window slot of the first segment the receiver is missing, or -1.
+static int first_missing(const struct sender *s, const struct peer *p) {
+    for (unsigned int k = 0; k < s->in_flight; k++) {
+        unsigned int idx = (s->head + k) % MAX_WINDOW;
+        if (s->slots[idx].last_frag > p->acked && !p->sacked[idx]) return idx;
+    }
+    return -1;
+}
+
+static void sample_rtt(struct sender *s, struct peer *p, double rtt) {
+    if (!p->have_rtt) {
+        p->estRtt = rtt;       // set initial est to the first sample
+        p->devRtt = rtt / 2;   // and devRTT to half of it
+        p->have_rtt = 1;
+    } else {
+        p->estRtt = (1 - ALPHA) * p->estRtt + ALPHA * rtt;
+        p->devRtt = (1 - BETA) * p->devRtt + BETA * fabs(rtt - p->estRtt);
+    }
+    p->timeout = fmax(p->estRtt + 4 * p->devRtt, s->cfg.min_rto); //update the timeout
+}
+
+// Handle "ACK <n> <window> [<first>-<last> ...]" from one receiver. The
+// optional ranges are SACK blocks: fragments held above the cumulative ACK.
+static void handle_ack(struct sender *s, struct peer *p, char *buffer, double now) {
+    unsigned int acked, rwnd;
+    int consumed = 0;
+    int fields = sscanf(buffer, "ACK %u %u%n", &acked, &rwnd, &consumed);
+    if (fields < 1) return;
+    // Never put more in flight than the receiver has room for.
+    p->rwnd = fields == 2 ? rwnd : MAX_WINDOW;
+
+    // Record SACK blocks against the outstanding segments.
+    unsigned int highest_sacked = 0;
+    if (fields == 2) {
+        char *q = buffer + consumed;
+        unsigned int first, last;
+        int len;
+        while (sscanf(q, " %u-%u%n", &first, &last, &len) == 2) {
+            q += len;
+            for (unsigned int k = 0; k < s->in_flight; k++) {
+                unsigned int idx = (s->head + k) % MAX_WINDOW;
+                if (s->slots[idx].first_frag >= first && s->slots[idx].last_frag <= last) {
+                    p->sacked[idx] = 1;
+                }
+            }
+            if (last > highest_sacked) highest_sacked = last;
+        }
+    }
+
+    if (acked > p->acked && acked < s->next_frag) {
+        // Only an ACK that a segment's own arrival produced measures the RTT:
+        // not one that covers a repair (Karn), and not one that jumps over
+        // SACKed segments because a gap below them was filled.
+        int clean = 1;
+        struct slot *timed = NULL;
+        for (unsigned int k = 0; k < s->in_flight; k++) {
+            unsigned int idx = (s->head + k) % MAX_WINDOW;
+            struct slot *sl = &s->slots[idx];
+            if (sl->last_frag <= p->acked || sl->first_frag > acked) continue;
+            if (p->repaired[idx] || p->sacked[idx]) clean = 0;
+            if (sl->last_frag == acked) timed = sl;
+        }
+        if (clean && timed) sample_rtt(s, p, now - timed->sent_at);
+        p->acked = acked;
+        p->dup_acks = 0;
+        p->timeouts = 0;
+        p->timer = now;
+        // New data got through: drop any backoff even without a sample.
+        p->timeout = p->have_rtt ? fmax(p->estRtt + 4 * p->devRtt, s->cfg.min_rto) : s->cfg.initial_rto;
+        if (acked >= s->total_frag) {
+            p->finished = 1;
+            LOG(s->cfg, "Receiver %s:%d has the whole file\n", inet_ntoa(p->addr.sin_addr), ntohs(p->addr.sin_port));
+            return;
+        }
+        // Partial ACK during recovery: the next segment was lost too, resend
+        // it without waiting for another timeout.
+        if (acked < p->recover) {
+            int idx = first_missing(s, p);
+            if (idx >= 0) repair(s, p, idx);
+        }
+    } else if (acked == p->acked) {
+        p->dup_acks++;
+    }
+
+    if (highest_sacked > 0) {
+        // A segment counts as lost once DUP_ACK_THRESHOLD segments above it
+        // have been SACKed. Each loss is repaired once; a lost repair is left
+        // to the timer.
+        int above = 0;
+        for (int k = (int)s->in_flight - 1; k >= 0; k--) {
+            unsigned int idx = (s->head + k) % MAX_WINDOW;
+            struct slot *sl = &s->slots[idx];
+            if (sl->last_frag <= p->acked) break;
+            if (p->sacked[idx]) {
+                above++;
+            } else if (above >= DUP_ACK_THRESHOLD && !p->repaired[idx]) {
+                repair(s, p, idx);
+                p->recover = s->next_frag - 1;
+            }
+        }
+    } else if (p->dup_acks == DUP_ACK_THRESHOLD) {
+        // No SACK information: fast retransmit of the first missing segment.
+        int idx = first_missing(s, p);
+        if (idx >= 0) {
+            LOG(s->cfg, "Fast retransmit of fragment %u\n", s->slots[idx].first_frag);
+            repair(s, p, idx);
+            p->recover = s->next_frag - 1;
+        }
+    }
+}
+
+// Last fragment of the hole starting at fragment frag_no, or 0 if that
+// fragment holds data.
+static unsigned int hole_end(struct sender *s, unsigned int frag_no) {
+    unsigned int frag_size = s->cfg.frag_size;
+    unsigned long long offset = (unsigned long long)(frag_no - 1) * frag_size;
+    long long data = s->io.next_data(s->io.ctx, offset);
+    if (data < 0) return s->total_frag; // Only a hole left up to EOF
+    if ((unsigned long long)data < offset + frag_size) return 0;
+    return data / frag_size; // The fragment holding data is data / frag_size + 1.
+}
+
+// Serialize the segment starting at fragment frag_no into buffer: either that
+// one fragment's data or, when holes may be sent, a hole extent covering it
+// and every following fragment without data. Returns the packet length.
+static int build_segment(struct sender *s, unsigned int frag_no, int use_holes,
+                         char *buffer, unsigned int *last_frag) {
+    unsigned int hole_last = use_holes ? hole_end(s, frag_no) : 0;
+    if (hole_last >= frag_no) {
+        *last_frag = hole_last;
+        int len = snprintf(buffer, BUFFER_SIZE, "HOLE:%u:%u:%u:%s",
+                           s->total_frag, frag_no, hole_last, s->hs.filename);
+        if (len < 0 || len >= BUFFER_SIZE) {
+            fprintf(stderr, "Error creating header\n");
+            return -1;
+        }
+        return len;
+    }
+
+    struct packet pkt;
+    pkt.total_frag = s->total_frag;
+    pkt.frag_no = frag_no;
+    pkt.filename = s->hs.filename;
+    *last_frag = frag_no;
+    int n = s->io.read(s->io.ctx, (unsigned long long)(frag_no - 1) * s->cfg.frag_size,
+                       pkt.filedata, s->cfg.frag_size);
+    if (n < 0) return -1;
+    pkt.size = n;
+
+    int header_len = snprintf(buffer, BUFFER_SIZE, "%u:%u:%u:%s:",
+                              pkt.total_frag, pkt.frag_no, pkt.size, pkt.filename);
+    if (header_len < 0 || header_len + (int)pkt.size > BUFFER_SIZE) {
+        fprintf(stderr, "Error creating header\n");
+        return -1;
+    }
+    // Append the binary file data right after the header.
+    memcpy(buffer + header_len, pkt.filedata, pkt.size);
+    return header_len + pkt.size;
+}
+
+// Slide the window past what every receiver has, then fill it again. The
+// window only slides once every receiver has a segment (or gave up). Until all
+// expected receivers have answered the handshake it does not slide at all, so
+// nobody joins too late to be repaired.
+static void pump(struct sender *s) {
+    int all_known = s->num_peers == s->expected;
+    int all_hs_acked = all_known;
+    unsigned int base = s->next_frag;
+    unsigned int rwnd = s->cfg.window;
+    for (int i = 0; i < s->num_peers; i++) {
+        struct peer *p = &s->peers[i];
+        if (!p->hs_acked) all_hs_acked = 0;
+        if (!peer_active(p)) continue;
+        if (p->acked + 1 < base) base = p->acked + 1;
+        if (p->rwnd < rwnd) rwnd = p->rwnd;
+    }
+    if (!all_known) base = 1;
+    while (s->in_flight > 0 && s->slots[s->head].last_frag < base) {
+        s->head = (s->head + 1) % MAX_WINDOW;
+        s->in_flight--;
+    }
+
+    // Fill the window. Holes go out as plain zeros until every receiver has
+    // confirmed it understands HOLE frames.
+    while (!s->error && s->next_frag <= s->total_frag && s->in_flight < s->cfg.window && s->in_flight < rwnd) {
+        unsigned int idx = (s->head + s->in_flight) % MAX_WINDOW;
+        struct slot *sl = &s->slots[idx];
+        int use_holes = all_hs_acked && (s->hs.flags & FEAT_SPARSE);
+        sl->len = build_segment(s, s->next_frag, use_holes, sl->buffer, &sl->last_frag);
+        if (sl->len < 0) {
+            s->error = 1;
+            return;
+        }
+        sl->first_frag = s->next_frag;
+        for (int i = 0; i < s->num_peers; i++) {
+            s->peers[i].sacked[idx] = 0;
+            s->peers[i].repaired[idx] = 0;
+        }
+        sl->sent_at = s->io.now(s->io.ctx);
+        send_to_all(s, sl->buffer, sl->len);
+        s->originals++;
+        if (sl->last_frag > sl->first_frag) {
+            LOG(s->cfg, "Sent hole for fragments %u-%u\n", sl->first_frag, sl->last_frag);
+        }
+        s->next_frag = sl->last_frag + 1;
+        s->in_flight++;
+    }
+}
+
+int sender_start(struct sender *s, const char *filename, unsigned long long file_size) {
+    s->total_frag = (file_size + s->cfg.frag_size - 1) / s->cfg.frag_size;
+    if (s->total_frag == 0) s->total_frag = 1; // An empty file still needs one fragment to be created.
+    s->next_frag = 1;
+
+    // Handshake frame. It is not waited on: the first window of data goes out
+    // right behind it, so a small file completes in about one RTT.
+    struct handshake *hs = &s->hs;
+    hs->version = PROTOCOL_VERSION;
+    hs->file_size = file_size;
+    hs->frag_size = s->cfg.frag_size;
+    hs->window = s->cfg.window;
+    hs->flags = s->cfg.flags;
+    snprintf(hs->filename, sizeof(hs->filename), "%s", filename);
+    s->hs_len = snprintf(s->hs_frame, sizeof(s->hs_frame), "HS:%u:%llu:%u:%u:%u:%s",
+                         hs->version, hs->file_size, hs->frag_size, hs->window, hs->flags, hs->filename);
+    s->hs_sent = s->io.now(s->io.ctx);
+    send_to_all(s, s->hs_frame, s->hs_len);
+    LOG(s->cfg, "\tInitial timeout set to: %.3f ms\n", s->num_peers > 0 ? s->peers[0].timeout : s->cfg.initial_rto);
+
+    pump(s);
+    return s->error ? -1 : 0;
+}
+
+void sender_on_packet(struct sender *s, const struct sockaddr_in *from, char *buffer, int len) {
+    (void)len;
+    double now = s->io.now(s->io.ctx);
+    struct peer *p = find_peer(s, from);
+    if (!p && s->multicast && strncmp(buffer, "HSACK:", 6) == 0 && s->num_peers < s->expected) {
+        p = sender_add_peer(s, from);
+        LOG(s->cfg, "Receiver %s:%d joined\n", inet_ntoa(from->sin_addr), ntohs(from->sin_port));
+    }
+    if (!p || !peer_active(p)) return;
+
+    if (strncmp(buffer, "HSACK:", 6) == 0) {
+        unsigned int version, peer_window, peer_flags;
+        if (sscanf(buffer, "HSACK:%u:%u:%u", &version, &peer_window, &peer_flags) != 3) return;
+        if (!p->hs_acked) {
+            p->hs_acked = 1;
+            if (!p->have_rtt && p->timeouts == 0) sample_rtt(s, p, now - s->hs_sent);
+            if (peer_window > 0 && peer_window < s->cfg.window) s->cfg.window = peer_window;
+            s->hs.flags &= peer_flags;
+            LOG(s->cfg, "Handshake accepted: version %u, window %u, flags 0x%x\n", version, s->cfg.window, s->hs.flags);
+        }
+    } else if (strncmp(buffer, "HSNAK:", 6) == 0) {
+        WARN(s->cfg, "Server refused transfer: %s\n", buffer + 6);
+        p->given_up = 1;
+    } else {
+        handle_ack(s, p, buffer, now);
+    }
+    pump(s);
+}
+
+void sender_on_timer(struct sender *s) {
+    // Until every multicast receiver has shown up the handshake is repeated
+    // to the whole group.
+    double now = s->io.now(s->io.ctx);
+    if (s->num_peers < s->expected && now >= s->hs_sent + s->cfg.initial_rto) {
+        if (++s->hs_repeats > MAX_RECEIVER_TIMEOUTS) {
+            WARN(s->cfg, "Only %d of %d receivers joined, continuing without the rest\n",
+                 s->num_peers, s->expected);
+            s->expected = s->num_peers;
+        } else {
+            s->hs_sent = now;
+            send_to_all(s, s->hs_frame, s->hs_len);
+        }
+    }
+    for (int i = 0; i < s->num_peers; i++) {
+        struct peer *p = &s->peers[i];
+        if (!peer_active(p) || now < p->timer + p->timeout) continue;
+
+        // Resend what this receiver misses first (and the handshake, if it
+        // has not been answered yet). Partial ACKs pull out any further
+        // losses. Then back off.
+        LOG(s->cfg, "Timeout for %s:%d. Retransmitting...\n", inet_ntoa(p->addr.sin_addr), ntohs(p->addr.sin_port));
+        LOG(s->cfg, "\tTimeout reached: %.3f ms\n", p->timeout);
+        s->timeouts++;
+        if (++p->timeouts > MAX_RECEIVER_TIMEOUTS) {
+            WARN(s->cfg, "Receiver %s:%d stopped answering, giving up on it\n",
+                 inet_ntoa(p->addr.sin_addr), ntohs(p->addr.sin_port));
+            p->given_up = 1;
+            continue;
+        }
+        if (!p->hs_acked) {
+            s->io.send(s->io.ctx, &p->addr, 1, s->hs_frame, s->hs_len);
+        }
+        int idx = first_missing(s, p);
+        if (idx >= 0) {
+            repair(s, p, idx);
+        } else {
+            p->timer = now;
+        }
+        p->recover = s->next_frag - 1;
+        p->timeout = fmin(p->timeout * 2, MAX_RTO);
+        p->dup_acks = 0;
+    }
+    pump(s);
+}
+
+// When sender_on_timer() next has work: a handshake repeat or the earliest
+// receiver timer.
+double sender_deadline(const struct sender *s) {
+    double deadline = -1;
+    if (s->num_peers < s->expected) deadline = s->hs_sent + s->cfg.initial_rto;
+    for (int i = 0; i < s->num_peers; i++) {
+        const struct peer *p = &s->peers[i];
+        if (!peer_active(p)) continue;
+        if (deadline < 0 || p->timer + p->timeout < deadline) deadline = p->timer + p->timeout;
+    }
+    return deadline;
+}
+
+int sender_done(const struct sender *s) {
+    if (s->error) return 1;
+    if (s->num_peers < s->expected) return 0;
+    for (int i = 0; i < s->num_peers; i++) {
+        if (peer_active(&s->peers[i])) return 0;
+    }
+    return 1;
+}
+
+int sender_failed(const struct sender *s) {
+    int failed = 0;
+    for (int i = 0; i < s->num_peers; i++) {
+        if (!s->peers[i].finished) failed++;
+    }
+    return failed;
+}
+
+void receiver_config_defaults(struct receiver_config *cfg) {
+    cfg->ack_every = ACK_EVERY;
+    cfg->ack_delay = ACK_DELAY_MS;
+    cfg->linger = LINGER_MS;
+    cfg->verbose = 1;
+}
+
+void receiver_init(struct receiver *r, const struct receiver_io *io, const struct receiver_config *cfg) {
+    memset(r, 0, sizeof(*r));
+    r->io = *io;
+    r->cfg = *cfg;
+    r->expected_frag = 1;
+    r->frag_size = MAX_FILEDATA_SIZE; // Until a handshake says otherwise
+}
+
+// Write one segment to its place in the file, or turn fragments first..last
+// back into a hole.
+static void store_segment(struct receiver *r, int is_hole, unsigned int first, unsigned int last,
+                          const char *data, unsigned int size) {
+    unsigned long long start = (unsigned long long)(first - 1) * r->frag_size;
+    if (is_hole) {
+        unsigned long long end = (unsigned long long)last * r->frag_size;
+        if (r->file_size > 0 && end > r->file_size) end = r->file_size;
+        if (end > start) r->io.punch(r->io.ctx, start, end - start);
+        LOG(r->cfg, "Received hole for fragments %u-%u\n", first, last);
+        return;
+    }
+    r->io.write(r->io.ctx, start, data, size);
+    LOG(r->cfg, "Received and wrote fragment %u\n", first);
+}
+
+// Free reassembly slots, advertised to the sender as its receive window. The
+// next in-order segment never needs a slot, hence the +1.
+static unsigned int receive_window(const struct receiver *r) {
+    unsigned int free_slots = 0;
+    for (int i = 0; i < REASSEMBLY_SLOTS; i++) {
+        if (!r->reassembly[i].used) free_slots++;
+    }
+    return free_slots + 1;
+}
+
+// Cumulative ACK "ACK <n> <window> [<first>-<last> ...]": everything up to
+// fragment n has been written, up to <window> segments may be in flight, and,
+// if SACK was negotiated, the listed ranges are already held above n.
+static void send_ack(struct receiver *r) {
+    char ack[32 + MAX_SACK_BLOCKS * 24];
+    unsigned int frag_no = r->expected_frag - 1;
+    int len = snprintf(ack, sizeof(ack), "ACK %u %u", frag_no, receive_window(r));
+
+    // Walk the buffered segments in fragment order, merging adjacent ones.
+    unsigned int from = frag_no + 1;
+    for (int blocks = 0; r->sack && blocks < MAX_SACK_BLOCKS; blocks++) {
+        struct segment *lowest = NULL;
+        for (int i = 0; i < REASSEMBLY_SLOTS; i++) {
+            struct segment *seg = &r->reassembly[i];
+            if (seg->used && seg->first_frag >= from && (!lowest || seg->first_frag < lowest->first_frag)) {
+                lowest = seg;
+            }
+        }
+        if (!lowest) break;
+        unsigned int first = lowest->first_frag, last = lowest->last_frag;
+        for (int merged = 1; merged; ) {
+            merged = 0;
+            for (int i = 0; i < REASSEMBLY_SLOTS; i++) {
+                if (r->reassembly[i].used && r->reassembly[i].first_frag == last + 1) {
+                    last = r->reassembly[i].last_frag;
+                    merged = 1;
+                }
+            }
+        }
+        len += snprintf(ack + len, sizeof(ack) - len, " %u-%u", first, last);
+        from = last + 1;
+    }
+    r->io.send(r->io.ctx, &r->peer, ack, len);
+    r->unacked = 0;
+    r->acks++;
+}
+
+// Typed handshake: open the transfer and answer with what we accept.
+static void handle_handshake(struct receiver *r, char *buffer) {
+    struct handshake hs;
+    if (sscanf(buffer, "HS:%u:%llu:%u:%u:%u:%99[^\n]", &hs.version, &hs.file_size,
+               &hs.frag_size, &hs.window, &hs.flags, hs.filename) != 6) {
+        WARN(r->cfg, "Malformed handshake received. Skipping...\n");
+        return;
+    }
+    char reply[64];
+    if (hs.version != PROTOCOL_VERSION) {
+        snprintf(reply, sizeof(reply), "HSNAK:unsupported version %u", hs.version);
+    } else if (hs.frag_size == 0 || hs.frag_size > MAX_FILEDATA_SIZE) {
+        snprintf(reply, sizeof(reply), "HSNAK:unsupported fragment size %u", hs.frag_size);
+    } else {
+        if (!r->handshake_seen && !r->done) {
+            // Data overtook a lost handshake: the file is already open.
+            if (!r->open) {
+                r->io.open(r->io.ctx, hs.filename, hs.file_size);
+                r->open = 1;
+                r->expected_frag = 1;
+            }
+            r->frag_size = hs.frag_size;
+            r->file_size = hs.file_size;
+            r->sack = (hs.flags & FEAT_SACK) != 0;
+            r->handshake_seen = 1;
+            LOG(r->cfg, "Handshake: %s, %llu bytes, fragment size %u, window %u, flags 0x%x\n",
+                hs.filename, hs.file_size, hs.frag_size, hs.window, hs.flags);
+        }
+        unsigned int window = receive_window(r);
+        if (hs.window < window) window = hs.window;
+        snprintf(reply, sizeof(reply), "HSACK:%u:%u:%u", PROTOCOL_VERSION, window, hs.flags & (FEAT_SPARSE | FEAT_SACK));
+    }
+    r->io.send(r->io.ctx, &r->peer, reply, strlen(reply));
+}
+
+// In-order segments are written straight away, later ones wait in the
+// reassembly buffer. ACKs are coalesced: one per ack_every in-order segments
+// or ack_delay, but immediately when a segment arrives out of order, as a
+// duplicate, or fills a gap.
+void receiver_on_packet(struct receiver *r, const struct sockaddr_in *from, char *buffer, int n) {
+    double now = r->io.now(r->io.ctx);
+    r->peer = *from;
+    if (r->done) r->done_at = now; // Linger on while the sender still retransmits.
+
+    if (strncmp(buffer, "HS:", 3) == 0) {
+        handle_handshake(r, buffer);
+        return;
+    }
+
+    // Untyped handshake from older senders.
+    if (strcmp(buffer, "ftp") == 0) {
+        LOG(r->cfg, "Received initial message: %s\n", buffer);
+        // Reply with "yes" to allow file transfer.
+        r->io.send(r->io.ctx, &r->peer, "yes", 3);
+        return;
+    }
+
+    // Parse the header. A data packet carries one fragment, a hole extent
+    // stands for fragments first..last and has no payload.
+    struct packet pkt;
+    char temp_filename[150];  // Temporary storage for the filename.
+    unsigned int last_frag;
+    int is_hole = strncmp(buffer, "HOLE:", 5) == 0;
+    if (is_hole) {
+        if (sscanf(buffer, "HOLE:%u:%u:%u:%99[^\n]", &pkt.total_frag, &pkt.frag_no,
+                   &last_frag, temp_filename) < 4 || last_frag < pkt.frag_no || !r->handshake_seen) {
+            WARN(r->cfg, "Malformed packet received. Skipping...\n");
+            return;
+        }
+        pkt.size = 0;
+        pkt.filename = temp_filename;
+    } else {
+        int parsed = sscanf(buffer, "%u:%u:%u:%99[^:]:",
+                            &pkt.total_frag, &pkt.frag_no, &pkt.size, temp_filename);
+        if (parsed < 4) {
+            WARN(r->cfg, "Malformed packet received. Skipping...\n");
+            return;
+        }
+        pkt.filename = temp_filename;
+        last_frag = pkt.frag_no;
+
+        // Compute header length using snprintf.
+        int header_len = snprintf(NULL, 0, "%u:%u:%u:%s:",
+                                  pkt.total_frag, pkt.frag_no, pkt.size, pkt.filename);
+        if (header_len < 0 || header_len >= BUFFER_SIZE) {
+            WARN(r->cfg, "Header length error. Skipping packet.\n");
+            return;
+        }
+        if (pkt.size > r->frag_size || header_len + (int)pkt.size > n) {
+            WARN(r->cfg, "Packet size too large. Skipping packet.\n");
+            return;
+        }
+        // Copy the file data from the correct offset.
+        memcpy(pkt.filedata, buffer + header_len, pkt.size);
+    }
+
+    // A transfer without a typed handshake starts at its first fragment.
+    if (!r->open && !r->done) {
+        if (pkt.frag_no != 1) return;
+        r->io.open(r->io.ctx, pkt.filename, 0);
+        r->open = 1;
+        r->expected_frag = 1;
+        // Every fragment but the last is full, so the first one gives the
+        // fragment size the handshake would have.
+        if (pkt.total_frag > 1 && pkt.size > 0) r->frag_size = pkt.size;
+    }
+    if (r->total_frag == 0) {
+        r->total_frag = pkt.total_frag;
+        LOG(r->cfg, "Receiving file: %s (Total Fragments: %u)\n", pkt.filename, r->total_frag);
+    }
+
+    int ack_now = 1;
+    if (r->done || last_frag < r->expected_frag) {
+        // Duplicate: the sender missed our ACK, repeat it.
+    } else if (pkt.frag_no <= r->expected_frag) {
+        store_segment(r, is_hole, r->expected_frag, last_frag, pkt.filedata, pkt.size);
+        r->expected_frag = last_frag + 1;
+
+        // Drain whatever the new segment made contiguous.
+        int filled_gap = 0;
+        for (int progress = 1; progress; ) {
+            progress = 0;
+            for (int i = 0; i < REASSEMBLY_SLOTS; i++) {
+                struct segment *seg = &r->reassembly[i];
+                if (!seg->used || seg->first_frag > r->expected_frag) continue;
+                if (seg->last_frag >= r->expected_frag) {
+                    store_segment(r, seg->is_hole, r->expected_frag, seg->last_frag, seg->filedata, seg->size);
+                    r->expected_frag = seg->last_frag + 1;
+                    progress = 1;
+                }
+                seg->used = 0;
+                filled_gap = 1;
+            }
+        }
+
+        if (!filled_gap && r->expected_frag <= r->total_frag && ++r->unacked < (int)r->cfg.ack_every) {
+            ack_now = 0;
+            if (r->unacked == 1) r->ack_due = now + r->cfg.ack_delay;
+        }
+    } else {
+        // Out of order: park it if there is room and tell the sender about
+        // the gap right away.
+        int slot = -1;
+        for (int i = 0; i < REASSEMBLY_SLOTS; i++) {
+            if (r->reassembly[i].used && r->reassembly[i].first_frag == pkt.frag_no) {
+                slot = -2; // Already buffered.
+                break;
+            }
+            if (!r->reassembly[i].used && slot == -1) slot = i;
+        }
+        if (slot >= 0) {
+            struct segment *seg = &r->reassembly[slot];
+            seg->used = 1;
+            seg->is_hole = is_hole;
+            seg->first_frag = pkt.frag_no;
+            seg->last_frag = last_frag;
+            seg->size = pkt.size;
+            memcpy(seg->filedata, pkt.filedata, pkt.size);
+            LOG(r->cfg, "Buffered out-of-order fragment %u (expected %u)\n", pkt.frag_no, r->expected_frag);
+        } else if (slot == -1) {
+            WARN(r->cfg, "Reassembly buffer full, dropping fragment %u\n", pkt.frag_no);
+        }
+    }
+
+    if (ack_now) {
+        send_ack(r);
+        LOG(r->cfg, "Sent ACK for fragment %u\n", r->expected_frag - 1);
+    }
+
+    // If this was the last fragment, finish the file and linger briefly.
+    if (!r->done && r->expected_frag > r->total_frag) {
+        r->io.finish(r->io.ctx, r->file_size);
+        r->open = 0;
+        r->done = 1;
+        r->done_at = now;
+    }
+}
+
+void receiver_on_timer(struct receiver *r) {
+    double now = r->io.now(r->io.ctx);
+    if (r->unacked > 0) {
+        if (now < r->ack_due) return;
+        send_ack(r);
+        LOG(r->cfg, "Sent delayed ACK for fragment %u\n", r->expected_frag - 1);
+        return;
+    }
+    // Linger period over without further retransmissions.
+    if (r->done && now >= r->done_at + r->cfg.linger) r->finished = 1;
+}
+
+double receiver_deadline(const struct receiver *r) {
+    if (r->unacked > 0) return r->ack_due;
+    if (r->done && !r->finished) return r->done_at + r->cfg.linger;
+    return -1;
+}
+
+int receiver_finished(const struct receiver *r) {
+    return r->finished;
+}
@@ -0,0 +1,166 @@
+#ifndef LAB_3_TRANSFER_H
+#define LAB_3_TRANSFER_H
+
+#include <netinet/in.h>
+#include "lab_3_packet.h"
+
+// Sender and receiver state machines of the lab_3 transfer protocol. They do
+// no I/O of their own: frames, file access and the clock all go through the
+// callbacks below, so lab_3_deliver/lab_3_server can drive them from real
+// sockets and lab_3_sim from a modeled link with a virtual clock.
+//
+// A driver feeds every incoming frame to *_on_packet(), calls *_on_timer()
+// once the time returned by *_deadline() has passed, and stops when
+// sender_done()/receiver_finished() says so.
+
+#define BUFFER_SIZE 1300       // Largest frame: header plus file data
+#define INITIAL_RTO 1000.0     // ms, used until the first ACK gives an RTT sample
+#define MIN_RTO (2.0 * ACK_DELAY_MS) // ms, floor so delayed ACKs do not cause spurious resends
+#define MAX_RTO 60000.0        // ms, cap for exponential backoff
+#define DUP_ACK_THRESHOLD 3    // Duplicate ACKs (or SACKed segments above a hole) before a repair
+#define MAX_RECEIVERS 64
+#define MAX_RECEIVER_TIMEOUTS 12 // Consecutive timeouts before a receiver is given up on
+#define REASSEMBLY_SLOTS 63    // Out-of-order segments held until the gap before them fills
+#define ACK_EVERY 2            // In-order segments covered by one delayed ACK
+#define LINGER_MS 2000         // Receiver keeps re-ACKing after the last fragment in case its ACK was lost
+
+struct sender_io {
+    void *ctx;
+    double (*now)(void *ctx);  // ms, any fixed origin
+    // Send one frame to each of count addresses.
+    void (*send)(void *ctx, const struct sockaddr_in *to, int count, const char *buf, int len);
+    // Read up to len bytes at offset. Returns the number read, -1 on error.
+    int (*read)(void *ctx, unsigned long long offset, char *buf, unsigned int len);
+    // Offset of the first data byte at or after offset, -1 if only a hole is
+    // left up to EOF. May simply return offset when holes are not known.
+    long long (*next_data)(void *ctx, unsigned long long offset);
+};
+
+struct receiver_io {
+    void *ctx;
+    double (*now)(void *ctx);
+    void (*send)(void *ctx, const struct sockaddr_in *to, const char *buf, int len);
+    // Start a new output file. file_size is 0 when no handshake announced it.
+    void (*open)(void *ctx, const char *filename, unsigned long long file_size);
+    void (*write)(void *ctx, unsigned long long offset, const char *buf, unsigned int len);
+    void (*punch)(void *ctx, unsigned long long offset, unsigned long long len);
+    // The last fragment is in; file_size (if known) is the final length.
+    void (*finish)(void *ctx, unsigned long long file_size);
+};
+
+struct sender_config {
+    unsigned int window;       // Segments, may shrink by negotiation
+    unsigned int frag_size;
+    unsigned int flags;        // Features offered in the handshake
+    double initial_rto;
+    double min_rto;
+    int verbose;
+};
+
+struct receiver_config {
+    unsigned int ack_every;
+    double ack_delay;          // ms
+    double linger;             // ms
+    int verbose;
+};
+
+// One in-flight segment (a data fragment or a hole extent), kept serialized
+// so it can be resent as-is.
+struct slot {
+    char buffer[BUFFER_SIZE];
+    int len;
+    unsigned int first_frag, last_frag;
+    double sent_at;
+};
+
+// Everything the sender tracks per destination. Original segments go out
+// once to all receivers; repairs go only to the receiver that lost them.
+struct peer {
+    struct sockaddr_in addr;
+    int hs_acked;
+    int finished;              // Has ACKed the last fragment
+    int given_up;              // Stopped answering, no longer waited for
+    unsigned int acked;        // Cumulative ACK
+    unsigned int rwnd;         // Receive window from its latest ACK
+    unsigned int recover;      // Highest fragment sent when loss recovery began
+    int dup_acks;
+    int timeouts;              // Consecutive, reset by progress
+    double estRtt, devRtt, timeout;
+    int have_rtt;
+    double timer;              // Restarted on progress and on every repair
+    unsigned char sacked[MAX_WINDOW];   // Per window slot: selectively ACKed
+    unsigned char repaired[MAX_WINDOW]; // Per window slot: resent (Karn)
+};
+
+struct sender {
+    struct sender_io io;
+    struct sender_config cfg;
+    struct handshake hs;
+    char hs_frame[BUFFER_SIZE];
+    int hs_len;
+    double hs_sent;
+    int hs_repeats;
+    unsigned int total_frag, next_frag;
+    struct slot slots[MAX_WINDOW];
+    unsigned int head, in_flight;  // Ring of outstanding segments in slots
+    struct peer peers[MAX_RECEIVERS];
+    int num_peers;
+    int expected;              // Receivers to wait for before the window slides
+    int multicast;             // Originals go to group_addr instead of each peer
+    struct sockaddr_in group_addr;
+    int error;                 // A segment could not be built
+    unsigned long originals, repairs, timeouts; // Frames sent, for statistics
+};
+
+// An out-of-order segment parked in the reassembly buffer.
+struct segment {
+    int used;
+    int is_hole;
+    unsigned int first_frag, last_frag;
+    unsigned int size;
+    char filedata[MAX_FILEDATA_SIZE];
+};
+
+struct receiver {
+    struct receiver_io io;
+    struct receiver_config cfg;
+    struct sockaddr_in peer;   // Where ACKs go: the source of the latest frame
+    int open;                  // An output file is open
+    unsigned int expected_frag;
+    unsigned int total_frag;
+    unsigned int frag_size;
+    unsigned long long file_size; // Unknown (0) without a handshake
+    int handshake_seen;
+    int sack;                  // SACK blocks were negotiated
+    int done;                  // Every fragment is in, lingering
+    int finished;              // Linger period over
+    double done_at;
+    int unacked;               // In-order segments not yet ACKed
+    double ack_due;            // When the oldest of them must be ACKed
+    struct segment reassembly[REASSEMBLY_SLOTS];
+    unsigned long acks;        // ACKs sent, for statistics
+};
+
+void sender_config_defaults(struct sender_config *cfg);
+void sender_init(struct sender *s, const struct sender_io *io, const struct sender_config *cfg);
+struct peer *sender_add_peer(struct sender *s, const struct sockaddr_in *addr);
+// Originals go to a multicast group; its expected members are learned from
+// their handshake answers.
+void sender_set_group(struct sender *s, const struct sockaddr_in *group, int expected);
+// Send the handshake and the first window. Returns -1 on error.
+int sender_start(struct sender *s, const char *filename, unsigned long long file_size);
+void sender_on_packet(struct sender *s, const struct sockaddr_in *from, char *buf, int len);
+void sender_on_timer(struct sender *s);
+double sender_deadline(const struct sender *s);
+int sender_done(const struct sender *s);
+int sender_failed(const struct sender *s); // Receivers that did not get the file
+void sender_set_rtt(struct peer *p, double est_rtt, double dev_rtt, double min_rto);
+
+void receiver_config_defaults(struct receiver_config *cfg);
+void receiver_init(struct receiver *r, const struct receiver_io *io, const struct receiver_config *cfg);
+void receiver_on_packet(struct receiver *r, const struct sockaddr_in *from, char *buf, int len);
+void receiver_on_timer(struct receiver *r);
+double receiver_deadline(const struct receiver *r); // < 0: nothing pending
+int receiver_finished(const struct receiver *r);
+
+#endif
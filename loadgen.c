@@ -0,0 +1,441 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include "message.h"
+
+// Load generator for server.c. Opens many connections, logs each in as its
+// own user (start the server with -u open), puts them in sessions of a given
+// size and sends chat messages at a target rate. Every message carries the
+// time it was sent, so each delivery gives one send-to-deliver latency.
+
+#define DEFAULT_CONNECTIONS 1000
+#define DEFAULT_SESSION_SIZE 10
+#define DEFAULT_RATE 1000      // Messages per second, all connections together
+#define DEFAULT_DURATION 10    // Seconds of traffic
+#define DEFAULT_THREADS 4
+#define DEFAULT_PAYLOAD 64     // Bytes of message data, timestamp included
+#define DRAIN_MS 1000          // Wait for deliveries in flight after the last send
+#define MAX_EVENTS 256
+#define OUTBUF_SIZE 8192
+
+// Latency histogram: exact below 64 us, then 32 buckets per power of two,
+// so percentiles are within about 3%.
+#define HIST_BUCKETS (64 + 58 * 32)
+
+typedef struct {
+    int fd;
+    int index;                 // Its user is "u<index>", its session "s<index / session_size>"
+    int acked;                 // Replies received to the setup step in progress
+    InBuf in;
+    char out[OUTBUF_SIZE];     // Bytes the socket did not take yet
+    size_t out_len;
+} Conn;
+
+typedef struct {
+    int id;
+    pthread_t thread;
+    int epfd;
+    Conn *conns;
+    int count;
+    uint64_t sent;             // Messages sent
+    uint64_t skipped;          // Sends skipped because the socket was backed up
+    uint64_t delivered;        // Messages received, own echoes included
+    uint64_t hist[HIST_BUCKETS];
+} Worker;
+
+static const char *host = "127.0.0.1";
+static int port;
+static int num_connections = DEFAULT_CONNECTIONS;
+static int session_size = DEFAULT_SESSION_SIZE;
+static int rate = DEFAULT_RATE;
+static int duration = DEFAULT_DURATION;
+static int num_threads = DEFAULT_THREADS;
+static int payload = DEFAULT_PAYLOAD;
+static int wire_mode = WIRE_BINARY;
+
+static Worker *workers;
+static pthread_barrier_t barrier;
+static uint64_t phase_start[4];  // Connect, create, join, traffic
+static uint64_t phase_end[4];
+
+static uint64_t now_nsec(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static int hist_index(uint64_t usec) {
+    if (usec < 64) return usec;
+    int msb = 63 - __builtin_clzll(usec);
+    int shift = msb - 5;
+    int index = 64 + (msb - 6) * 32 + (int)((usec >> shift) - 32);
+    return index < HIST_BUCKETS ? index : HIST_BUCKETS - 1;
+}
+
+// Smallest latency a bucket holds.
+static uint64_t hist_value(int index) {
+    if (index < 64) return index;
+    int msb = (index - 64) / 32 + 6;
+    return (uint64_t)(32 + (index - 64) % 32) << (msb - 5);
+}
+
+static uint64_t percentile(const uint64_t *hist, uint64_t total, double p) {
+    uint64_t rank = (uint64_t)(total * p);
+    if (rank >= total) rank = total - 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen > rank) return hist_value(i);
+    }
+    return hist_value(HIST_BUCKETS - 1);
+}
+
+// Write what the socket takes and keep the rest for EPOLLOUT. Returns -1 if
+// the previous frame is still waiting, so a backed-up connection is skipped
+// instead of buffering without bound.
+static int conn_send(Conn *c, const char *buf, size_t len) {
+    if (c->out_len > 0) return -1;
+    ssize_t n = send(c->fd, buf, len, MSG_NOSIGNAL);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("send");
+            exit(EXIT_FAILURE);
+        }
+        n = 0;
+    }
+    memcpy(c->out, buf + n, len - n);
+    c->out_len = len - n;
+    return 0;
+}
+
+static void conn_flush(Conn *c) {
+    if (c->out_len == 0) return;
+    ssize_t n = send(c->fd, c->out, c->out_len, MSG_NOSIGNAL);
+    if (n <= 0) return;
+    memmove(c->out, c->out + n, c->out_len - n);
+    c->out_len -= n;
+}
+
+static void send_command(Conn *c, unsigned int type, const char *source, const char *data) {
+    char buffer[MAX_FRAME];
+    size_t len = encode_message(buffer, wire_mode, type, source, strlen(source), data, strlen(data));
+    conn_send(c, buffer, len);
+}
+
+// Read everything the socket has and count what arrived: replies to the
+// setup step, or chat messages, whose latency goes into the histogram.
+static void conn_read(Worker *w, Conn *c) {
+    while (1) {
+        MessageView msg;
+        int rc;
+        while ((rc = inbuf_next(&c->in, &msg)) > 0) {
+            if (msg.type == 11) {
+                uint64_t sent_at = strtoull(msg.data, NULL, 10);
+                uint64_t now = now_nsec();
+                w->delivered++;
+                w->hist[hist_index(now > sent_at ? (now - sent_at) / 1000 : 0)]++;
+            } else if (msg.type == 18) {
+                send_command(c, 19, "", ""); // PING, from a server that heard nothing for a while
+            } else if (msg.type == 3 || msg.type == 7) {
+                fprintf(stderr, "u%d: request refused: %s\n", c->index, msg.data);
+                exit(EXIT_FAILURE);
+            } else {
+                c->acked++;
+            }
+        }
+        if (rc < 0) {
+            fprintf(stderr, "u%d: malformed frame from server\n", c->index);
+            exit(EXIT_FAILURE);
+        }
+        ssize_t n = inbuf_fill(&c->in, c->fd);
+        if (n == 0) {
+            fprintf(stderr, "u%d: server closed the connection\n", c->index);
+            exit(EXIT_FAILURE);
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            perror("recv");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// Handle socket events for up to timeout_ms.
+static void poll_worker(Worker *w, int timeout_ms) {
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(w->epfd, events, MAX_EVENTS, timeout_ms);
+    if (n < 0 && errno != EINTR) {
+        perror("epoll_wait");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < n; i++) {
+        Conn *c = events[i].data.ptr;
+        if (events[i].events & EPOLLOUT) conn_flush(c);
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) conn_read(w, c);
+    }
+}
+
+// Wait until every connection taking part has had want replies.
+static void wait_acks(Worker *w, int want, int creators_only) {
+    while (1) {
+        int done = 1;
+        for (int i = 0; i < w->count && done; i++) {
+            Conn *c = &w->conns[i];
+            if (creators_only && c->index % session_size != 0) continue;
+            if (c->acked < want) done = 0;
+        }
+        if (done) return;
+        poll_worker(w, 1000);
+    }
+}
+
+// Setup steps and traffic, in step with the other workers. Worker 0 times
+// each step from the first thread in to the last one out.
+static void step_begin(Worker *w, int step) {
+    pthread_barrier_wait(&barrier);
+    if (w->id == 0) phase_start[step] = now_nsec();
+    pthread_barrier_wait(&barrier);
+}
+
+static void step_end(Worker *w, int step) {
+    pthread_barrier_wait(&barrier);
+    if (w->id == 0) phase_end[step] = now_nsec();
+}
+
+static void *worker_main(void *arg) {
+    Worker *w = arg;
+    struct sockaddr_in address;
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &address.sin_addr) <= 0) {
+        fprintf(stderr, "Bad address %s\n", host);
+        exit(EXIT_FAILURE);
+    }
+
+    // Connect and log in.
+    step_begin(w, 0);
+    for (int i = 0; i < w->count; i++) {
+        Conn *c = &w->conns[i];
+        c->fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (c->fd < 0 || connect(c->fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+            perror("connect");
+            exit(EXIT_FAILURE);
+        }
+        int one = 1;
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (fcntl(c->fd, F_SETFL, O_NONBLOCK) < 0) {
+            perror("fcntl");
+            exit(EXIT_FAILURE);
+        }
+        inbuf_init(&c->in);
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLET, .data.ptr = c };
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+            perror("epoll_ctl");
+            exit(EXIT_FAILURE);
+        }
+        char user[MAX_NAME];
+        snprintf(user, sizeof(user), "u%d", c->index);
+        send_command(c, 1, user, "x");
+    }
+    wait_acks(w, 1, 0);
+    step_end(w, 0);
+
+    // The first connection of each session creates it, the rest join.
+    step_begin(w, 1);
+    for (int i = 0; i < w->count; i++) {
+        Conn *c = &w->conns[i];
+        if (c->index % session_size != 0) continue;
+        char user[MAX_NAME], session[MAX_NAME];
+        snprintf(user, sizeof(user), "u%d", c->index);
+        snprintf(session, sizeof(session), "s%d", c->index / session_size);
+        send_command(c, 9, user, session);
+    }
+    wait_acks(w, 2, 1);
+    step_end(w, 1);
+
+    step_begin(w, 2);
+    for (int i = 0; i < w->count; i++) {
+        Conn *c = &w->conns[i];
+        if (c->index % session_size == 0) continue;
+        char user[MAX_NAME], session[MAX_NAME];
+        snprintf(user, sizeof(user), "u%d", c->index);
+        snprintf(session, sizeof(session), "s%d", c->index / session_size);
+        send_command(c, 5, user, session);
+    }
+    wait_acks(w, 2, 0);
+    step_end(w, 2);
+
+    // Traffic: this worker's share of the rate, its connections taking turns.
+    step_begin(w, 3);
+    uint64_t interval = (uint64_t)1000000000 * num_threads / rate;
+    uint64_t start = phase_start[3];
+    uint64_t stop = start + (uint64_t)duration * 1000000000;
+    uint64_t next = start + interval * w->id / num_threads;
+    int turn = 0;
+    char data[MAX_DATA];
+    while (1) {
+        uint64_t now = now_nsec();
+        if (now >= stop) break;
+        while (next <= now && next < stop) {
+            Conn *c = &w->conns[turn];
+            turn = (turn + 1) % w->count;
+            next += interval;
+
+            int len = snprintf(data, sizeof(data), "%llu ", (unsigned long long)now_nsec());
+            if (payload > len) {
+                memset(data + len, 'x', payload - len);
+                len = payload;
+            }
+            data[len] = '\0';
+            char buffer[MAX_FRAME];
+            size_t frame_len = encode_message(buffer, wire_mode, 11, "", 0, data, len);
+            if (conn_send(c, buffer, frame_len) < 0) {
+                w->skipped++;
+            } else {
+                w->sent++;
+            }
+        }
+        uint64_t wait = next > now ? (next - now) / 1000000 : 0;
+        poll_worker(w, wait < 100 ? (int)wait : 100);
+    }
+    step_end(w, 3);
+
+    uint64_t drain = now_nsec() + (uint64_t)DRAIN_MS * 1000000;
+    while (now_nsec() < drain) poll_worker(w, 50);
+    return NULL;
+}
+
+static void raise_fd_limit(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+static double seconds(int step) {
+    return (phase_end[step] - phase_start[step]) / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    // -n connections, -g connections per session, -r messages per second in
+    // all, -d seconds of traffic, -T threads, -m payload bytes, -h server
+    // address, -t the text wire format.
+    int argi = 1;
+    while (argi < argc && argv[argi][0] == '-') {
+        if (strcmp(argv[argi], "-t") == 0) {
+            wire_mode = WIRE_TEXT;
+            argi++;
+            continue;
+        }
+        if (argi + 1 >= argc) break;
+        if (strcmp(argv[argi], "-n") == 0) {
+            num_connections = atoi(argv[argi + 1]);
+        } else if (strcmp(argv[argi], "-g") == 0) {
+            session_size = atoi(argv[argi + 1]);
+        } else if (strcmp(argv[argi], "-r") == 0) {
+            rate = atoi(argv[argi + 1]);
+        } else if (strcmp(argv[argi], "-d") == 0) {
+            duration = atoi(argv[argi + 1]);
+        } else if (strcmp(argv[argi], "-T") == 0) {
+            num_threads = atoi(argv[argi + 1]);
+        } else if (strcmp(argv[argi], "-m") == 0) {
+            payload = atoi(argv[argi + 1]);
+        } else if (strcmp(argv[argi], "-h") == 0) {
+            host = argv[argi + 1];
+        } else {
+            break;
+        }
+        argi += 2;
+    }
+    if (argc - argi != 1 || num_connections <= 0 || session_size <= 0 || rate <= 0 || duration <= 0 ||
+        num_threads <= 0 || payload < 0 || payload >= MAX_DATA) {
+        fprintf(stderr, "Usage: %s [-n connections] [-g session_size] [-r msgs_per_sec] [-d seconds] "
+                "[-T threads] [-m payload_bytes] [-h host] [-t] <port>\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    port = atoi(argv[argi]);
+    if (num_threads > num_connections) num_threads = num_connections;
+    raise_fd_limit();
+
+    // Connection i goes to worker i % num_threads.
+    workers = calloc(num_threads, sizeof(Worker));
+    Conn *conns = calloc(num_connections, sizeof(Conn));
+    if (!workers || !conns) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    int per_worker = (num_connections + num_threads - 1) / num_threads;
+    for (int t = 0; t < num_threads; t++) {
+        Worker *w = &workers[t];
+        w->id = t;
+        w->conns = conns + t * per_worker;
+        w->epfd = epoll_create1(0);
+        if (w->epfd < 0) {
+            perror("epoll_create1");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < num_connections; i++) {
+        Worker *w = &workers[i % num_threads];
+        Conn *c = &w->conns[w->count++];
+        c->index = i;
+    }
+
+    pthread_barrier_init(&barrier, NULL, num_threads);
+    for (int t = 0; t < num_threads; t++) {
+        if (pthread_create(&workers[t].thread, NULL, worker_main, &workers[t]) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int t = 0; t < num_threads; t++) pthread_join(workers[t].thread, NULL);
+
+    uint64_t sent = 0, skipped = 0, delivered = 0;
+    static uint64_t hist[HIST_BUCKETS];
+    for (int t = 0; t < num_threads; t++) {
+        Worker *w = &workers[t];
+        sent += w->sent;
+        skipped += w->skipped;
+        delivered += w->delivered;
+        for (int i = 0; i < HIST_BUCKETS; i++) hist[i] += w->hist[i];
+    }
+
+    // Every member of a session, the sender included, should get each
+    // message sent to it. The last session may be smaller.
+    int full = num_connections / session_size, rest = num_connections % session_size;
+    // Senders take turns, so messages split over connections nearly evenly.
+    uint64_t expected = (uint64_t)((double)sent / num_connections *
+                          ((double)full * session_size * session_size + (double)rest * rest));
+
+    printf("connections      %d in %.2fs (%.0f/s, login included)\n", num_connections, seconds(0),
+           num_connections / seconds(0));
+    printf("sessions         %d of up to %d, created in %.2fs, joined in %.2fs\n",
+           full + (rest > 0), session_size, seconds(1), seconds(2));
+    printf("messages sent    %llu in %.2fs (%.0f/s), %llu skipped on a full socket\n",
+           (unsigned long long)sent, seconds(3), sent / seconds(3), (unsigned long long)skipped);
+    printf("deliveries       %llu (%.0f/s), %llu expected\n", (unsigned long long)delivered,
+           delivered / seconds(3), (unsigned long long)expected);
+    if (delivered > 0) {
+        printf("latency (us)     p50 %llu  p99 %llu  p999 %llu  max %llu\n",
+               (unsigned long long)percentile(hist, delivered, 0.5),
+               (unsigned long long)percentile(hist, delivered, 0.99),
+               (unsigned long long)percentile(hist, delivered, 0.999),
+               (unsigned long long)percentile(hist, delivered, 1.0));
+    }
+    return 0;
+}
@@ -0,0 +1,131 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "message.h"
+
+void inbuf_init(InBuf *in) {
+    in->start = in->end = in->scanned = 0;
+}
+
+ssize_t inbuf_fill(InBuf *in, int sockfd) {
+    if (in->start == in->end) {
+        in->start = in->end = 0;
+    } else if (in->end == sizeof(in->buf) && in->start > 0) {
+        memmove(in->buf, in->buf + in->start, in->end - in->start);
+        in->end -= in->start;
+        in->start = 0;
+    }
+    ssize_t n = recv(sockfd, in->buf + in->end, sizeof(in->buf) - in->end, 0);
+    if (n > 0) in->end += n;
+    return n;
+}
+
+// Cut the next ':'-terminated field out of [*p, end) in place.
+static char *next_field(char **p, char *end, size_t *len) {
+    char *field = *p;
+    char *colon = memchr(field, ':', end - field);
+    if (!colon) colon = end;
+    *colon = '\0';
+    *len = colon - field;
+    *p = colon < end ? colon + 1 : end;
+    return field;
+}
+
+// Text frame "<type>:<size>:<source>:<data>\n". The data runs to the end of
+// the line and may itself contain ':'.
+static int next_text(InBuf *in, MessageView *view) {
+    char *frame = in->buf + in->start;
+    char *nl = memchr(frame + in->scanned, '\n', in->end - in->start - in->scanned);
+    if (!nl) {
+        in->scanned = in->end - in->start;
+        if (in->scanned >= MAX_FRAME) return -1;
+        return 0;
+    }
+    in->start += nl + 1 - frame;
+    in->scanned = 0;
+
+    char *end = nl;
+    if (end > frame && end[-1] == '\r') end--;
+    *end = '\0';
+    char *p = frame;
+    size_t len;
+    view->mode = WIRE_TEXT;
+    view->type = strtoul(next_field(&p, end, &len), NULL, 10);
+    view->size = strtoul(next_field(&p, end, &len), NULL, 10);
+    view->source = next_field(&p, end, &view->source_len);
+    view->data = p;
+    view->data_len = end - p;
+    if (view->source_len >= MAX_NAME || view->data_len >= MAX_DATA) return -1;
+    return 1;
+}
+
+// Binary frame: the header says exactly how much follows, and the NULs after
+// source and data are already on the wire.
+static int next_binary(InBuf *in, MessageView *view) {
+    unsigned char *frame = (unsigned char *)in->buf + in->start;
+    size_t avail = in->end - in->start;
+    if (avail < WIRE_HEADER) return 0;
+    uint32_t data_len;
+    memcpy(&data_len, frame + 4, sizeof(data_len));
+    data_len = ntohl(data_len);
+    size_t source_len = frame[3];
+    if (frame[1] != WIRE_VERSION || source_len >= MAX_NAME || data_len >= MAX_DATA) return -1;
+    size_t total = WIRE_HEADER + source_len + 1 + data_len + 1;
+    if (avail < total) return 0;
+    char *source = (char *)frame + WIRE_HEADER;
+    char *data = source + source_len + 1;
+    if (source[source_len] != '\0' || data[data_len] != '\0') return -1;
+
+    view->mode = WIRE_BINARY;
+    view->type = frame[2];
+    view->size = data_len;
+    view->source = source;
+    view->source_len = source_len;
+    view->data = data;
+    view->data_len = data_len;
+    in->start += total;
+    in->scanned = 0;
+    return 1;
+}
+
+int inbuf_next(InBuf *in, MessageView *view) {
+    if (in->start == in->end) return 0;
+    if ((unsigned char)in->buf[in->start] == WIRE_MAGIC) return next_binary(in, view);
+    return next_text(in, view);
+}
+
+size_t encode_message(char *buffer, int mode, unsigned int type, const char *source, size_t source_len,
+                      const char *data, size_t data_len) {
+    if (source_len >= MAX_NAME) source_len = MAX_NAME - 1;
+    if (data_len >= MAX_DATA) data_len = MAX_DATA - 1;
+    if (mode == WIRE_TEXT) {
+        // A newline would end the frame early, so the data stops before it.
+        const char *nl = memchr(data, '\n', data_len);
+        if (nl) data_len = nl - data;
+        return snprintf(buffer, MAX_FRAME, "%u:%zu:%.*s:%.*s\n", type, data_len,
+                        (int)source_len, source, (int)data_len, data);
+    }
+
+    unsigned char *p = (unsigned char *)buffer;
+    uint32_t len = htonl(data_len);
+    p[0] = WIRE_MAGIC;
+    p[1] = WIRE_VERSION;
+    p[2] = type;
+    p[3] = source_len;
+    memcpy(p + 4, &len, sizeof(len));
+    memcpy(p + WIRE_HEADER, source, source_len);
+    p[WIRE_HEADER + source_len] = '\0';
+    memcpy(p + WIRE_HEADER + source_len + 1, data, data_len);
+    p[WIRE_HEADER + source_len + 1 + data_len] = '\0';
+    return WIRE_HEADER + source_len + 1 + data_len + 1;
+}
+
+size_t serialize_message(const Message *msg, char *buffer, int mode) {
+    const char *source = (const char *)msg->source, *data = (const char *)msg->data;
+    return encode_message(buffer, mode, msg->type, source, strnlen(source, MAX_NAME),
+                          data, strnlen(data, MAX_DATA));
+}
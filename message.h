@@ -0,0 +1,70 @@
+#ifndef MESSAGE_H
+#define MESSAGE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define MAX_NAME 50
+#define MAX_DATA 1024
+#define MAX_FRAME 2048         // Longest encoded message, header included
+#define INBUF_SIZE 8192        // Receive buffer per connection, several frames deep
+
+// Wire formats. A connection's first frame picks one and the server answers
+// in kind; text stays available for peers that only speak it.
+//
+// Text:   "<type>:<size>:<source>:<data>\n". Data cannot contain a newline;
+//         encoding cuts it short at the first one.
+// Binary: an 8-byte header, then the source and the data, each followed by a
+//         NUL byte that its length does not count:
+//             u8 WIRE_MAGIC, u8 WIRE_VERSION, u8 type, u8 source length,
+//             u32 data length (network order)
+//         Lengths are exact, so data may contain any byte.
+#define WIRE_TEXT 0
+#define WIRE_BINARY 1
+#define WIRE_MAGIC 0xC3        // Never the first byte of a text frame
+#define WIRE_VERSION 1
+#define WIRE_HEADER 8
+
+typedef struct {
+    unsigned int type;
+    unsigned int size;
+    unsigned char source[MAX_NAME];
+    unsigned char data[MAX_DATA];
+} Message;
+
+// A received message. source and data point into the input buffer (and are
+// NUL-terminated there), so they stay valid only until the next inbuf_fill().
+typedef struct {
+    int mode;                  // WIRE_TEXT or WIRE_BINARY, as it arrived
+    unsigned int type;
+    unsigned int size;
+    char *source;
+    size_t source_len;
+    char *data;
+    size_t data_len;
+} MessageView;
+
+// Bytes received on a connection but not yet parsed. Reads go to the free
+// space at the end; unread bytes move back to the front when it runs out, so
+// a frame is always contiguous.
+typedef struct {
+    size_t start;              // First unread byte
+    size_t end;                // One past the last received byte
+    size_t scanned;            // Bytes from start already searched for a frame end
+    char buf[INBUF_SIZE];
+} InBuf;
+
+void inbuf_init(InBuf *in);
+// One recv() into the free space. Returns what recv() returned.
+ssize_t inbuf_fill(InBuf *in, int sockfd);
+// Parse the next complete frame into view. Returns 1 for a frame, 0 if more
+// bytes are needed and -1 if the peer sent something that is not a frame.
+int inbuf_next(InBuf *in, MessageView *view);
+
+// Encode a message in the given wire format into buffer (at least MAX_FRAME
+// bytes). Returns its length.
+size_t encode_message(char *buffer, int mode, unsigned int type, const char *source, size_t source_len,
+                      const char *data, size_t data_len);
+size_t serialize_message(const Message *msg, char *buffer, int mode);
+
+#endif
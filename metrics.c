@@ -0,0 +1,93 @@
+#define _GNU_SOURCE
+#include <time.h>
+#include "metrics.h"
+
+uint64_t metrics_now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+void hist_record(Histogram *h, uint64_t ns) {
+    uint64_t us = ns / 1000;
+    int bucket = us ? 64 - __builtin_clzll(us) : 0;
+    if (bucket >= HIST_BUCKETS) bucket = HIST_BUCKETS - 1;
+    STAT_ADD(h->buckets[bucket], 1);
+    STAT_ADD(h->count, 1);
+    STAT_ADD(h->sum_ns, ns);
+}
+
+void hist_read(const Histogram *h, Histogram *sum) {
+    for (int i = 0; i < HIST_BUCKETS; i++) sum->buckets[i] += STAT_GET(h->buckets[i]);
+    sum->count += STAT_GET(h->count);
+    sum->sum_ns += STAT_GET(h->sum_ns);
+}
+
+void statlock_init(StatLock *l) {
+    pthread_mutex_init(&l->mutex, NULL);
+    l->locked_at = 0;
+    l->stats = (LockStats){ 0, 0, 0, 0 };
+}
+
+// Uncontended, this costs one clock read more than a plain mutex.
+void statlock_lock(StatLock *l) {
+    if (pthread_mutex_trylock(&l->mutex) == 0) {
+        l->locked_at = metrics_now();
+    } else {
+        uint64_t start = metrics_now();
+        pthread_mutex_lock(&l->mutex);
+        l->locked_at = metrics_now();
+        STAT_ADD(l->stats.contended, 1);
+        STAT_ADD(l->stats.wait_ns, l->locked_at - start);
+    }
+    STAT_ADD(l->stats.acquired, 1);
+}
+
+void statlock_unlock(StatLock *l) {
+    STAT_ADD(l->stats.hold_ns, metrics_now() - l->locked_at);
+    pthread_mutex_unlock(&l->mutex);
+}
+
+void statlock_read(const StatLock *l, LockStats *sum) {
+    sum->acquired += STAT_GET(l->stats.acquired);
+    sum->contended += STAT_GET(l->stats.contended);
+    sum->wait_ns += STAT_GET(l->stats.wait_ns);
+    sum->hold_ns += STAT_GET(l->stats.hold_ns);
+}
+
+void metrics_write_hist(FILE *out, const char *name, const char *help, const Histogram *h) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    unsigned long long cumulative = 0;
+    for (int i = 0; i < HIST_BUCKETS - 1; i++) {
+        cumulative += h->buckets[i];
+        fprintf(out, "%s_bucket{le=\"%g\"} %llu\n", name, (double)(1ull << i) / 1e6, cumulative);
+    }
+    // Counted from the buckets, so the total agrees with them even if a
+    // writer moved on while they were read.
+    cumulative += h->buckets[HIST_BUCKETS - 1];
+    fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", name, cumulative);
+    fprintf(out, "%s_sum %.9f\n%s_count %llu\n", name, h->sum_ns / 1e9, name, cumulative);
+}
+
+void metrics_write_locks(FILE *out, const char *const names[], const LockStats stats[], int n) {
+    fprintf(out, "# HELP chat_lock_acquired_total Times the lock was taken.\n"
+                 "# TYPE chat_lock_acquired_total counter\n");
+    for (int i = 0; i < n; i++) {
+        fprintf(out, "chat_lock_acquired_total{lock=\"%s\"} %llu\n", names[i], stats[i].acquired);
+    }
+    fprintf(out, "# HELP chat_lock_contended_total Times the lock was taken after waiting for it.\n"
+                 "# TYPE chat_lock_contended_total counter\n");
+    for (int i = 0; i < n; i++) {
+        fprintf(out, "chat_lock_contended_total{lock=\"%s\"} %llu\n", names[i], stats[i].contended);
+    }
+    fprintf(out, "# HELP chat_lock_wait_seconds_total Time spent waiting for the lock.\n"
+                 "# TYPE chat_lock_wait_seconds_total counter\n");
+    for (int i = 0; i < n; i++) {
+        fprintf(out, "chat_lock_wait_seconds_total{lock=\"%s\"} %.9f\n", names[i], stats[i].wait_ns / 1e9);
+    }
+    fprintf(out, "# HELP chat_lock_hold_seconds_total Time the lock was held.\n"
+                 "# TYPE chat_lock_hold_seconds_total counter\n");
+    for (int i = 0; i < n; i++) {
+        fprintf(out, "chat_lock_hold_seconds_total{lock=\"%s\"} %.9f\n", names[i], stats[i].hold_ns / 1e9);
+    }
+}
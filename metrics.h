@@ -0,0 +1,57 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// Counters and histograms cheap enough for the hot path. Each has a single
+// writing thread, or is written only under one lock, so updates are plain
+// stores; a scrape from another thread reads them without stopping anyone.
+#define STAT_ADD(counter, n) __atomic_store_n(&(counter), (counter) + (n), __ATOMIC_RELAXED)
+#define STAT_GET(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+// Durations in buckets of 1us << k, k = 0 .. HIST_BUCKETS - 2; the last one
+// holds everything longer (about a second and up).
+#define HIST_BUCKETS 22
+
+typedef struct {
+    unsigned long long buckets[HIST_BUCKETS];
+    unsigned long long count;
+    unsigned long long sum_ns;
+} Histogram;
+
+// A mutex that keeps how long it was waited for and held. The counts are
+// written only by the holder.
+typedef struct {
+    unsigned long long acquired;
+    unsigned long long contended;  // Acquisitions that had to wait
+    unsigned long long wait_ns;
+    unsigned long long hold_ns;
+} LockStats;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    uint64_t locked_at;
+    LockStats stats;
+} StatLock;
+
+#define STATLOCK_INITIALIZER { PTHREAD_MUTEX_INITIALIZER, 0, { 0, 0, 0, 0 } }
+
+uint64_t metrics_now(void);    // Monotonic nanoseconds
+
+void hist_record(Histogram *h, uint64_t ns);
+// Add a snapshot of h into sum.
+void hist_read(const Histogram *h, Histogram *sum);
+
+void statlock_init(StatLock *l);
+void statlock_lock(StatLock *l);
+void statlock_unlock(StatLock *l);
+// Add a snapshot of l's counts into sum.
+void statlock_read(const StatLock *l, LockStats *sum);
+
+// Prometheus text format.
+void metrics_write_hist(FILE *out, const char *name, const char *help, const Histogram *h);
+void metrics_write_locks(FILE *out, const char *const names[], const LockStats stats[], int n);
+
+#endif
@@ -0,0 +1,49 @@
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <sched.h>
+#include "mpsc.h"
+
+void mpsc_init(Mpsc *q) {
+    q->stub.next = NULL;
+    q->head = q->tail = &q->stub;
+}
+
+void mpsc_push(Mpsc *q, MpscNode *node) {
+    node->next = NULL;
+    MpscNode *prev = __atomic_exchange_n(&q->head, node, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+// A producer has swapped in node as head but not linked it yet; that takes a
+// few instructions unless it was preempted in between.
+static MpscNode *wait_next(MpscNode *node) {
+    MpscNode *next;
+    while (!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE))) sched_yield();
+    return next;
+}
+
+MpscNode *mpsc_pop(Mpsc *q) {
+    MpscNode *tail = q->tail;
+    MpscNode *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (tail == &q->stub) {
+        if (!next) {
+            if (__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == &q->stub) return NULL;
+            next = wait_next(tail);
+        }
+        q->tail = next;
+        tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+    if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)) {
+        q->tail = wait_next(tail);
+        return tail;
+    }
+    // tail is the only node: put the stub behind it so it can be unlinked.
+    mpsc_push(q, &q->stub);
+    q->tail = wait_next(tail);
+    return tail;
+}
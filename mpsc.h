@@ -0,0 +1,22 @@
+#ifndef MPSC_H
+#define MPSC_H
+
+// Lock-free multi-producer, single-consumer FIFO of intrusive nodes. Any
+// thread may push; only the owning thread pops. Items from one producer come
+// out in the order it pushed them.
+typedef struct MpscNode {
+    struct MpscNode *next;
+} MpscNode;
+
+typedef struct {
+    MpscNode *head;            // Last pushed (producers)
+    MpscNode *tail;            // Next to pop (consumer)
+    MpscNode stub;
+} Mpsc;
+
+void mpsc_init(Mpsc *q);
+void mpsc_push(Mpsc *q, MpscNode *node);
+// The oldest node, NULL if the queue is empty.
+MpscNode *mpsc_pop(Mpsc *q);
+
+#endif
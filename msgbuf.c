@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "msgbuf.h"
+
+// One free list per size class, shared by all threads. Buffers come from
+// slabs that are never given back. Each thread also keeps its own free list
+// per class, and takes from or gives back to the shared one MSGBUF_BATCH at
+// a time, so most allocations and releases take no lock at all.
+typedef struct {
+    pthread_mutex_t mutex;
+    MsgBuf *free;
+} Pool;
+
+typedef struct {
+    MsgBuf *free;
+    int count;
+} Cache;
+
+static Pool pools[MSGBUF_CLASSES] = {
+    { PTHREAD_MUTEX_INITIALIZER, NULL },
+    { PTHREAD_MUTEX_INITIALIZER, NULL },
+    { PTHREAD_MUTEX_INITIALIZER, NULL },
+    { PTHREAD_MUTEX_INITIALIZER, NULL },
+};
+
+static __thread Cache caches[MSGBUF_CLASSES];
+static __thread int cache_in_use;
+
+// Set in each thread that uses its cache, so it is emptied when the thread
+// exits.
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+static size_t class_capacity(int size_class) {
+    return (size_t)64 << (2 * size_class);
+}
+
+// Carve a new slab into buffers for the pool. Called with its mutex held.
+static int refill(Pool *pool, int size_class) {
+    size_t stride = sizeof(MsgBuf) + class_capacity(size_class);
+    char *slab = malloc(stride * MSGBUF_SLAB);
+    if (!slab) return -1;
+    for (int i = 0; i < MSGBUF_SLAB; i++) {
+        MsgBuf *buf = (MsgBuf *)(slab + i * stride);
+        buf->size_class = size_class;
+        buf->next = pool->free;
+        pool->free = buf;
+    }
+    return 0;
+}
+
+// Move count buffers from the thread's cache back to their pool.
+static void give_back(int size_class, int count) {
+    Cache *cache = &caches[size_class];
+    Pool *pool = &pools[size_class];
+    MsgBuf *first = cache->free, *last = first;
+    for (int i = 1; i < count; i++) last = last->next;
+    cache->free = last->next;
+    cache->count -= count;
+    pthread_mutex_lock(&pool->mutex);
+    last->next = pool->free;
+    pool->free = first;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+static void empty_caches(void *arg) {
+    (void)arg;
+    for (int size_class = 0; size_class < MSGBUF_CLASSES; size_class++) {
+        if (caches[size_class].count > 0) give_back(size_class, caches[size_class].count);
+    }
+}
+
+static void make_cache_key(void) {
+    if (pthread_key_create(&cache_key, empty_caches) != 0) {
+        perror("pthread_key_create");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void use_cache(void) {
+    pthread_once(&cache_key_once, make_cache_key);
+    pthread_setspecific(cache_key, caches);
+    cache_in_use = 1;
+}
+
+// Fill the thread's empty cache with a batch from the pool. Returns -1 if
+// memory ran out.
+static int take_batch(int size_class) {
+    Cache *cache = &caches[size_class];
+    Pool *pool = &pools[size_class];
+    if (!cache_in_use) use_cache();
+    pthread_mutex_lock(&pool->mutex);
+    while (cache->count < MSGBUF_BATCH) {
+        if (!pool->free && refill(pool, size_class) < 0) break;
+        MsgBuf *buf = pool->free;
+        pool->free = buf->next;
+        buf->next = cache->free;
+        cache->free = buf;
+        cache->count++;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return cache->free ? 0 : -1;
+}
+
+MsgBuf *msgbuf_alloc(size_t len) {
+    int size_class = 0;
+    while (size_class < MSGBUF_CLASSES && class_capacity(size_class) < len) size_class++;
+    if (size_class == MSGBUF_CLASSES) return NULL;
+
+    Cache *cache = &caches[size_class];
+    if (!cache->free && take_batch(size_class) < 0) return NULL;
+    MsgBuf *buf = cache->free;
+    cache->free = buf->next;
+    cache->count--;
+
+    buf->refs = 1;
+    buf->len = len;
+    return buf;
+}
+
+MsgBuf *msgbuf_copy(const char *frame, size_t len) {
+    MsgBuf *buf = msgbuf_alloc(len);
+    if (buf) memcpy(buf->data, frame, len);
+    return buf;
+}
+
+void msgbuf_ref(MsgBuf *buf) {
+    __atomic_add_fetch(&buf->refs, 1, __ATOMIC_RELAXED);
+}
+
+void msgbuf_unref(MsgBuf *buf) {
+    if (__atomic_sub_fetch(&buf->refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+    // Into this thread's cache, whichever thread allocated it. Past two
+    // batches, one goes back to the pool for the others.
+    if (!cache_in_use) use_cache();
+    Cache *cache = &caches[buf->size_class];
+    buf->next = cache->free;
+    cache->free = buf;
+    if (++cache->count > 2 * MSGBUF_BATCH) give_back(buf->size_class, MSGBUF_BATCH);
+}
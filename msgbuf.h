@@ -0,0 +1,29 @@
+#ifndef MSGBUF_H
+#define MSGBUF_H
+
+#include <stddef.h>
+
+// An encoded frame shared by every queue it is sent on. It is filled once,
+// right after msgbuf_alloc(), and never written again; the last
+// msgbuf_unref() returns it to its pool.
+typedef struct MsgBuf {
+    int refs;                  // Atomic
+    int size_class;
+    size_t len;
+    struct MsgBuf *next;       // Link in its pool's free list
+    char data[];
+} MsgBuf;
+
+#define MSGBUF_CLASSES 4       // Capacities 64, 256, 1024 and 4096 bytes
+#define MSGBUF_SLAB 64         // Buffers carved from each allocation of a pool
+#define MSGBUF_BATCH 32        // Buffers moved between a thread's cache and its pool at once
+
+// A buffer of at least len bytes holding one reference, with len set. NULL if
+// len is too large or memory ran out.
+MsgBuf *msgbuf_alloc(size_t len);
+// A buffer holding a copy of frame.
+MsgBuf *msgbuf_copy(const char *frame, size_t len);
+void msgbuf_ref(MsgBuf *buf);
+void msgbuf_unref(MsgBuf *buf);
+
+#endif
@@ -0,0 +1,508 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include "msglog.h"
+
+// A message on its way to the log thread.
+typedef struct {
+    MpscNode node;
+    MsgBuf *frame;
+    LogPosition pos;           // Where it was written
+    char session_id[MAX_NAME];
+} LogRecord;
+
+// A compacted record's new place, applied to the index once it is synced.
+typedef struct {
+    LogPosition *slot;
+    LogPosition pos;
+} LogMove;
+
+#define HISTORY_ATTEMPTS 3     // Reads of a session's history that may race compaction
+
+static uint32_t checksum(const char *p, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void segment_path(const MsgLog *log, uint32_t segment, char *path, size_t size) {
+    snprintf(path, size, "%s/%08u.log", log->dir, segment);
+}
+
+// The record at offset in a segment of size bytes. Fills in its session and
+// frame and returns its length, 0 if no whole, intact record is there.
+static size_t parse_record(const char *base, size_t size, size_t offset, char *session_id,
+                           const char **frame, size_t *frame_len) {
+    LogHeader h;
+    if (size - offset < sizeof(h)) return 0;
+    memcpy(&h, base + offset, sizeof(h));
+    if (h.len < 1 || h.len > size - offset - sizeof(h)) return 0;
+    const char *p = base + offset + sizeof(h);
+    if (checksum(p, h.len) != h.check) return 0;
+    size_t name_len = (unsigned char)p[0];
+    if (name_len >= MAX_NAME || 1 + name_len > h.len || h.len - 1 - name_len > MAX_FRAME) return 0;
+    memcpy(session_id, p + 1, name_len);
+    session_id[name_len] = '\0';
+    *frame = p + 1 + name_len;
+    *frame_len = h.len - 1 - name_len;
+    return sizeof(h) + h.len;
+}
+
+// Map a segment read-only. NULL if it is missing or empty.
+static char *map_segment(const MsgLog *log, uint32_t segment, size_t *size) {
+    char path[PATH_MAX];
+    segment_path(log, segment, path, sizeof(path));
+    *size = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    char *base = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (base == MAP_FAILED) {
+            perror("mmap");
+            base = NULL;
+        } else {
+            *size = st.st_size;
+        }
+    }
+    close(fd);
+    return base;
+}
+
+// The index entry for a session, made if create is set and there is room.
+// Called with log->lock held.
+static LogSession *find_indexed(MsgLog *log, const char *session_id, int create) {
+    int handle = registry_find(&log->session_registry, session_id);
+    if (handle >= 0) return slab_get(&log->sessions, handle);
+    if (!create) return NULL;
+    handle = slab_alloc(&log->sessions);
+    if (handle < 0) return NULL;
+    LogSession *s = slab_get(&log->sessions, handle);
+    if (!s->latest) {
+        s->latest = malloc(log->keep_per_session * sizeof(LogPosition));
+        if (!s->latest) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    strcpy(s->session_id, session_id);
+    s->handle = handle;
+    s->start = s->count = 0;
+    registry_insert(&log->session_registry, s->session_id, handle);
+    return s;
+}
+
+// Make pos the latest record of its session. Called with log->lock held.
+static void index_record(MsgLog *log, const char *session_id, LogPosition pos) {
+    if (log->keep_per_session == 0) return;
+    LogSession *s = find_indexed(log, session_id, 1);
+    if (!s) return;
+    if (s->count == log->keep_per_session) {
+        s->start = (s->start + 1) % log->keep_per_session;
+        s->count--;
+    }
+    s->latest[(s->start + s->count) % log->keep_per_session] = pos;
+    s->count++;
+}
+
+// The index slot still pointing at pos, NULL if its session has moved on.
+// Called with log->lock held.
+static LogPosition *indexed_at(MsgLog *log, const char *session_id, LogPosition pos) {
+    LogSession *s = find_indexed(log, session_id, 0);
+    for (int i = 0; s && i < s->count; i++) {
+        LogPosition *slot = &s->latest[(s->start + i) % log->keep_per_session];
+        if (slot->segment == pos.segment && slot->offset == pos.offset) return slot;
+    }
+    return NULL;
+}
+
+static void flush_batch(MsgLog *log) {
+    size_t done = 0;
+    while (done < log->batch_len) {
+        ssize_t n = write(log->fd, log->batch + done, log->batch_len - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("write log");
+            exit(EXIT_FAILURE);
+        }
+        done += n;
+    }
+    log->batch_len = 0;
+}
+
+// Write out the batch and make everything written so far durable.
+static void commit(MsgLog *log) {
+    flush_batch(log);
+    if (fdatasync(log->fd) < 0) {
+        perror("fdatasync");
+        exit(EXIT_FAILURE);
+    }
+    STAT_ADD(log->commits, 1);
+}
+
+static void open_segment(MsgLog *log, uint32_t segment) {
+    char path[PATH_MAX];
+    segment_path(log, segment, path, sizeof(path));
+    log->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (log->fd < 0) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    log->segment = segment;
+    log->size = 0;
+    // The new name is durable too, not just what is written under it.
+    int dir_fd = open(log->dir, O_RDONLY | O_DIRECTORY);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+}
+
+// Add a record to the batch, moving to a new segment first if this one is
+// full. Returns where it goes.
+static LogPosition append_record(MsgLog *log, const char *session_id, const char *frame, size_t frame_len) {
+    size_t name_len = strlen(session_id);
+    LogHeader h = { 1 + name_len + frame_len, 0 };
+    size_t total = sizeof(h) + h.len;
+    if (log->size > 0 && log->size + total > log->segment_bytes) {
+        commit(log);
+        close(log->fd);
+        open_segment(log, log->segment + 1);
+    }
+    if (log->batch_len + total > LOG_BATCH_BYTES) flush_batch(log);
+
+    char *p = log->batch + log->batch_len;
+    p[sizeof(h)] = name_len;
+    memcpy(p + sizeof(h) + 1, session_id, name_len);
+    memcpy(p + sizeof(h) + 1 + name_len, frame, frame_len);
+    h.check = checksum(p + sizeof(h), h.len);
+    memcpy(p, &h, sizeof(h));
+
+    LogPosition pos = { log->segment, log->size };
+    log->batch_len += total;
+    log->size += total;
+    STAT_ADD(log->bytes, total);
+    return pos;
+}
+
+// Delete the oldest segment, copying forward the records the index still
+// points at.
+static void compact_oldest(MsgLog *log) {
+    uint32_t segment = log->first;
+    size_t size, n;
+    char *base = map_segment(log, segment, &size);
+    LogMove *moves = NULL;
+    int num_moves = 0, moves_cap = 0;
+    for (size_t offset = 0; base && offset < size; offset += n) {
+        char session_id[MAX_NAME];
+        const char *frame;
+        size_t frame_len;
+        n = parse_record(base, size, offset, session_id, &frame, &frame_len);
+        if (n == 0) break;
+        LogPosition old = { segment, offset };
+        statlock_lock(&log->lock);
+        LogPosition *slot = indexed_at(log, session_id, old);
+        statlock_unlock(&log->lock);
+        if (!slot) continue;
+        if (num_moves == moves_cap) {
+            moves_cap = moves_cap ? 2 * moves_cap : 64;
+            moves = realloc(moves, moves_cap * sizeof(LogMove));
+            if (!moves) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        // Only this thread changes the index, so the slot stays put.
+        moves[num_moves++] = (LogMove){ slot, append_record(log, session_id, frame, frame_len) };
+    }
+    if (base) munmap(base, size);
+    if (num_moves > 0) commit(log);
+
+    char path[PATH_MAX];
+    segment_path(log, segment, path, sizeof(path));
+    statlock_lock(&log->lock);
+    for (int i = 0; i < num_moves; i++) *moves[i].slot = moves[i].pos;
+    unlink(path);
+    log->first = segment + 1;
+    statlock_unlock(&log->lock);
+    STAT_ADD(log->compacted, num_moves);
+    free(moves);
+}
+
+static void *log_main(void *arg) {
+    MsgLog *log = arg;
+    struct pollfd pfd = { log->event_fd, POLLIN, 0 };
+    int more = 0, unsynced = 0;
+    uint64_t synced_at = 0;
+    while (1) {
+        // A record pushed as the queue was drained is picked up within
+        // LOG_COMMIT_MS even if its eventfd write was skipped. Written
+        // records wait at most LOG_SYNC_MS for their sync.
+        int timeout = LOG_COMMIT_MS;
+        if (unsynced) {
+            uint64_t since = (metrics_now() - synced_at) / 1000000;
+            timeout = since >= LOG_SYNC_MS ? 0 : LOG_SYNC_MS - since;
+        }
+        if (!more && poll(&pfd, 1, timeout) < 0 && errno != EINTR) {
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+        if (__atomic_load_n(&log->signaled, __ATOMIC_RELAXED)) {
+            uint64_t count;
+            if (read(log->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                perror("read eventfd");
+                exit(EXIT_FAILURE);
+            }
+            __atomic_store_n(&log->signaled, 0, __ATOMIC_SEQ_CST);
+        }
+        // Read before the queue, which then holds every record there will be.
+        int closing = __atomic_load_n(&log->closing, __ATOMIC_ACQUIRE);
+
+        // Everything queued is written at once, up to a batch's worth so
+        // the index keeps up under a steady stream.
+        LogRecord *head = NULL, *tail = NULL, *r;
+        unsigned long long bytes = log->bytes;
+        more = 0;
+        while ((r = (LogRecord *)mpsc_pop(&log->queue))) {
+            r->pos = append_record(log, r->session_id, r->frame->data, r->frame->len);
+            msgbuf_unref(r->frame);
+            r->node.next = NULL;
+            if (tail) {
+                tail->node.next = &r->node;
+            } else {
+                head = r;
+            }
+            tail = r;
+            if (log->bytes - bytes >= LOG_BATCH_BYTES) {
+                more = 1;
+                break;
+            }
+        }
+        if (head) {
+            flush_batch(log);
+            unsynced = 1;
+        }
+        // One sync covers every record written since the last, however
+        // many batches that was.
+        if (unsynced && (closing || metrics_now() - synced_at >= (uint64_t)LOG_SYNC_MS * 1000000)) {
+            commit(log);
+            synced_at = metrics_now();
+            unsynced = 0;
+        }
+        if (closing && !head) break;
+        if (!head) continue;
+
+        // Readable from the file now, if not yet synced.
+        int n = 0;
+        statlock_lock(&log->lock);
+        for (r = head; r; r = (LogRecord *)r->node.next) {
+            index_record(log, r->session_id, r->pos);
+            n++;
+        }
+        statlock_unlock(&log->lock);
+        while (head) {
+            r = head;
+            head = (LogRecord *)r->node.next;
+            free(r);
+        }
+        STAT_ADD(log->appended, n);
+
+        // Only those past the limit now; what compacting them copies forward
+        // waits for the next round.
+        uint32_t segments = log->segment - log->first + 1;
+        for (uint32_t i = log->keep_segments; i < segments; i++) compact_oldest(log);
+    }
+    close(log->fd);
+    return NULL;
+}
+
+// Index the records of every segment already on disk, oldest first.
+static void replay(MsgLog *log, uint32_t first, uint32_t last) {
+    for (uint32_t segment = first; segment <= last; segment++) {
+        size_t size, offset = 0, n;
+        char *base = map_segment(log, segment, &size);
+        if (!base) continue;
+        for (; offset < size; offset += n) {
+            char session_id[MAX_NAME];
+            const char *frame;
+            size_t frame_len;
+            n = parse_record(base, size, offset, session_id, &frame, &frame_len);
+            if (n == 0) break;
+            index_record(log, session_id, (LogPosition){ segment, offset });
+        }
+        munmap(base, size);
+        if (offset < size) {
+            // Torn by a crash: nothing after it was acknowledged as synced.
+            char path[PATH_MAX];
+            segment_path(log, segment, path, sizeof(path));
+            if (truncate(path, offset) < 0) perror("truncate");
+        }
+    }
+}
+
+void msglog_open(MsgLog *log, const char *dir, int keep_segments, int keep_per_session, int max_sessions) {
+    log->dir = dir;
+    log->segment_bytes = LOG_SEGMENT_BYTES;
+    log->keep_segments = keep_segments;
+    log->keep_per_session = keep_per_session;
+    log->appended = log->commits = log->bytes = log->compacted = 0;
+    statlock_init(&log->lock);
+    slab_init(&log->sessions, sizeof(LogSession), max_sessions, NULL);
+    registry_init(&log->session_registry, SLAB_OBJECTS);
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        perror(dir);
+        exit(EXIT_FAILURE);
+    }
+    DIR *d = opendir(dir);
+    if (!d) {
+        perror(dir);
+        exit(EXIT_FAILURE);
+    }
+    uint32_t first = UINT32_MAX, last = 0;
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        unsigned int segment;
+        char end;
+        if (strlen(e->d_name) != 12 || sscanf(e->d_name, "%8u.lo%c", &segment, &end) != 2 || end != 'g') continue;
+        if (segment < first) first = segment;
+        if (segment > last) last = segment;
+    }
+    closedir(d);
+
+    if (first == UINT32_MAX) {
+        log->first = 0;
+        open_segment(log, 0);
+    } else {
+        replay(log, first, last);
+        log->first = first;
+        open_segment(log, last + 1);
+    }
+
+    log->batch = malloc(LOG_BATCH_BYTES);
+    if (!log->batch) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    log->batch_len = 0;
+    mpsc_init(&log->queue);
+    log->signaled = 0;
+    log->closing = 0;
+    log->event_fd = eventfd(0, EFD_NONBLOCK);
+    if (log->event_fd < 0) {
+        perror("eventfd");
+        exit(EXIT_FAILURE);
+    }
+    if (pthread_create(&log->thread, NULL, log_main, log) != 0) {
+        perror("could not create log thread");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void msglog_append(MsgLog *log, const char *session_id, MsgBuf *frame) {
+    LogRecord *r = malloc(sizeof(LogRecord));
+    if (!r) return;
+    r->frame = frame;
+    msgbuf_ref(frame);
+    strcpy(r->session_id, session_id);
+    mpsc_push(&log->queue, &r->node);
+    if (__atomic_exchange_n(&log->signaled, 1, __ATOMIC_SEQ_CST) == 0) {
+        uint64_t one = 1;
+        if (write(log->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            perror("write eventfd");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// Map the segments holding records pos[0..n), each once for every run of
+// records in it. Returns how many are in a segment that is gone.
+static int map_records(const MsgLog *log, const LogPosition *pos, int n, char **bases, size_t *sizes) {
+    int missing = 0;
+    for (int i = 0; i < n; i++) {
+        if (i > 0 && pos[i].segment == pos[i - 1].segment) {
+            bases[i] = bases[i - 1];
+            sizes[i] = sizes[i - 1];
+        } else {
+            bases[i] = map_segment(log, pos[i].segment, &sizes[i]);
+        }
+        if (!bases[i]) missing++;
+    }
+    return missing;
+}
+
+static void unmap_records(char **bases, const size_t *sizes, int n) {
+    for (int i = 0; i < n; i++) {
+        if (bases[i] && (i == 0 || bases[i] != bases[i - 1])) munmap(bases[i], sizes[i]);
+    }
+}
+
+int msglog_history(MsgLog *log, const char *session_id, int max,
+                   void (*fn)(void *arg, const char *frame, size_t len), void *arg) {
+    if (max > log->keep_per_session) max = log->keep_per_session;
+    if (max <= 0) return 0;
+    LogPosition *pos = malloc(max * sizeof(LogPosition));
+    char **bases = malloc(max * sizeof(char *));
+    size_t *sizes = malloc(max * sizeof(size_t));
+    if (!pos || !bases || !sizes) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    // Only the positions are copied under the lock, so appends are not held
+    // up while the records are read. A segment compacted away in between
+    // had its records copied forward, and the index now says where.
+    int n = 0;
+    for (int attempt = 1; ; attempt++) {
+        statlock_lock(&log->lock);
+        LogSession *s = find_indexed(log, session_id, 0);
+        n = s ? (s->count < max ? s->count : max) : 0;
+        for (int i = 0; i < n; i++) {
+            pos[i] = s->latest[(s->start + s->count - n + i) % log->keep_per_session];
+        }
+        statlock_unlock(&log->lock);
+        if (map_records(log, pos, n, bases, sizes) == 0 || attempt == HISTORY_ATTEMPTS) break;
+        unmap_records(bases, sizes, n);
+    }
+
+    int found = 0;
+    for (int i = 0; i < n; i++) {
+        char name[MAX_NAME];
+        const char *frame;
+        size_t frame_len;
+        if (!bases[i] || pos[i].offset >= sizes[i]) continue;
+        if (parse_record(bases[i], sizes[i], pos[i].offset, name, &frame, &frame_len) == 0) continue;
+        fn(arg, frame, frame_len);
+        found++;
+    }
+    unmap_records(bases, sizes, n);
+    free(pos);
+    free(bases);
+    free(sizes);
+    return found;
+}
+
+void msglog_close(MsgLog *log) {
+    __atomic_store_n(&log->closing, 1, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    if (write(log->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("write eventfd");
+        exit(EXIT_FAILURE);
+    }
+    pthread_join(log->thread, NULL);
+    close(log->event_fd);
+    free(log->batch);
+}
@@ -0,0 +1,97 @@
+#ifndef MSGLOG_H
+#define MSGLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "message.h"
+#include "msgbuf.h"
+#include "mpsc.h"
+#include "registry.h"
+#include "slab.h"
+#include "metrics.h"
+
+// An append-only log of chat messages on disk, shared by all sessions and
+// split into numbered segment files in one directory. msglog_append() only
+// queues a message; the log's own thread writes whatever has queued up and
+// syncs the file at most every LOG_SYNC_MS, once for all it wrote meanwhile
+// (group commit). A message costs a copy and a queue push, not an fsync, and
+// is on disk within LOG_SYNC_MS of being written.
+//
+// A record is a LogHeader followed by the session name's length (one byte),
+// the name and the message's binary wire frame. Segments are read back by
+// mapping them, at startup to rebuild the index, for a session's history and
+// when old ones are compacted.
+//
+// Retention keeps the newest keep_segments segments. Before the oldest is
+// deleted, the records still among the latest keep_per_session of their
+// session are copied forward, so those survive however old they are.
+#define LOG_SEGMENT_BYTES (64 << 20) // A new segment is started past this
+#define LOG_BATCH_BYTES (1 << 20)    // Records written with one write()
+#define LOG_COMMIT_MS 100            // Longest a queued record waits to be written
+#define LOG_SYNC_MS 10               // Least time between syncs
+
+typedef struct {
+    uint32_t len;              // Bytes after the header
+    uint32_t check;            // FNV-1a of those bytes
+} LogHeader;
+
+typedef struct {
+    uint32_t segment;
+    uint32_t offset;           // Of the record's header
+} LogPosition;
+
+// Where the latest records of one session are, for msglog_history().
+typedef struct {
+    char session_id[MAX_NAME]; // Empty while the slot is free
+    int handle;
+    LogPosition *latest;       // Ring of keep_per_session, oldest at start
+    int start;
+    int count;
+} LogSession;
+
+typedef struct {
+    const char *dir;
+    size_t segment_bytes;
+    int keep_segments;
+    int keep_per_session;
+    pthread_t thread;
+    Mpsc queue;                // Records waiting to be written
+    int event_fd;
+    int signaled;              // event_fd written and not yet drained (atomic)
+    int closing;               // Set by msglog_close() (atomic)
+    // The log thread's own
+    int fd;                    // Segment being written
+    uint32_t segment;
+    uint32_t first;            // Oldest segment on disk
+    size_t size;               // Of the segment being written, batch included
+    char *batch;
+    size_t batch_len;
+    // The index, against shards reading history
+    StatLock lock;
+    Slab sessions;
+    Registry session_registry;
+    // Written by the log thread only (metrics.h)
+    unsigned long long appended;
+    unsigned long long commits;    // fdatasync() calls
+    unsigned long long bytes;
+    unsigned long long compacted;  // Records copied forward before deletion
+} MsgLog;
+
+// Open the log in dir, replaying the segments already there into the index,
+// and start its thread. A record torn by a crash ends its segment there.
+void msglog_open(MsgLog *log, const char *dir, int keep_segments, int keep_per_session, int max_sessions);
+// Queue frame, a chat message in the binary wire format, as said in
+// session_id. Takes a reference to frame.
+void msglog_append(MsgLog *log, const char *session_id, MsgBuf *frame);
+// Call fn with up to max of the latest frames logged for session_id, oldest
+// first. The records are read after the index lock is released, so a long
+// read does not hold up the log thread. Returns how many there were.
+int msglog_history(MsgLog *log, const char *session_id, int max,
+                   void (*fn)(void *arg, const char *frame, size_t len), void *arg);
+// Write and sync everything queued, then stop the log's thread and close its
+// segment, leaving the directory for another process to open. Nothing may be
+// appended meanwhile. The index stays readable.
+void msglog_close(MsgLog *log);
+
+#endif
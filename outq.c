@@ -0,0 +1,127 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "outq.h"
+
+void outq_init(OutQueue *q, int limit) {
+    pthread_mutex_init(&q->mutex, NULL);
+    q->ring = calloc(limit, sizeof(MsgBuf *));
+    if (!q->ring) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    q->limit = limit;
+    q->head = q->count = 0;
+    q->offset = 0;
+    q->dropped = 0;
+    q->closed = 0;
+}
+
+void outq_destroy(OutQueue *q) {
+    for (int i = 0; i < q->count; i++) msgbuf_unref(q->ring[(q->head + i) % q->limit]);
+    free(q->ring);
+    pthread_mutex_destroy(&q->mutex);
+}
+
+// Discard the oldest frame that has not been partly written; a partial one
+// has to finish or the stream loses its framing.
+static void drop_oldest(OutQueue *q) {
+    int victim = q->head;
+    if (q->offset > 0) {
+        if (q->count < 2) return;
+        victim = (q->head + 1) % q->limit;
+        msgbuf_unref(q->ring[victim]);
+        q->ring[victim] = q->ring[q->head];
+    } else {
+        msgbuf_unref(q->ring[victim]);
+        q->offset = 0;
+    }
+    q->head = (q->head + 1) % q->limit;
+    q->count--;
+    q->dropped++;
+}
+
+static int flush_locked(OutQueue *q, int fd) {
+    while (q->count > 0) {
+        struct iovec iov[OUTQ_IOV];
+        int n = q->count < OUTQ_IOV ? q->count : OUTQ_IOV;
+        for (int i = 0; i < n; i++) {
+            MsgBuf *f = q->ring[(q->head + i) % q->limit];
+            iov[i].iov_base = f->data;
+            iov[i].iov_len = f->len;
+        }
+        iov[0].iov_base = (char *)iov[0].iov_base + q->offset;
+        iov[0].iov_len -= q->offset;
+
+        // sendmsg rather than writev: only it takes MSG_NOSIGNAL.
+        struct msghdr mh = { .msg_iov = iov, .msg_iovlen = n };
+        ssize_t rc = sendmsg(fd, &mh, MSG_NOSIGNAL);
+        if (rc < 0) {
+            if (errno == EINTR) continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+
+        // Retire every frame that went out completely.
+        size_t written = rc + q->offset;
+        while (q->count > 0 && written >= q->ring[q->head]->len) {
+            written -= q->ring[q->head]->len;
+            msgbuf_unref(q->ring[q->head]);
+            q->head = (q->head + 1) % q->limit;
+            q->count--;
+        }
+        q->offset = written;
+    }
+    return 0;
+}
+
+int outq_send(OutQueue *q, int fd, MsgBuf *buf, int policy) {
+    pthread_mutex_lock(&q->mutex);
+    int rc = 0;
+    if (q->closed) {
+        // Nobody is reading any more
+    } else if (q->count == q->limit && policy == OUTQ_DISCONNECT) {
+        rc = -1;
+    } else {
+        if (q->count == q->limit) drop_oldest(q);
+        if (q->count < q->limit) {
+            msgbuf_ref(buf);
+            q->ring[(q->head + q->count) % q->limit] = buf;
+            q->count++;
+            // Already-queued frames mean the socket was full a moment ago;
+            // its writable event will drain them.
+            if (q->count == 1) rc = flush_locked(q, fd);
+        } else {
+            q->dropped++; // Only a partly written frame left, and no room
+        }
+    }
+    // Still under the lock, so fd cannot have been closed and reused.
+    if (rc < 0) shutdown(fd, SHUT_RDWR);
+    pthread_mutex_unlock(&q->mutex);
+    return rc;
+}
+
+int outq_flush(OutQueue *q, int fd) {
+    pthread_mutex_lock(&q->mutex);
+    int rc = q->closed ? 0 : flush_locked(q, fd);
+    pthread_mutex_unlock(&q->mutex);
+    return rc;
+}
+
+void outq_close(OutQueue *q) {
+    pthread_mutex_lock(&q->mutex);
+    q->closed = 1;
+    pthread_mutex_unlock(&q->mutex);
+}
+
+void outq_pending(OutQueue *q, void (*fn)(void *arg, const char *data, size_t len), void *arg) {
+    pthread_mutex_lock(&q->mutex);
+    for (int i = 0; i < q->count; i++) {
+        MsgBuf *buf = q->ring[(q->head + i) % q->limit];
+        size_t skip = i == 0 ? q->offset : 0;
+        fn(arg, buf->data + skip, buf->len - skip);
+    }
+    pthread_mutex_unlock(&q->mutex);
+}
@@ -0,0 +1,45 @@
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include "msgbuf.h"
+
+// Frames waiting to be written to one non-blocking socket. Senders append and
+// write what the socket takes right away; the rest goes out, many frames per
+// sendmsg, once the socket is writable again. No sender ever waits for a slow
+// reader.
+
+#define OUTQ_DROP_OLDEST 0     // Full queue: discard the oldest frame not yet started
+#define OUTQ_DISCONNECT 1      // Full queue: give up on the reader
+#define OUTQ_IOV 64            // Frames gathered into one sendmsg
+
+typedef struct {
+    pthread_mutex_t mutex;
+    MsgBuf **ring;             // Each holds a reference
+    int limit;                 // Frames the queue holds at most
+    int head;
+    int count;
+    size_t offset;             // Bytes of the head frame already written
+    unsigned long dropped;     // Frames discarded under OUTQ_DROP_OLDEST
+    int closed;                // The socket is gone; sends are discarded
+} OutQueue;
+
+void outq_init(OutQueue *q, int limit);
+void outq_destroy(OutQueue *q);
+// Queue a frame (taking a reference of its own; the caller keeps its one)
+// and write as much as fd accepts. If the queue was full under
+// OUTQ_DISCONNECT or the socket failed, fd is shut down so its owner sees a
+// hangup, and -1 is returned.
+int outq_send(OutQueue *q, int fd, MsgBuf *buf, int policy);
+// Write queued frames until the queue is empty or fd would block. Returns -1
+// if the socket failed.
+int outq_flush(OutQueue *q, int fd);
+// Discard every later send. Call before closing the socket, so a sender still
+// holding the queue cannot write to a descriptor reused by then.
+void outq_close(OutQueue *q);
+// Call fn on the unwritten bytes of each queued frame, oldest first, so they
+// can be carried over to another process.
+void outq_pending(OutQueue *q, void (*fn)(void *arg, const char *data, size_t len), void *arg);
+
+#endif
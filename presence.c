@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <string.h>
+#include "presence.h"
+
+static void init_user(void *object) {
+    ((PresenceUser *)object)->handle = -1;
+}
+
+static void init_session(void *object) {
+    ((PresenceSession *)object)->handle = -1;
+}
+
+void presence_init(Presence *p, int max_users, int max_sessions) {
+    statlock_init(&p->lock);
+    slab_init(&p->users, sizeof(PresenceUser), max_users, init_user);
+    registry_init(&p->user_registry, SLAB_OBJECTS);
+    slab_init(&p->sessions, sizeof(PresenceSession), max_sessions, init_session);
+    registry_init(&p->session_registry, SLAB_OBJECTS);
+}
+
+void presence_user_set(Presence *p, const char *id, const char *session) {
+    statlock_lock(&p->lock);
+    int handle = registry_find(&p->user_registry, id);
+    if (handle < 0) handle = slab_alloc(&p->users);
+    if (handle >= 0) {
+        PresenceUser *user = slab_get(&p->users, handle);
+        if (user->handle < 0) {
+            strncpy(user->id, id, MAX_NAME - 1);
+            user->id[MAX_NAME - 1] = '\0';
+            user->handle = handle;
+            registry_insert(&p->user_registry, user->id, handle);
+        }
+        strncpy(user->session, session, MAX_NAME - 1);
+        user->session[MAX_NAME - 1] = '\0';
+    }
+    statlock_unlock(&p->lock);
+}
+
+void presence_user_remove(Presence *p, const char *id) {
+    statlock_lock(&p->lock);
+    int handle = registry_remove(&p->user_registry, id);
+    if (handle >= 0) {
+        PresenceUser *user = slab_get(&p->users, handle);
+        user->id[0] = '\0';
+        user->handle = -1;
+        slab_free(&p->users, handle);
+    }
+    statlock_unlock(&p->lock);
+}
+
+// The entry for session_id, made if need be. NULL if the table is full.
+static PresenceSession *find_session(Presence *p, const char *session_id) {
+    int handle = registry_find(&p->session_registry, session_id);
+    if (handle >= 0) return slab_get(&p->sessions, handle);
+    handle = slab_alloc(&p->sessions);
+    if (handle < 0) return NULL;
+    PresenceSession *s = slab_get(&p->sessions, handle);
+    strncpy(s->session_id, session_id, MAX_NAME - 1);
+    s->session_id[MAX_NAME - 1] = '\0';
+    s->local = -1;
+    s->remote_opens = s->remote_members = 0;
+    s->handle = handle;
+    registry_insert(&p->session_registry, s->session_id, handle);
+    return s;
+}
+
+// Drop the entry once no node has the session open.
+static void settle_session(Presence *p, PresenceSession *s) {
+    if (s->local >= 0 || s->remote_opens > 0) return;
+    int handle = s->handle;
+    registry_remove(&p->session_registry, s->session_id);
+    s->session_id[0] = '\0';
+    s->handle = -1;
+    slab_free(&p->sessions, handle);
+}
+
+void presence_session_local(Presence *p, const char *session_id, int count) {
+    statlock_lock(&p->lock);
+    PresenceSession *s = find_session(p, session_id);
+    if (s) {
+        s->local = count;
+        settle_session(p, s);
+    }
+    statlock_unlock(&p->lock);
+}
+
+void presence_session_remote(Presence *p, const char *session_id, int opens, int members) {
+    statlock_lock(&p->lock);
+    PresenceSession *s = find_session(p, session_id);
+    if (s) {
+        s->remote_opens += opens;
+        s->remote_members += members;
+        settle_session(p, s);
+    }
+    statlock_unlock(&p->lock);
+}
+
+// Cursors below users.max are user slots, the rest session slots after it.
+// Slots freed or filled between pages are simply seen or not, as they are
+// when the listing gets there.
+int presence_page(Presence *p, int cursor, char *out, size_t room) {
+    size_t len = 0;
+    char line[2 * MAX_NAME + 32];
+    out[0] = '\0';
+
+    statlock_lock(&p->lock);
+    int end = p->users.max + p->sessions.max;
+    while (cursor < end) {
+        int n = 0, next = cursor + 1;
+        if (cursor < p->users.max) {
+            if (cursor == 0) n += snprintf(line, sizeof(line), "=== Online Users ===\n");
+            if (cursor < p->users.next) {
+                PresenceUser *user = slab_get(&p->users, cursor);
+                if (user->id[0]) {
+                    n += snprintf(line + n, sizeof(line) - n, "- %s (in %s)\n", user->id, user->session);
+                }
+            } else {
+                next = p->users.max; // No slot past here was ever handed out
+            }
+        } else {
+            int handle = cursor - p->users.max;
+            if (handle == 0) n += snprintf(line, sizeof(line), "\n=== Active Sessions ===\n");
+            if (handle < p->sessions.next) {
+                PresenceSession *s = slab_get(&p->sessions, handle);
+                if (s->session_id[0]) {
+                    int count = (s->local > 0 ? s->local : 0) + s->remote_members;
+                    n += snprintf(line + n, sizeof(line) - n, "- %s (%d participants)\n", s->session_id, count);
+                }
+            } else {
+                next = end;
+            }
+        }
+        if (len + n >= room) break;
+        memcpy(out + len, line, n);
+        len += n;
+        out[len] = '\0';
+        cursor = next;
+    }
+    statlock_unlock(&p->lock);
+    return cursor < end ? cursor : -1;
+}
@@ -0,0 +1,51 @@
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+#include <stddef.h>
+#include "message.h"
+#include "registry.h"
+#include "slab.h"
+#include "metrics.h"
+
+// Who is online and which sessions are open, kept up to date as users log in,
+// join, leave and log out, here or on other nodes. Each change and each page
+// of a listing holds the index's own lock for a bounded time, so listing
+// never stops the rest of the server, however many entries there are.
+typedef struct {
+    char id[MAX_NAME];         // Empty while the slot is free
+    char session[MAX_NAME];
+    int handle;
+} PresenceUser;
+
+typedef struct {
+    char session_id[MAX_NAME]; // Empty while the slot is free
+    int local;                 // Members on this node, -1 if not open here
+    int remote_opens;          // Other nodes that have it open
+    int remote_members;
+    int handle;
+} PresenceSession;
+
+typedef struct {
+    StatLock lock;
+    Slab users;
+    Registry user_registry;
+    Slab sessions;
+    Registry session_registry;
+} Presence;
+
+void presence_init(Presence *p, int max_users, int max_sessions);
+// Add a user, or move it to another session ("" for none).
+void presence_user_set(Presence *p, const char *id, const char *session);
+void presence_user_remove(Presence *p, const char *id);
+// This node's member count of a session, -1 once it is closed here.
+void presence_session_local(Presence *p, const char *session_id, int count);
+// Another node opened (+1) or closed (-1) a session, and its member count
+// changed by members.
+void presence_session_remote(Presence *p, const char *session_id, int opens, int members);
+
+// Render the listing from cursor on (0 for the start) into out, a NUL-
+// terminated text of whole lines at most room bytes long. Returns the
+// cursor to continue from, -1 once the listing is complete.
+int presence_page(Presence *p, int cursor, char *out, size_t room);
+
+#endif
@@ -0,0 +1,153 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/time.h>
+#include "probe.h"
+
+#define PROBE_TOTAL (PROBE_COUNT + 2 * PROBE_PAIRS)
+
+static long long now_usec(void) {
+    struct timeval t;
+    gettimeofday(&t, NULL);
+    return (long long)t.tv_sec * 1000000 + t.tv_usec;
+}
+
+static void send_probe(int sockfd, const struct sockaddr_in *addr, unsigned int seq, char kind, int size,
+                       long long *sent_at) {
+    char buffer[PROBE_PAIR_SIZE];
+    int len = snprintf(buffer, sizeof(buffer), "PROBE:%u:%c:", seq, kind);
+    if (size > len) {
+        memset(buffer + len, 'x', size - len);
+        len = size;
+    }
+    sent_at[seq] = now_usec();
+    sendto(sockfd, buffer, len, 0, (const struct sockaddr *)addr, sizeof(*addr));
+}
+
+// Collect replies for up to wait_ms. Returns early once every probe sent so
+// far has been answered.
+static void collect_replies(int sockfd, int wait_ms, unsigned int sent, const long long *sent_at,
+                            long long *rtt, long long *server_at) {
+    long long deadline = now_usec() + (long long)wait_ms * 1000;
+    while (1) {
+        unsigned int answered = 0;
+        for (unsigned int i = 0; i < sent; i++) {
+            if (rtt[i] >= 0) answered++;
+        }
+        long long left = deadline - now_usec();
+        if (answered == sent || left <= 0) return;
+
+        struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+        if (poll(&pfd, 1, (int)((left + 999) / 1000)) <= 0) return;
+        char buffer[128];
+        int n = recvfrom(sockfd, buffer, sizeof(buffer) - 1, 0, NULL, NULL);
+        if (n <= 0) continue;
+        buffer[n] = '\0';
+        long long arrived = now_usec();
+
+        unsigned int seq;
+        char kind;
+        long long server_usec;
+        if (sscanf(buffer, "PROBE:%u:%c:%lld", &seq, &kind, &server_usec) != 3 || seq >= sent) continue;
+        if (rtt[seq] < 0) {
+            rtt[seq] = arrived - sent_at[seq];
+            server_at[seq] = server_usec;
+        }
+    }
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+int probe_path(int sockfd, const struct sockaddr_in *addr, struct path_estimate *est) {
+    long long sent_at[PROBE_TOTAL], rtt[PROBE_TOTAL], server_at[PROBE_TOTAL];
+    memset(est, 0, sizeof(*est));
+    for (int i = 0; i < PROBE_TOTAL; i++) rtt[i] = -1;
+
+    // RTT train: small, evenly spaced probes for min RTT, jitter and loss.
+    unsigned int seq = 0;
+    for (int i = 0; i < PROBE_COUNT; i++, seq++) {
+        send_probe(sockfd, addr, seq, 'R', 0, sent_at);
+        collect_replies(sockfd, PROBE_INTERVAL_MS, seq + 1, sent_at, rtt, server_at);
+    }
+    // Packet pairs: two full-size probes back to back. The bottleneck spaces
+    // them out by one packet's transmission time, which the server's receive
+    // timestamps expose.
+    for (int i = 0; i < PROBE_PAIRS; i++, seq += 2) {
+        send_probe(sockfd, addr, seq, 'P', PROBE_PAIR_SIZE, sent_at);
+        send_probe(sockfd, addr, seq + 1, 'P', PROBE_PAIR_SIZE, sent_at);
+        collect_replies(sockfd, PROBE_INTERVAL_MS, seq + 2, sent_at, rtt, server_at);
+    }
+    collect_replies(sockfd, PROBE_WAIT_MS, seq, sent_at, rtt, server_at);
+
+    est->sent = seq;
+    double sum = 0, jitter_sum = 0;
+    int jitter_samples = 0;
+    long long prev = -1;
+    for (int i = 0; i < PROBE_TOTAL; i++) {
+        if (rtt[i] < 0) continue;
+        est->replies++;
+        if (i >= PROBE_COUNT) continue; // Pair packets queue behind each other, no RTT sample.
+        double ms = rtt[i] / 1000.0;
+        if (est->replies == 1 || ms < est->min_rtt) est->min_rtt = ms;
+        sum += ms;
+        if (prev >= 0) {
+            jitter_sum += llabs(rtt[i] - prev) / 1000.0;
+            jitter_samples++;
+        }
+        prev = rtt[i];
+    }
+    est->loss_rate = 1.0 - (double)est->replies / est->sent;
+
+    int rtt_samples = 0;
+    for (int i = 0; i < PROBE_COUNT; i++) {
+        if (rtt[i] >= 0) rtt_samples++;
+    }
+    if (rtt_samples > 0) est->avg_rtt = sum / rtt_samples;
+    if (jitter_samples > 0) est->jitter = jitter_sum / jitter_samples;
+
+    // Median of the per-pair bandwidths, which discards pairs that were
+    // squeezed together or pulled apart by cross traffic.
+    double rates[PROBE_PAIRS];
+    int pairs = 0;
+    for (int i = PROBE_COUNT; i + 1 < PROBE_TOTAL; i += 2) {
+        if (rtt[i] < 0 || rtt[i + 1] < 0) continue;
+        long long dispersion = server_at[i + 1] - server_at[i];
+        if (dispersion > 0) rates[pairs++] = PROBE_PAIR_SIZE * 1e6 / dispersion;
+    }
+    if (pairs > 0) {
+        qsort(rates, pairs, sizeof(rates[0]), compare_doubles);
+        est->bandwidth = rates[pairs / 2];
+    }
+    return est->replies > 0 ? 0 : -1;
+}
+
+void print_path_estimate(const struct path_estimate *est) {
+    printf("Path probe: %d of %d probes answered\n", est->replies, est->sent);
+    printf("\tMin RTT:   %.3f ms\n", est->min_rtt);
+    printf("\tAvg RTT:   %.3f ms\n", est->avg_rtt);
+    printf("\tJitter:    %.3f ms\n", est->jitter);
+    printf("\tLoss rate: %.1f %%\n", est->loss_rate * 100);
+    if (est->bandwidth > 0) {
+        printf("\tBottleneck bandwidth: %.2f Mbit/s\n", est->bandwidth * 8 / 1e6);
+    } else {
+        printf("\tBottleneck bandwidth: unknown\n");
+    }
+}
+
+int answer_probe(int sockfd, const char *buffer, int n, const struct sockaddr_in *from, socklen_t addr_len) {
+    unsigned int seq;
+    char kind;
+    if (n < 6 || strncmp(buffer, "PROBE:", 6) != 0 || sscanf(buffer, "PROBE:%u:%c:", &seq, &kind) != 2) {
+        return 0;
+    }
+    char reply[64];
+    int len = snprintf(reply, sizeof(reply), "PROBE:%u:%c:%lld", seq, kind, now_usec());
+    sendto(sockfd, reply, len, 0, (const struct sockaddr *)from, addr_len);
+    return 1;
+}
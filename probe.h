@@ -0,0 +1,35 @@
+#ifndef PROBE_H
+#define PROBE_H
+
+#include <arpa/inet.h>
+
+// Path probing on top of the lab_1 UDP handshake. A probe is a datagram
+//     "PROBE:<seq>:<kind>:"                (kind 'R' = RTT train, 'P' = packet pair)
+// optionally padded to PROBE_PAIR_SIZE bytes; the server answers each with
+//     "PROBE:<seq>:<kind>:<server receive time in usec>"
+#define PROBE_COUNT 20         // Small probes in the RTT/loss train
+#define PROBE_INTERVAL_MS 5    // Spacing between train probes
+#define PROBE_PAIRS 8          // Back-to-back packet pairs for the bandwidth estimate
+#define PROBE_PAIR_SIZE 1000   // Bytes per pair packet, fits every lab's receive buffer
+#define PROBE_WAIT_MS 1000     // How long to wait for stragglers after the last probe
+
+struct path_estimate {
+    int sent;
+    int replies;
+    double min_rtt;            // ms
+    double avg_rtt;            // ms
+    double jitter;             // ms, mean difference between consecutive RTTs
+    double loss_rate;          // 0..1
+    double bandwidth;          // Bytes per second at the bottleneck, 0 if unknown
+};
+
+// Send the probe trains to addr and fill in est. Returns 0 if at least one
+// probe was answered, -1 otherwise.
+int probe_path(int sockfd, const struct sockaddr_in *addr, struct path_estimate *est);
+
+void print_path_estimate(const struct path_estimate *est);
+
+// Server side: if buffer holds a probe, answer it and return 1, else return 0.
+int answer_probe(int sockfd, const char *buffer, int n, const struct sockaddr_in *from, socklen_t addr_len);
+
+#endif
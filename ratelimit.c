@@ -0,0 +1,36 @@
+#include "ratelimit.h"
+
+#define UNIT 1000000000LL      // Billionths of a token in one
+
+void bucket_init(Bucket *b, const RateLimit *limit, uint64_t now) {
+    b->tokens = (int64_t)limit->burst * UNIT;
+    b->at = now;
+}
+
+int bucket_ready(Bucket *b, const RateLimit *limit, uint64_t now) {
+    if (limit->rate == 0) return 1;
+    int64_t full = (int64_t)limit->burst * UNIT;
+    uint64_t elapsed = now > b->at ? now - b->at : 0;
+    b->at = now;
+    // Unsigned, as from the deepest debt it is up to twice a full bucket.
+    uint64_t room = (uint64_t)full - (uint64_t)b->tokens;
+    if (elapsed > room / limit->rate) {
+        b->tokens = full;
+    } else {
+        b->tokens = (int64_t)((uint64_t)b->tokens + elapsed * limit->rate);
+    }
+    return b->tokens >= UNIT;
+}
+
+void bucket_take(Bucket *b, const RateLimit *limit, uint64_t cost) {
+    if (limit->rate == 0) return;
+    int64_t full = (int64_t)limit->burst * UNIT;
+    uint64_t above = (uint64_t)b->tokens + (uint64_t)full; // Over the deepest debt
+    uint64_t debt = cost * UNIT;
+    b->tokens = debt >= above ? -full : (int64_t)((uint64_t)b->tokens - debt);
+}
+
+uint64_t bucket_wait(const Bucket *b, const RateLimit *limit) {
+    if (limit->rate == 0 || b->tokens >= UNIT) return 0;
+    return ((uint64_t)UNIT - (uint64_t)b->tokens + limit->rate - 1) / limit->rate;
+}
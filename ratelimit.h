@@ -0,0 +1,32 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+
+// Token buckets. A bucket fills at rate tokens a second up to burst, and each
+// use takes what it costs. A cost is taken whole even when it is more than
+// the bucket holds; the debt is paid off by the refill before the bucket is
+// ready again, so the rate holds however uneven the costs. Times are
+// metrics_now() nanoseconds. A bucket belongs to one thread.
+// Largest rate or burst: a full bucket holds burst billion billionths.
+#define RATE_MAX (INT64_MAX / 1000000000LL)
+
+typedef struct {
+    uint64_t rate;             // Tokens a second, 0 for no limit, at most RATE_MAX
+    uint64_t burst;            // Most saved up, at most RATE_MAX
+} RateLimit;
+
+typedef struct {
+    int64_t tokens;            // In billionths of a token
+    uint64_t at;               // When last refilled
+} Bucket;
+
+// Start full.
+void bucket_init(Bucket *b, const RateLimit *limit, uint64_t now);
+// Whether a use may go ahead: there is at least one token.
+int bucket_ready(Bucket *b, const RateLimit *limit, uint64_t now);
+void bucket_take(Bucket *b, const RateLimit *limit, uint64_t cost);
+// Nanoseconds until bucket_ready() holds, as of its last refill.
+uint64_t bucket_wait(const Bucket *b, const RateLimit *limit);
+
+#endif
@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "registry.h"
+
+// FNV-1a
+unsigned int registry_hash(const char *key) {
+    unsigned int h = 2166136261u;
+    for (; *key; key++) {
+        h ^= (unsigned char)*key;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static RegistryEntry *alloc_entries(size_t size) {
+    RegistryEntry *entries = calloc(size, sizeof(RegistryEntry));
+    if (!entries) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    return entries;
+}
+
+void registry_init(Registry *r, size_t capacity) {
+    size_t size = 8;
+    while (size < 2 * capacity) size *= 2;
+    r->entries = alloc_entries(size);
+    r->mask = size - 1;
+    r->live = r->used = 0;
+}
+
+// Slot holding key, or NULL.
+static RegistryEntry *lookup(const Registry *r, const char *key, unsigned int hash) {
+    for (size_t i = hash & r->mask;; i = (i + 1) & r->mask) {
+        RegistryEntry *e = &r->entries[i];
+        if (!e->key) return NULL;
+        if (e->handle != REGISTRY_TOMBSTONE && e->hash == hash && strcmp(e->key, key) == 0) return e;
+    }
+}
+
+int registry_find(const Registry *r, const char *key) {
+    RegistryEntry *e = lookup(r, key, registry_hash(key));
+    return e ? e->handle : -1;
+}
+
+// Rebuild the table at the given size without tombstones. Churn (logins and
+// logouts) leaves them behind, and a table full of them makes every miss
+// probe to the end.
+static void rebuild(Registry *r, size_t size) {
+    RegistryEntry *old = r->entries;
+    size_t old_size = r->mask + 1;
+    r->entries = alloc_entries(size);
+    r->mask = size - 1;
+    for (size_t i = 0; i < old_size; i++) {
+        if (!old[i].key || old[i].handle == REGISTRY_TOMBSTONE) continue;
+        size_t j = old[i].hash & r->mask;
+        while (r->entries[j].key) j = (j + 1) & r->mask;
+        r->entries[j] = old[i];
+    }
+    r->used = r->live;
+    free(old);
+}
+
+int registry_insert(Registry *r, const char *key, int handle) {
+    unsigned int hash = registry_hash(key);
+    if (lookup(r, key, hash)) return -1;
+    size_t size = r->mask + 1;
+    if ((r->used + 1) * 4 > size * 3) rebuild(r, (r->live + 1) * 2 > size ? 2 * size : size);
+
+    // Reuse the first tombstone on the probe path, else the empty slot ending it.
+    size_t i = hash & r->mask;
+    while (r->entries[i].key && r->entries[i].handle != REGISTRY_TOMBSTONE) i = (i + 1) & r->mask;
+    RegistryEntry *e = &r->entries[i];
+    if (!e->key) r->used++;
+    e->key = key;
+    e->hash = hash;
+    e->handle = handle;
+    r->live++;
+    return 0;
+}
+
+int registry_remove(Registry *r, const char *key) {
+    RegistryEntry *e = lookup(r, key, registry_hash(key));
+    if (!e) return -1;
+    int handle = e->handle;
+    e->handle = REGISTRY_TOMBSTONE;
+    r->live--;
+    return handle;
+}
@@ -0,0 +1,37 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <stddef.h>
+
+// Open-addressing hash index from a name to a handle, an index into an array
+// the caller owns. Names are not copied: an entry points at the name stored
+// with its handle, which must stay put and unchanged while it is indexed.
+// Not thread-safe; callers hold whatever lock guards the array.
+typedef struct {
+    const char *key;           // NULL: empty
+    unsigned int hash;
+    int handle;                // REGISTRY_TOMBSTONE once removed
+} RegistryEntry;
+
+#define REGISTRY_TOMBSTONE -1
+
+typedef struct {
+    RegistryEntry *entries;
+    size_t mask;               // Table size minus one, size a power of two
+    size_t live;
+    size_t used;               // Live entries plus tombstones
+} Registry;
+
+// Size the table for capacity live names at no more than half load. It grows
+// when more are inserted.
+void registry_init(Registry *r, size_t capacity);
+// Handle indexed under key, -1 if none.
+int registry_find(const Registry *r, const char *key);
+// Index handle under key. Returns -1 if key is already indexed.
+int registry_insert(Registry *r, const char *key, int handle);
+// Drop key from the index. Returns its handle, -1 if it was not indexed.
+int registry_remove(Registry *r, const char *key);
+// The hash entries are placed by (FNV-1a), for callers that partition names.
+unsigned int registry_hash(const char *key);
+
+#endif
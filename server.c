@@ -1,489 +1,2775 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netdb.h>
+#include <time.h>
+#include <sys/time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include "message.h"
+#include "registry.h"
+#include "outq.h"
+#include "slab.h"
+#include "mpsc.h"
+#include "metrics.h"
+#include "presence.h"
+#include "msglog.h"
+#include "wheel.h"
+#include "ratelimit.h"
 
-#define MAX_NAME 50
-#define MAX_DATA 1024
-#define MAX_CLIENTS 100
-#define MAX_SESSIONS 50
+#define DEFAULT_MAX_CLIENTS (1 << 20)
+#define DEFAULT_MAX_SESSIONS (1 << 16)
 #define BUF_SIZE 2048
+#define MAX_SHARDS 64
+#define MAX_EVENTS 64          // epoll events handled per wakeup
+#define DEFAULT_OUTQ_LIMIT 256 // Frames queued for a slow reader before backpressure applies
+#define MIN_MEMBERS 8          // Smallest member array allocated
+#define MAX_PEERS 16           // Links to other nodes at once
+#define PEER_RETRY_MS 1000     // Wait before dialing a peer that is down again
+#define PEER_OUTQ_LIMIT 65536  // Frames queued for a peer before its link is reset
+#define STAT_COMMANDS 20       // Command types counted one by one
+#define SPARE_SHARD_MSGS 1024  // Used shard messages a shard keeps for reuse
+#define DEFAULT_HISTORY 20     // Messages a session keeps for those who join later
+#define HISTORY_MAX 1024       // Most a session can ask to keep
+#define HISTORY_BYTES (64 * 1024) // Encoded bytes a session keeps by default, both formats
+#define HISTORY_BYTES_MAX (1 << 20) // Most bytes a session can ask to keep
+#define DEFAULT_LOG_SEGMENTS 16 // Segments of the message log kept on disk (-k)
+#define DEFAULT_IDLE_TIMEOUT 60 // Seconds a client may stay silent (-t)
+#define WHEEL_TICK_MS 250      // Granularity of idle deadlines
+#define WHEEL_SLOTS 512        // Ticks in one turn of a shard's timer wheel
+#define DEFAULT_COMMAND_RATE 1000   // Commands a second from one connection (-m)
+#define DEFAULT_BYTE_RATE (1 << 20) // Bytes a second from one connection (-w)
+#define DEFAULT_SESSION_RATE 5000   // Messages a second in one session (-M)
+#define DEFAULT_SESSION_BYTE_RATE (4 << 20) // Bytes of messages a second in one session (-W)
+#define THROTTLE_TICK_MS 5     // Granularity of resuming throttled connections
+#define THROTTLE_SLOTS 256
 
+// What happens to a connection over its limits (-x). Each limit lets one
+// second's worth through at once.
+#define FLOOD_THROTTLE 0       // Its input is left unread until its buckets refill
+#define FLOOD_DROP 1           // Its commands are discarded unhandled
+#define FLOOD_DISCONNECT 2     // It is closed
+
+// What connections that SUBSCRIBE (15) are sent as it happens. The source
+// is a user, the data "online", "offline", "joined <session>" or "left
+// <session>". Joins and leaves go to the session's subscribed members only.
+#define PRESENCE_EVENT 17
+
+// Heartbeats. A connection silent for half the idle timeout is sent a PING,
+// which clients answer with a PONG; one silent for all of it is closed. A
+// client may PING the server as well.
+#define PING 18
+#define PONG 19
+
+typedef struct Client {
+    char id[MAX_NAME];
+    char password[MAX_NAME];
+    int socket;
+    char session[MAX_NAME];
+    int active;
+    int mode;                  // Wire format of the connection it logged in on
+    int handle;                // In client_slab
+} Client;
+
+// A chat message as it was fanned out, in each wire format.
+typedef struct {
+    MsgBuf *frame[2];
+} HistoryEntry;
+
+// A session, kept by the shard its name hashes to. Only that shard's thread
+// changes it, under the shard's lock so a new peer link can be sent it. The
+// history is the owner's alone and is kept without the lock.
+typedef struct {
+    char session_id[MAX_NAME];
+    int handle;                // In the owner's sessions slab
+    int count;                 // Members on all shards
+    int on_shard[MAX_SHARDS];  // Members on each shard, the ones messages go to
+    HistoryEntry *history;     // Ring of the latest messages, allocated on the first
+    Bucket messages;           // Against session_limit
+    Bucket bytes;              // Against session_byte_limit
+    int history_limit;         // Messages it holds at most, 0 for none
+    size_t history_byte_limit; // Bytes of them it holds at most, both formats
+    int history_start;         // Oldest
+    int history_count;
+    size_t history_bytes;
+} Session;
+
+// The members of one session that a shard serves itself, wherever the
+// session is owned. Only that shard's thread touches it.
+typedef struct {
+    char session_id[MAX_NAME];
+    int handle;                // In the shard's replicas slab
+    struct Connection **members;
+    int count;
+    int capacity;
+} Replica;
+
+// Counters of one shard, written only by its thread and read by the admin
+// port (metrics.h).
+typedef struct {
+    unsigned long long commands[STAT_COMMANDS]; // By type, 0 for any other
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;          // Queued to clients
+    unsigned long long accepted;
+    unsigned long long closed;
+    unsigned long long logins;
+    unsigned long long logouts;
+    unsigned long long idle_closed;        // Connections dropped for silence
+    unsigned long long throttled;          // Times a connection over its limits was paused
+    unsigned long long flood_dropped;      // Commands discarded over a connection's limits
+    unsigned long long flood_closed;       // Connections closed over their limits
+    unsigned long long session_dropped;    // Messages discarded over a session's limits
+    unsigned long long sessions_opened;    // Of those the shard owns
+    unsigned long long sessions_closed;
+    unsigned long long shard_messages;     // From other shards and nodes
+    Histogram command;                     // Handling one command
+    Histogram broadcast;                   // From a MESSAGE arriving to its delivery by one shard
+} Stats;
+
+// A client connection. It belongs to the shard that accepted it, and only
+// that shard's thread reads, writes or frees it.
+typedef struct Connection {
+    int fd;
+    int closed;
+    int waiting;               // A JOIN or NEW_SESS is out at the owner shard
+    Client *client;            // The user logged in on it, NULL if none
+    Stats *stats;              // Its shard's
+    Replica *replica;          // Session it is a member of, NULL if none
+    int member;                // Its position in replica->members
+    int subscribed;            // Gets presence events (SUBSCRIBE)
+    int subscriber;            // Its position in the shard's subscribers
+    int mode;                  // Wire format of the last command it sent
+    uint64_t heard;            // When it last sent anything (metrics_now())
+    WheelNode timer;           // Its idle deadline, in the shard's wheel
+    Bucket commands;           // Against command_limit
+    Bucket bytes;              // Against byte_limit
+    int paused;                // Throttled: input is read again at resume
+    WheelNode resume;          // In the shard's resumes while paused
+    InBuf in;                  // Received bytes not yet parsed into messages
+    OutQueue out;              // Frames not yet written
+    struct Connection *next;   // Link in the shard's reap list
+    struct Connection *open_prev, *open_next; // In the shard's open connections
+} Connection;
+
+// What shards send each other. Requests go to the shard owning the session,
+// answers and deliveries come back to the shards serving the connections.
+#define SHARD_JOIN 1           // conn wants to join session_id
+#define SHARD_NEW 2            // conn wants session_id created, and joined if join
+#define SHARD_LEAVE 3          // A member on shard from has left session_id
+#define SHARD_MESSAGE 4        // Send frame to every member of session_id
+#define SHARD_DELIVER 5        // Send frame to this shard's members of session_id
+#define SHARD_REPLY 6          // The owner's answer to a JOIN or NEW for conn
+#define FED_USER 7             // Tell other nodes user data is here, in session_id
+#define FED_USER_GONE 8        // Tell other nodes user data has logged out
+#define FED_SESSION 9          // Tell other nodes session_id has count members here
+#define FED_MESSAGE 10         // Send frame to the other nodes with members in session_id
+#define SHARD_NOTIFY 11        // Send frame to this shard's subscribers
+#define SHARD_HANDOFF 12       // Stop while this process hands its state to a new one
+
+typedef struct {
+    MpscNode node;             // Link in the receiving shard's inbox
+    int kind;
+    int from;                  // Shard that sent it, -1 for another node
+    int pool;                  // Shard it goes back to once used, -1 to free it
+    Connection *conn;
+    int mode;                  // Wire format to answer conn in
+    int join;                  // NEW: conn joins too. REPLY: conn is now a member
+    int count;                 // FED_SESSION: members here, -1 once it is closed.
+                               // NEW: history to keep, -1 for the default
+    int history_bytes;         // NEW: bytes of history to keep, -1 for the default
+    unsigned int type;         // REPLY: response type
+    char session_id[MAX_NAME];
+    char data[MAX_NAME];       // REPLY: response data. FED_USER*: the user
+    MsgBuf *frame[2];          // MESSAGE, DELIVER, NOTIFY: the frame in each wire format
+    HistoryEntry *history;     // REPLY: what was said before a JOIN, oldest first
+    int history_count;
+    uint64_t at;               // MESSAGE, DELIVER: when it arrived, for metrics
+} ShardMsg;
+
+// Messages for one thread, which watches event_fd in its epoll set.
+typedef struct {
+    Mpsc queue;
+    int event_fd;              // Readable while the queue may hold messages
+    int signaled;              // event_fd written and not yet drained (atomic)
+} Inbox;
+
+// One event loop per thread, with its own listening socket on the shared
+// port; the kernel spreads new connections over them. Sessions are split
+// between shards by name, and shards reach each other only through their
+// inboxes.
+typedef struct {
+    int id;
+    pthread_t thread;
+    int epfd;
+    int listen_fd;
+    int extra_fds[MAX_SHARDS]; // More sockets on the port, left by an older server
+    int num_extra_fds;         // with more shards, and polled here too
+    Inbox inbox;
+    Mpsc returns;              // Its messages, used by other threads
+    ShardMsg *spare;           // Its used messages, ready for reuse
+    int num_spare;
+    StatLock lock;             // Sessions, against the federation thread
+    Slab sessions;             // Sessions owned here
+    Registry session_registry;
+    Slab replicas;             // Sessions this shard's connections are in
+    Registry replica_registry;
+    Connection **subscribers;  // Its connections that get presence events
+    int num_subscribers;
+    int subscribers_capacity;
+    Connection *open;          // Its connections, newest first
+    Connection *reap;          // Closed in this batch of events, freed after it
+    TimerWheel timers;         // Idle deadlines of its connections
+    TimerWheel resumes;        // When its throttled connections may go on
+    int num_paused;
+    Stats stats;
+} Shard;
+
+// Frames between nodes, in the binary wire format. A link starts with a
+// HELLO each way; after that each side reports its users and sessions as
+// they change, and sends each chat message once, to the nodes that have
+// members in its session.
+#define PEER_HELLO 20          // source: node id
+#define PEER_USER 21           // source: user, data: its session or ""
+#define PEER_USER_GONE 22      // source: user
+#define PEER_SESSION 23        // source: session, data: members on the sender
+#define PEER_SESSION_GONE 24   // source: session
+#define PEER_ROUTE 25          // source: session the next MESSAGE (11) or event goes to
+
+typedef struct {
+    char id[MAX_NAME];         // Empty while the slot is free
+    char session[MAX_NAME];
+    int handle;
+} RemoteUser;
+
+typedef struct {
+    char session_id[MAX_NAME]; // Empty while the slot is free
+    int count;
+    int handle;
+} RemoteSession;
+
+// A link to another node, and what that node last reported.
+typedef struct {
+    int fd;                    // -1 while down
+    int dialed;                // We connect to it, at address
+    struct sockaddr_in address;
+    int node;                  // Its id, -1 until it said HELLO
+    int up;                    // HELLO received
+    char route[MAX_NAME];      // Session for the next MESSAGE it sends
+    char routed[MAX_NAME];     // Session of the last ROUTE we sent it
+    InBuf in;
+    OutQueue out;
+    Slab users;                // Written by the federation thread under
+    Registry user_registry;    // cluster_lock, read by shards under it
+    Slab sessions;
+    Registry session_registry;
+} Peer;
+
+// The thread that keeps the links to other nodes.
+typedef struct {
+    pthread_t thread;
+    int epfd;
+    int listen_fd;
+    Inbox inbox;
+    Peer peers[MAX_PEERS];     // Dialed peers first, then accepted ones
+    int num_dialed;
+} Federation;
+
+// Users are shared by all shards. clients_mutex guards client_slab, the user
+// registry and the user fields that a new peer link is sent.
+StatLock clients_mutex = STATLOCK_INITIALIZER;
+
+// What other nodes reported. Taken before a shard's lock, and after
+// clients_mutex if both are needed. The presence index's lock is taken last.
+StatLock cluster_lock = STATLOCK_INITIALIZER;
+
+// Users live in a slab that grows with use, up to the limit set by -c. The
+// registry finds them by name without scanning.
+static Slab client_slab;
+static Registry client_registry;
+static int max_clients = DEFAULT_MAX_CLIENTS;
+static int max_sessions = DEFAULT_MAX_SESSIONS;
+static int default_history = DEFAULT_HISTORY;
+static uint64_t idle_timeout = DEFAULT_IDLE_TIMEOUT * 1000000000ULL; // 0 for none
+static RateLimit command_limit = { DEFAULT_COMMAND_RATE, DEFAULT_COMMAND_RATE };
+static RateLimit byte_limit = { DEFAULT_BYTE_RATE, DEFAULT_BYTE_RATE };
+static RateLimit session_limit = { DEFAULT_SESSION_RATE, DEFAULT_SESSION_RATE };
+static RateLimit session_byte_limit = { DEFAULT_SESSION_BYTE_RATE, DEFAULT_SESSION_BYTE_RATE };
+static int flood_action = FLOOD_THROTTLE;
+
+const Client valid_clients[] = {
+    {"a", "1", -1, "", 0, WIRE_TEXT, -1},
+    {"b", "2", -1, "", 0, WIRE_TEXT, -1},
+    {"c", "3", -1, "", 0, WIRE_TEXT, -1},
+    {"d", "4", -1, "", 0, WIRE_TEXT, -1},
+};
+const int num_valid_clients = 4;
+static int open_login;         // -u open: any name logs in
+
+static Shard *shards;
+static int num_shards;
+static int outq_limit = DEFAULT_OUTQ_LIMIT;
+static int backpressure = OUTQ_DROP_OLDEST;
+static int node_id = -1;       // Set by -i when this node is part of a cluster
+static Federation *federation; // NULL unless it is
+
+// Who is online and which sessions are open, across the cluster, for QUERY.
+static Presence presence;
+
+// Chat messages on disk, NULL unless -L names a directory for them. A
+// session's history starts from what the log holds when it is opened.
+static MsgLog *msglog;
+
+// -U: the Unix socket where a newer server asks this one for its state.
+static const char *upgrade_path;
+
+static int admin_fd = -1;      // -a, handed over like the shards' sockets
+
+// Sentinels in epoll data for a shard's own descriptors.
+static char listen_event, extra_listen_event, inbox_event, peer_listen_event;
+
+// Queue a frame for a connection without waiting on its reader. A reader
+// that cannot keep up under OUTQ_DISCONNECT is shut down; its shard then
+// sees the hangup and closes the connection as usual.
+void conn_send_buf(Connection *conn, MsgBuf *buf) {
+    STAT_ADD(conn->stats->bytes_out, buf->len);
+    outq_send(&conn->out, conn->fd, buf, backpressure);
+}
+
+void conn_send(Connection *conn, const char *buffer, size_t len) {
+    MsgBuf *buf = msgbuf_copy(buffer, len);
+    if (!buf) return;
+    conn_send_buf(conn, buf);
+    msgbuf_unref(buf);
+}
+
+void send_response(Connection *conn, int mode, unsigned int type, const char *data) {
+    Message response = {0};
+    response.type = type;
+    strcpy((char *)response.data, data);
+    char res_buffer[MAX_FRAME];
+    size_t len = serialize_message(&response, res_buffer, mode);
+    conn_send(conn, res_buffer, len);
+}
+
+Client *find_client(char *id) {
+    int handle = registry_find(&client_registry, id);
+    return handle == -1 ? NULL : slab_get(&client_slab, handle);
+}
+
+// The shard owning a session name. Uses the top of the hash, so names a
+// shard owns still spread over its registry, which indexes by the bottom.
+int owner_of(const char *session_id) {
+    return (int)(((uint64_t)registry_hash(session_id) * num_shards) >> 32);
+}
+
+Session *find_session(Shard *shard, const char *session_id) {
+    int handle = registry_find(&shard->session_registry, session_id);
+    return handle == -1 ? NULL : slab_get(&shard->sessions, handle);
+}
+
+Replica *find_replica(Shard *shard, const char *session_id) {
+    int handle = registry_find(&shard->replica_registry, session_id);
+    return handle == -1 ? NULL : slab_get(&shard->replicas, handle);
+}
+
+// A zeroed message. A shard sending one (from >= 0) reuses what came back
+// from earlier ones, so passing messages does not go through malloc.
+ShardMsg *new_shard_msg(int kind, int from) {
+    ShardMsg *m = NULL;
+    if (from >= 0) {
+        Shard *self = &shards[from];
+        if (!self->spare) {
+            MpscNode *node;
+            while ((node = mpsc_pop(&self->returns))) {
+                ShardMsg *used = (ShardMsg *)node;
+                used->node.next = (MpscNode *)self->spare;
+                self->spare = used;
+                self->num_spare++;
+            }
+        }
+        if (self->spare) {
+            m = self->spare;
+            self->spare = (ShardMsg *)m->node.next;
+            self->num_spare--;
+            memset(m, 0, sizeof(*m));
+        }
+    }
+    if (!m) {
+        m = calloc(1, sizeof(ShardMsg));
+        if (!m) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    m->kind = kind;
+    m->from = from;
+    m->pool = from;
+    return m;
+}
+
+// Done with a message: back to the shard that made it, straight onto its
+// spares if that is self (NULL from other threads).
+void release_shard_msg(Shard *self, ShardMsg *m) {
+    if (m->pool < 0) {
+        free(m);
+    } else if (self && self->id == m->pool) {
+        if (self->num_spare >= SPARE_SHARD_MSGS) {
+            free(m);
+            return;
+        }
+        m->node.next = (MpscNode *)self->spare;
+        self->spare = m;
+        self->num_spare++;
+    } else {
+        mpsc_push(&shards[m->pool].returns, &m->node);
+    }
+}
+
+void inbox_init(Inbox *inbox, int epfd, void *tag) {
+    mpsc_init(&inbox->queue);
+    inbox->signaled = 0;
+    inbox->event_fd = eventfd(0, EFD_NONBLOCK);
+    if (inbox->event_fd < 0) {
+        perror("eventfd");
+        exit(EXIT_FAILURE);
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = tag };
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, inbox->event_fd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Hand a message to another thread. Its event_fd is written only when it has
+// none pending, so a busy thread is not woken once per message.
+void post(Inbox *inbox, ShardMsg *m) {
+    mpsc_push(&inbox->queue, &m->node);
+    if (__atomic_exchange_n(&inbox->signaled, 1, __ATOMIC_SEQ_CST) == 0) {
+        uint64_t one = 1;
+        if (write(inbox->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            perror("write eventfd");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// Take the next message, NULL once there are none. The first call after a
+// wakeup rearms event_fd, so a message posted while draining wakes it again.
+ShardMsg *inbox_next(Inbox *inbox) {
+    if (__atomic_load_n(&inbox->signaled, __ATOMIC_RELAXED)) {
+        uint64_t count;
+        if (read(inbox->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+            perror("read eventfd");
+            exit(EXIT_FAILURE);
+        }
+        __atomic_store_n(&inbox->signaled, 0, __ATOMIC_SEQ_CST);
+    }
+    return (ShardMsg *)mpsc_pop(&inbox->queue);
+}
+
+// Members other nodes reported in a session, -1 if none has it open. Called
+// with cluster_lock held, or by the federation thread.
+int cluster_count(const char *session_id) {
+    int total = -1;
+    for (int i = 0; federation && i < MAX_PEERS; i++) {
+        Peer *p = &federation->peers[i];
+        if (!p->up) continue;
+        int handle = registry_find(&p->session_registry, session_id);
+        if (handle == -1) continue;
+        RemoteSession *rs = slab_get(&p->sessions, handle);
+        total = (total < 0 ? 0 : total) + rs->count;
+    }
+    return total;
+}
+
+// Called with cluster_lock held.
+int cluster_has_user(const char *id) {
+    for (int i = 0; federation && i < MAX_PEERS; i++) {
+        Peer *p = &federation->peers[i];
+        if (p->up && registry_find(&p->user_registry, id) != -1) return 1;
+    }
+    return 0;
+}
+
+// Record where a user is now, and tell the other nodes, if any.
+void publish_user(const char *id, const char *session_id, int gone) {
+    if (gone) {
+        presence_user_remove(&presence, id);
+    } else {
+        presence_user_set(&presence, id, session_id);
+    }
+    if (!federation) return;
+    ShardMsg *m = new_shard_msg(gone ? FED_USER_GONE : FED_USER, -1);
+    strcpy(m->data, id);
+    strcpy(m->session_id, session_id);
+    post(&federation->inbox, m);
+}
+
+void publish_session(const char *session_id, int count) {
+    presence_session_local(&presence, session_id, count);
+    if (!federation) return;
+    ShardMsg *m = new_shard_msg(FED_SESSION, -1);
+    strcpy(m->session_id, session_id);
+    m->count = count;
+    post(&federation->inbox, m);
+}
+
+// Encode a frame once per wire format. Returns -1 if out of memory.
+int encode_frames(MsgBuf *frame[2], unsigned int type, const char *source, size_t source_len,
+                  const char *data, size_t data_len) {
+    for (int mode = 0; mode < 2; mode++) {
+        char buffer[MAX_FRAME];
+        size_t len = encode_message(buffer, mode, type, source, source_len, data, data_len);
+        frame[mode] = msgbuf_copy(buffer, len);
+    }
+    if (frame[WIRE_TEXT] && frame[WIRE_BINARY]) return 0;
+    for (int mode = 0; mode < 2; mode++) {
+        if (frame[mode]) msgbuf_unref(frame[mode]);
+    }
+    return -1;
+}
+
+// Add a connection to this shard's members of a session.
+void add_member(Shard *self, Connection *conn, const char *session_id) {
+    Replica *r = find_replica(self, session_id);
+    if (!r) {
+        int index = slab_alloc(&self->replicas);
+        if (index == -1) return; // More sessions than -s allows were ever open
+        r = slab_get(&self->replicas, index);
+        strcpy(r->session_id, session_id);
+        r->handle = index;
+        r->count = 0;
+        registry_insert(&self->replica_registry, r->session_id, index);
+    }
+    if (r->count == r->capacity) {
+        int capacity = r->capacity ? 2 * r->capacity : MIN_MEMBERS;
+        Connection **members = realloc(r->members, capacity * sizeof(Connection *));
+        if (!members) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        r->members = members;
+        r->capacity = capacity;
+    }
+    conn->replica = r;
+    conn->member = r->count;
+    r->members[r->count++] = conn;
+}
+
+// The last member moves into the leaver's place.
+void remove_member(Shard *self, Connection *conn) {
+    Replica *r = conn->replica;
+    Connection *last = r->members[--r->count];
+    r->members[conn->member] = last;
+    last->member = conn->member;
+    conn->replica = NULL;
+    if (r->count == 0) {
+        // The slab keeps the array for the next session in this slot.
+        registry_remove(&self->replica_registry, r->session_id);
+        memset(r->session_id, 0, MAX_NAME);
+        slab_free(&self->replicas, r->handle);
+    }
+}
+
+// A binary frame's type is its third byte.
+static inline unsigned int frame_type(MsgBuf *frame[2]) {
+    return (unsigned char)frame[WIRE_BINARY]->data[2];
+}
+
+// Send a message to this shard's members of a session.
+void deliver(Shard *self, const char *session_id, MsgBuf *frame[2], uint64_t at) {
+    Replica *r = find_replica(self, session_id);
+    if (!r) return;
+    // Events reach only the members that subscribed.
+    int event = frame_type(frame) == PRESENCE_EVENT;
+    for (int i = 0; i < r->count; i++) {
+        Connection *conn = r->members[i];
+        if (event && !conn->subscribed) continue;
+        conn_send_buf(conn, frame[conn->client->mode]);
+    }
+    hist_record(&self->stats.broadcast, metrics_now() - at);
+}
+
+// Keep a message for those who join later, holding references to the frames
+// it was sent as. The oldest go first once the session's limit on messages
+// or on bytes is reached. A message larger than the byte limit is not kept.
+void remember(Session *sess, MsgBuf *frame[2]) {
+    size_t len = frame[WIRE_TEXT]->len + frame[WIRE_BINARY]->len;
+    if (sess->history_limit == 0 || len > sess->history_byte_limit) return;
+    if (!sess->history) {
+        sess->history = malloc(sess->history_limit * sizeof(HistoryEntry));
+        if (!sess->history) return;
+    }
+    while (sess->history_count > 0 &&
+           (sess->history_count == sess->history_limit || sess->history_bytes + len > sess->history_byte_limit)) {
+        HistoryEntry *oldest = &sess->history[sess->history_start];
+        sess->history_bytes -= oldest->frame[WIRE_TEXT]->len + oldest->frame[WIRE_BINARY]->len;
+        for (int mode = 0; mode < 2; mode++) msgbuf_unref(oldest->frame[mode]);
+        sess->history_start = (sess->history_start + 1) % sess->history_limit;
+        sess->history_count--;
+    }
+    HistoryEntry *e = &sess->history[(sess->history_start + sess->history_count) % sess->history_limit];
+    for (int mode = 0; mode < 2; mode++) {
+        e->frame[mode] = frame[mode];
+        msgbuf_ref(frame[mode]);
+    }
+    sess->history_count++;
+    sess->history_bytes += len;
+}
+
+void forget_history(Session *sess) {
+    for (int i = 0; i < sess->history_count; i++) {
+        HistoryEntry *e = &sess->history[(sess->history_start + i) % sess->history_limit];
+        for (int mode = 0; mode < 2; mode++) msgbuf_unref(e->frame[mode]);
+    }
+    free(sess->history);
+    sess->history = NULL;
+    sess->history_start = sess->history_count = 0;
+    sess->history_bytes = 0;
+}
+
+// Owner side of MESSAGE: pass the frames to every shard with members, this
+// one included, and unless it came from there, to the other nodes. Takes
+// over the caller's references.
+void fan_out(Shard *self, const char *session_id, MsgBuf *frame[2], int forward, uint64_t at) {
+    Session *sess = find_session(self, session_id);
+    // Chat said on this node counts against the session's limit here; each
+    // node limits what its own members say.
+    if (forward && sess && frame_type(frame) == 11) {
+        uint64_t now = metrics_now();
+        if (!bucket_ready(&sess->messages, &session_limit, now) ||
+            !bucket_ready(&sess->bytes, &session_byte_limit, now)) {
+            STAT_ADD(self->stats.session_dropped, 1);
+            for (int mode = 0; mode < 2; mode++) msgbuf_unref(frame[mode]);
+            return;
+        }
+        bucket_take(&sess->messages, &session_limit, 1);
+        bucket_take(&sess->bytes, &session_byte_limit, frame[WIRE_BINARY]->len);
+    }
+
+    if (forward && federation) {
+        ShardMsg *m = new_shard_msg(FED_MESSAGE, self->id);
+        strcpy(m->session_id, session_id);
+        m->frame[WIRE_BINARY] = frame[WIRE_BINARY];
+        msgbuf_ref(frame[WIRE_BINARY]);
+        post(&federation->inbox, m);
+    }
+
+    if (sess && frame_type(frame) == 11) {
+        remember(sess, frame);
+        if (msglog) msglog_append(msglog, session_id, frame[WIRE_BINARY]);
+    }
+    for (int i = 0; sess && i < num_shards; i++) {
+        if (sess->on_shard[i] == 0) continue;
+        if (i == self->id) {
+            deliver(self, session_id, frame, at);
+            continue;
+        }
+        ShardMsg *m = new_shard_msg(SHARD_DELIVER, self->id);
+        strcpy(m->session_id, session_id);
+        m->at = at;
+        for (int mode = 0; mode < 2; mode++) {
+            m->frame[mode] = frame[mode];
+            msgbuf_ref(frame[mode]);
+        }
+        post(&shards[i].inbox, m);
+    }
+    for (int mode = 0; mode < 2; mode++) msgbuf_unref(frame[mode]);
+}
+
+// Send frames to every member of a session, through the shard that owns
+// it. Takes over the caller's references.
+void send_to_session(Shard *self, const char *session_id, MsgBuf *frame[2], uint64_t at) {
+    int owner = owner_of(session_id);
+    if (owner == self->id) {
+        fan_out(self, session_id, frame, 1, at);
+        return;
+    }
+    ShardMsg *m = new_shard_msg(SHARD_MESSAGE, self->id);
+    strcpy(m->session_id, session_id);
+    m->at = at;
+    m->frame[WIRE_TEXT] = frame[WIRE_TEXT];
+    m->frame[WIRE_BINARY] = frame[WIRE_BINARY];
+    post(&shards[owner].inbox, m);
+}
+
+// Subscribers on all shards, so events nobody would get are not built.
+static int num_subscribers;    // Atomic
+
+void add_subscriber(Shard *self, Connection *conn) {
+    if (conn->subscribed) return;
+    if (self->num_subscribers == self->subscribers_capacity) {
+        int capacity = self->subscribers_capacity ? 2 * self->subscribers_capacity : MIN_MEMBERS;
+        Connection **subscribers = realloc(self->subscribers, capacity * sizeof(Connection *));
+        if (!subscribers) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        self->subscribers = subscribers;
+        self->subscribers_capacity = capacity;
+    }
+    conn->subscribed = 1;
+    conn->subscriber = self->num_subscribers;
+    self->subscribers[self->num_subscribers++] = conn;
+    __atomic_fetch_add(&num_subscribers, 1, __ATOMIC_RELAXED);
+}
+
+// The last subscriber moves into the leaver's place.
+void remove_subscriber(Shard *self, Connection *conn) {
+    if (!conn->subscribed) return;
+    Connection *last = self->subscribers[--self->num_subscribers];
+    self->subscribers[conn->subscriber] = last;
+    last->subscriber = conn->subscriber;
+    conn->subscribed = 0;
+    __atomic_fetch_sub(&num_subscribers, 1, __ATOMIC_RELAXED);
+}
+
+// Send an event to this shard's subscribers.
+void notify(Shard *self, MsgBuf *frame[2]) {
+    for (int i = 0; i < self->num_subscribers; i++) {
+        Connection *conn = self->subscribers[i];
+        conn_send_buf(conn, frame[conn->client->mode]);
+    }
+}
+
+// Tell every subscriber here that a user came online or went offline, on
+// this node or another. self is the calling shard, NULL on the federation
+// thread.
+void user_event(Shard *self, const char *id, const char *what) {
+    if (__atomic_load_n(&num_subscribers, __ATOMIC_RELAXED) == 0) return;
+    MsgBuf *frame[2];
+    if (encode_frames(frame, PRESENCE_EVENT, id, strlen(id), what, strlen(what)) < 0) return;
+    for (int i = 0; i < num_shards; i++) {
+        if (&shards[i] == self) {
+            notify(self, frame);
+            continue;
+        }
+        ShardMsg *m = new_shard_msg(SHARD_NOTIFY, self ? self->id : -1);
+        for (int mode = 0; mode < 2; mode++) {
+            m->frame[mode] = frame[mode];
+            msgbuf_ref(frame[mode]);
+        }
+        post(&shards[i].inbox, m);
+    }
+    for (int mode = 0; mode < 2; mode++) msgbuf_unref(frame[mode]);
+}
+
+// Tell a session's subscribed members that a user joined or left it. They
+// may be on other nodes, where this node cannot see who subscribed.
+void session_event(Shard *self, const char *id, const char *what, const char *session_id) {
+    if (!federation && __atomic_load_n(&num_subscribers, __ATOMIC_RELAXED) == 0) return;
+    char data[MAX_DATA];
+    int len = snprintf(data, sizeof(data), "%s %s", what, session_id);
+    MsgBuf *frame[2];
+    if (encode_frames(frame, PRESENCE_EVENT, id, strlen(id), data, len) < 0) return;
+    send_to_session(self, session_id, frame, metrics_now());
+}
+
+// Put a message read back from the log, or handed over by an older server,
+// into a session's history.
+void restore_message(void *arg, const char *frame, size_t len) {
+    InBuf in;
+    MessageView view;
+    inbuf_init(&in);
+    memcpy(in.buf, frame, len);
+    in.end = len;
+    if (inbuf_next(&in, &view) != 1) return;
+    MsgBuf *frames[2];
+    if (encode_frames(frames, 11, view.source, view.source_len, view.data, view.data_len) < 0) return;
+    remember(arg, frames);
+    for (int mode = 0; mode < 2; mode++) msgbuf_unref(frames[mode]);
+}
+
+// Open a session here, with no history yet. Called with self->lock held.
+// history and history_bytes are how many messages and how many bytes of
+// them it keeps, -1 for the defaults.
+Session *create_session(Shard *self, const char *session_id, int history, int history_bytes) {
+    int index = slab_alloc(&self->sessions);
+    if (index == -1) return NULL;
+    Session *sess = slab_get(&self->sessions, index);
+    strcpy(sess->session_id, session_id);
+    sess->handle = index;
+    sess->count = 0;
+    memset(sess->on_shard, 0, sizeof(sess->on_shard));
+    bucket_init(&sess->messages, &session_limit, metrics_now());
+    bucket_init(&sess->bytes, &session_byte_limit, metrics_now());
+    sess->history_limit = history < 0 ? default_history : history > HISTORY_MAX ? HISTORY_MAX : history;
+    sess->history_byte_limit = history_bytes < 0 ? HISTORY_BYTES :
+                               history_bytes > HISTORY_BYTES_MAX ? HISTORY_BYTES_MAX : history_bytes;
+    registry_insert(&self->session_registry, sess->session_id, index);
+    STAT_ADD(self->stats.sessions_opened, 1);
+    return sess;
+}
+
+// Start a new session's history from what the log holds. The history is
+// the owner's alone, so this runs without self->lock, which the federation
+// thread would otherwise wait on while the log is read.
+void load_history(Session *sess) {
+    if (msglog && sess->history_limit > 0) {
+        msglog_history(msglog, sess->session_id, sess->history_limit, restore_message, sess);
+    }
+}
+
+// Owner side of JOIN and NEW_SESS. Fills in the answer for m->conn. A
+// session open only on other nodes is opened here too when someone joins it.
+void owner_join(Shard *self, ShardMsg *m) {
+    int remote = 0;
+    if (federation) {
+        statlock_lock(&cluster_lock);
+        remote = cluster_count(m->session_id) >= 0;
+        statlock_unlock(&cluster_lock);
+    }
+
+    statlock_lock(&self->lock);
+    Session *sess = find_session(self, m->session_id);
+    int created = 0;
+    if (m->kind == SHARD_JOIN) {
+        if (!sess && remote) {
+            sess = create_session(self, m->session_id, -1, -1);
+            created = 1;
+        }
+        if (!sess) {
+            m->type = 7; // JN_NAK
+            strcpy(m->data, remote ? "Max sessions reached" : "Session not found");
+            m->join = 0;
+        } else {
+            m->type = 6; // JN_ACK
+            m->join = 1;
+        }
+    } else if (sess || remote) {
+        // Session already exists, reject the request
+        m->type = 7; // JN_NAK
+        strcpy(m->data, "Session already exists");
+        m->join = 0;
+    } else {
+        // Session doesn't exist, create it
+        sess = create_session(self, m->session_id, m->count, m->history_bytes);
+        created = 1;
+        if (sess) {
+            m->type = 10; // NS_ACK
+        } else {
+            m->type = 7; // JN_NAK
+            strcpy(m->data, "Max sessions reached");
+            m->join = 0;
+        }
+    }
+    if (m->join) {
+        sess->count++;
+        sess->on_shard[m->from]++;
+    }
+    int count = sess ? sess->count : -1;
+    if (m->type != 7) strcpy(m->data, m->session_id);
+    statlock_unlock(&self->lock);
+
+    if (sess && created) load_history(sess);
+    if (m->type == 6 && sess->history_count > 0) {
+        // The joiner's shard sends these after JN_ACK. Anything newer goes
+        // to that shard after this answer, so nothing is missed or repeated.
+        m->history = malloc(sess->history_count * sizeof(HistoryEntry));
+        for (int i = 0; m->history && i < sess->history_count; i++) {
+            m->history[i] = sess->history[(sess->history_start + i) % sess->history_limit];
+            for (int mode = 0; mode < 2; mode++) msgbuf_ref(m->history[i].frame[mode]);
+        }
+        if (m->history) m->history_count = sess->history_count;
+    }
+    if (m->type != 7) publish_session(m->session_id, count);
+}
+
+// Called with self->lock held.
+void close_session(Shard *self, Session *sess) {
+    forget_history(sess);
+    registry_remove(&self->session_registry, sess->session_id);
+    memset(sess->session_id, 0, MAX_NAME);
+    slab_free(&self->sessions, sess->handle);
+    STAT_ADD(self->stats.sessions_closed, 1);
+}
+
+// Owner side of LEAVE_SESS. The last member out closes the session.
+void owner_leave(Shard *self, int from, const char *session_id) {
+    statlock_lock(&self->lock);
+    Session *sess = find_session(self, session_id);
+    int count = -1;
+    if (sess) {
+        sess->count--;
+        sess->on_shard[from]--;
+        count = sess->count;
+        if (sess->count == 0) {
+            close_session(self, sess);
+            count = -1;
+        }
+    }
+    statlock_unlock(&self->lock);
+    if (sess) publish_session(session_id, count);
+}
+
+// Apply the owner's answer on the connection's own shard.
+void finish_join(Shard *self, ShardMsg *m) {
+    Connection *conn = m->conn;
+    if (m->join && conn->client) {
+        add_member(self, conn, m->session_id);
+        statlock_lock(&clients_mutex);
+        strcpy(conn->client->session, m->session_id);
+        statlock_unlock(&clients_mutex);
+        publish_user(conn->client->id, m->session_id, 0);
+    }
+    send_response(conn, m->mode, m->type, m->data);
+    for (int i = 0; i < m->history_count; i++) {
+        if (m->join && conn->client) conn_send_buf(conn, m->history[i].frame[conn->client->mode]);
+        for (int mode = 0; mode < 2; mode++) msgbuf_unref(m->history[i].frame[mode]);
+    }
+    free(m->history);
+    // After the answer, so the joiner hears of its own join second.
+    if (m->join && conn->client) session_event(self, conn->client->id, "joined", m->session_id);
+}
+
+// A count after a space in NEW_SESS's data, advancing *p past it. -1 if
+// there is no number there.
+int parse_count(const char **p, int max) {
+    if (**p != ' ' || (*p)[1] < '0' || (*p)[1] > '9') return -1;
+    char *end;
+    long n = strtol(*p + 1, &end, 10);
+    *p = end;
+    return n > max ? max : (int)n;
+}
+
+// NEW_SESS data is the session's name, then optionally how many messages
+// and how many bytes of them its history keeps. Fills those in, with -1 for
+// the limits not given, and returns NULL, or why the request is refused.
+const char *parse_new_session(const char *data, char *session_id, int *history, int *history_bytes) {
+    size_t len = strcspn(data, " ");
+    if (len >= MAX_NAME) return "Session name too long";
+    memcpy(session_id, data, len);
+    session_id[len] = '\0';
+    const char *p = data + len;
+    *history = parse_count(&p, HISTORY_MAX);
+    *history_bytes = *history < 0 ? -1 : parse_count(&p, HISTORY_BYTES_MAX);
+    // Anything else would be taken for the rest of a name.
+    if (*p) return "Session names cannot contain spaces";
+    return NULL;
+}
+
+// Send a JOIN or NEW_SESS to the session's owner. A remote owner answers
+// through the inbox; until then the connection's input is held, so its
+// commands still run in the order they were sent. history and history_bytes
+// are NEW_SESS's limits, -1 for the defaults.
+void request_join(Shard *self, Connection *conn, int kind, int mode, const char *session_id,
+                  int history, int history_bytes) {
+    ShardMsg *m = new_shard_msg(kind, self->id);
+    m->conn = conn;
+    m->mode = mode;
+    m->join = conn->client != NULL;
+    strcpy(m->session_id, session_id);
+    m->count = history;
+    m->history_bytes = history_bytes;
+
+    int owner = owner_of(m->session_id);
+    if (owner == self->id) {
+        owner_join(self, m);
+        finish_join(self, m);
+        release_shard_msg(self, m);
+        return;
+    }
+    conn->waiting = 1;
+    post(&shards[owner].inbox, m);
+}
+
+void leave_session(Shard *self, Connection *conn) {
+    if (!conn->replica) return;
+    char session_id[MAX_NAME];
+    strcpy(session_id, conn->replica->session_id);
+    remove_member(self, conn);
+
+    statlock_lock(&clients_mutex);
+    memset(conn->client->session, 0, MAX_NAME);
+    statlock_unlock(&clients_mutex);
+    publish_user(conn->client->id, "", 0);
+    // Ahead of the LEAVE, which may close the session.
+    session_event(self, conn->client->id, "left", session_id);
+
+    int owner = owner_of(session_id);
+    if (owner == self->id) {
+        owner_leave(self, self->id, session_id);
+    } else {
+        ShardMsg *m = new_shard_msg(SHARD_LEAVE, self->id);
+        strcpy(m->session_id, session_id);
+        post(&shards[owner].inbox, m);
+    }
+}
+
+// Log a user out and give its slot back.
+void release_client(Shard *self, Connection *conn) {
+    Client *client = conn->client;
+    leave_session(self, conn);
+    remove_subscriber(self, conn);
+    STAT_ADD(self->stats.logouts, 1);
+    publish_user(client->id, "", 1);
+    user_event(self, client->id, "offline");
+    statlock_lock(&clients_mutex);
+    registry_remove(&client_registry, client->id);
+    client->active = 0;
+    client->socket = -1;
+    slab_free(&client_slab, client->handle);
+    statlock_unlock(&clients_mutex);
+    conn->client = NULL;
+}
+
+// Handle one command from a connection. Commands act on the user logged in
+// on it, whatever source they name. Returns -1 once the connection should
+// be closed.
+int handle_message(Shard *self, Connection *conn, MessageView *msg, uint64_t start) {
+    int client_socket = conn->fd;
+    Client *client = conn->client;
+    Message response;
+
+    memset(&response, 0, sizeof(Message));
+
+    switch (msg->type) {
+        case 1: { // LOGIN
+            int valid = open_login && msg->source_len > 0;
+            for (int i = 0; !valid && i < num_valid_clients; i++) {
+                if (strcmp(valid_clients[i].id, msg->source) == 0 &&
+                    strcmp(valid_clients[i].password, msg->data) == 0) {
+                    valid = 1;
+                    break;
+                }
+            }
+
+            statlock_lock(&clients_mutex);
+            int taken = find_client(msg->source) != NULL;
+            if (valid && !taken && federation) {
+                // Logged in on another node
+                statlock_lock(&cluster_lock);
+                taken = cluster_has_user(msg->source);
+                statlock_unlock(&cluster_lock);
+            }
+            if (valid && !client && !taken) {
+                int index = slab_alloc(&client_slab);
+                if (index != -1) {
+                    Client *c = slab_get(&client_slab, index);
+                    *c = valid_clients[0]; // Copy valid client
+                    c->socket = client_socket;
+                    c->active = 1;
+                    c->mode = msg->mode;
+                    c->handle = index;
+                    strcpy(c->id, msg->source);
+                    registry_insert(&client_registry, c->id, index);
+                    conn->client = c;
+                }
+                response.type = (index != -1) ? 2 : 3; // LO_ACK/LO_NAK
+                if (index == -1) strcpy(response.data, "Server full");
+            } else {
+                response.type = 3; // LO_NAK
+                strcpy(response.data, !client ? "Invalid credentials" : "Already logged in");
+            }
+            statlock_unlock(&clients_mutex);
+            if (response.type == 2) {
+                STAT_ADD(self->stats.logins, 1);
+                publish_user(msg->source, "", 0);
+                user_event(self, msg->source, "online");
+            }
+            break;
+        }
+
+        // In client_handler() switch-case:
+        case 4: { // EXIT (logout)
+            if (client) release_client(self, conn);
+
+            // Acknowledge logout
+            Message response = {0};
+            response.type = 4; // EXIT_ACK
+            char res_buffer[MAX_FRAME];
+            size_t len = serialize_message(&response, res_buffer, msg->mode);
+            conn_send(conn, res_buffer, len);
+
+            // Do NOT close the socket or exit the thread
+            break;
+        }
+
+        case 5: { // JOIN
+            if (!client) {
+                response.type = 7; // JN_NAK
+                strcpy(response.data, "Not logged in");
+            }
+            else if (conn->replica) {
+                response.type = 7; // JN_NAK
+                strcpy(response.data, "Already in session");
+            }
+            else if (strlen(msg->data) >= MAX_NAME) {
+                response.type = 7; // JN_NAK
+                strcpy(response.data, "Session name too long");
+            }
+            else if (strchr(msg->data, ' ')) {
+                response.type = 7; // JN_NAK
+                strcpy(response.data, "Session names cannot contain spaces");
+            }
+            else {
+                // The owner answers
+                request_join(self, conn, SHARD_JOIN, msg->mode, msg->data, -1, -1);
+            }
+            break;
+        }
+        // In client_handler() switch-case:
+        case 8: { // LEAVE_SESS
+            if (!client) {
+                // Not logged in
+                response.type = 3; // LO_NAK
+                strcpy(response.data, "Not logged in");
+            } else if (!conn->replica) {
+                // Not in a session
+                response.type = 7; // JN_NAK
+                strcpy(response.data, "Not in any session");
+            } else {
+                // Remove from session
+                leave_session(self, conn);
+                response.type = 8; // LEAVE_SESS_ACK
+                strcpy(response.data, "Left session successfully");
+            }
+            break;
+        }
+        case 9: { // NEW_SESS
+            if (client && conn->replica) {
+                response.type = 7; // JN_NAK
+                strcpy(response.data, "Already in a session");
+                break;
+            }
+            char session_id[MAX_NAME];
+            int history, history_bytes;
+            const char *error = parse_new_session(msg->data, session_id, &history, &history_bytes);
+            if (error) {
+                response.type = 7; // JN_NAK
+                strcpy(response.data, error);
+                break;
+            }
+
+            // The owner creates it and answers
+            request_join(self, conn, SHARD_NEW, msg->mode, session_id, history, history_bytes);
+            break;
+        }
+
+        case 11: // MESSAGE
+            if (client && conn->replica) {
+                // Encoded once per wire format here; the owner passes the
+                // same bytes to every shard with members, and they to every
+                // member's queue.
+                MsgBuf *frame[2];
+                if (encode_frames(frame, 11, client->id, strlen(client->id), msg->data, msg->data_len) < 0) break;
+
+                send_to_session(self, conn->replica->session_id, frame, start);
+            }
+            break;
+
+
+
+        case 12: { // QUERY
+            // One page of the presence index per request. An empty request
+            // starts the listing; a client that gets a next=<cursor> source
+            // back asks again with the cursor as its data for the rest.
+            char list[MAX_DATA];
+            int cursor = atoi(msg->data);
+            if (cursor < 0) cursor = 0;
+            cursor = presence_page(&presence, cursor, list, sizeof(list));
+
+            // A text frame ends at the first newline, so text clients get ~
+            // instead. Binary frames carry the list as it is.
+            if (msg->mode == WIRE_TEXT) {
+                for (char *p = list; *p; p++) {
+                    if (*p == '\n') *p = '~';
+                }
+            }
+
+            response.type = 13;
+            response.size = strlen(list);
+            if (cursor < 0) {
+                strcpy(response.source, "SERVER");
+            } else {
+                snprintf((char *)response.source, MAX_NAME, "next=%d", cursor);
+            }
+            strcpy(response.data, list);
+            break;
+        }
+        case 14: { // QUIT
+            if (client) release_client(self, conn);
+
+            // Acknowledge quit
+            Message response = {0};
+            response.type = 14; // QUIT_ACK
+            char res_buffer[MAX_FRAME];
+            size_t len = serialize_message(&response, res_buffer, msg->mode);
+            conn_send(conn, res_buffer, len);
+
+            // Close the connection
+            return -1;
+        }
+
+        case 15: // SUBSCRIBE to presence events, "off" to stop
+            if (!client) {
+                response.type = 3;
+                strcpy(response.data, "Not logged in");
+            } else if (strcmp(msg->data, "off") == 0) {
+                remove_subscriber(self, conn);
+                response.type = 16; // SUB_ACK
+                strcpy(response.data, "off");
+            } else {
+                add_subscriber(self, conn);
+                response.type = 16;
+                strcpy(response.data, "on");
+            }
+            break;
+
+        case PING:
+            response.type = PONG;
+            break;
+
+        case PONG: // Being heard from was the point
+            break;
+
+        default:
+            response.type = 3;
+            strcpy(response.data, "Unknown command");
+    }
+
+    if (response.type != 0) {
+        char res_buffer[MAX_FRAME];
+        size_t len = serialize_message(&response, res_buffer, msg->mode);
+        conn_send(conn, res_buffer, len);
+    }
+    return 0;
+}
+
+// Stop handling a connection's input until its buckets allow more.
+void pause_connection(Shard *self, Connection *conn) {
+    uint64_t wait = bucket_wait(&conn->commands, &command_limit);
+    uint64_t bytes_wait = bucket_wait(&conn->bytes, &byte_limit);
+    if (bytes_wait > wait) wait = bytes_wait;
+    conn->paused = 1;
+    self->num_paused++;
+    wheel_add(&self->resumes, &conn->resume, metrics_now() + wait);
+    STAT_ADD(self->stats.throttled, 1);
+}
+
+// Write out what was queued while the socket was full, then handle every
+// complete message and read everything the socket has (it is
+// edge-triggered). Stops early while a request is out at another shard; the
+// answer calls this again. Returns -1 once the connection should be closed.
+int service_connection(Shard *self, Connection *conn) {
+    if (outq_flush(&conn->out, conn->fd) < 0) return -1;
+    while (1) {
+        MessageView msg;
+        int rc = 0;
+        while (!conn->waiting && !conn->paused) {
+            // The limits are checked before a frame is parsed, and charged
+            // with what it turns out to cost.
+            uint64_t start = metrics_now();
+            int over = !bucket_ready(&conn->commands, &command_limit, start) ||
+                       !bucket_ready(&conn->bytes, &byte_limit, start);
+            if (over && flood_action == FLOOD_THROTTLE) {
+                pause_connection(self, conn);
+                break;
+            }
+            if (over && flood_action == FLOOD_DISCONNECT) {
+                STAT_ADD(self->stats.flood_closed, 1);
+                return -1;
+            }
+            size_t offset = conn->in.start;
+            if ((rc = inbuf_next(&conn->in, &msg)) <= 0) break;
+            if (over) {
+                STAT_ADD(self->stats.flood_dropped, 1);
+                continue;
+            }
+            bucket_take(&conn->commands, &command_limit, 1);
+            bucket_take(&conn->bytes, &byte_limit, conn->in.start - offset);
+            STAT_ADD(self->stats.commands[msg.type < STAT_COMMANDS ? msg.type : 0], 1);
+            conn->mode = msg.mode;
+            rc = handle_message(self, conn, &msg, start);
+            hist_record(&self->stats.command, metrics_now() - start);
+            if (rc < 0) return -1;
+        }
+        // A paused connection is not read either, so a client sending
+        // faster than its limits is slowed down by TCP.
+        if (conn->waiting || conn->paused) return 0;
+        if (rc < 0) return -1; // Not our protocol
+
+        ssize_t n = inbuf_fill(&conn->in, conn->fd);
+        if (n > 0) {
+            STAT_ADD(self->stats.bytes_in, n);
+            conn->heard = metrics_now();
+        }
+        if (n == 0) return -1; // Connection closed
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+    }
+}
+
+// Log out whoever was using the connection. It is freed once this batch of
+// events is handled, as a later event in the batch may still name it.
+void close_connection(Shard *self, Connection *conn) {
+    if (conn->client) release_client(self, conn);
+    outq_close(&conn->out);
+    epoll_ctl(self->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    conn->closed = 1;
+    wheel_remove(&conn->timer);
+    if (conn->paused) {
+        wheel_remove(&conn->resume);
+        self->num_paused--;
+    }
+    if (conn->open_prev) {
+        conn->open_prev->open_next = conn->open_next;
+    } else {
+        self->open = conn->open_next;
+    }
+    if (conn->open_next) conn->open_next->open_prev = conn->open_prev;
+    STAT_ADD(self->stats.closed, 1);
+    conn->next = self->reap;
+    self->reap = conn;
+}
+
+// Serve a connected, non-blocking socket on this shard. Returns NULL, the
+// socket closed, if it cannot.
+Connection *add_connection(Shard *self, int fd) {
+    Connection *conn = calloc(1, sizeof(Connection));
+    if (!conn) {
+        perror("calloc");
+        close(fd);
+        return NULL;
+    }
+    conn->fd = fd;
+    conn->stats = &self->stats;
+    inbuf_init(&conn->in);
+    outq_init(&conn->out, outq_limit);
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = conn };
+    if (epoll_ctl(self->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl");
+        close(fd);
+        outq_destroy(&conn->out);
+        free(conn);
+        return NULL;
+    }
+    conn->open_next = self->open;
+    if (self->open) self->open->open_prev = conn;
+    self->open = conn;
+    conn->heard = metrics_now();
+    if (idle_timeout) wheel_add(&self->timers, &conn->timer, conn->heard + idle_timeout / 2);
+    bucket_init(&conn->commands, &command_limit, conn->heard);
+    bucket_init(&conn->bytes, &byte_limit, conn->heard);
+    STAT_ADD(self->stats.accepted, 1);
+    return conn;
+}
+
+// A throttled connection may go on.
+void resume(WheelNode *node, void *arg) {
+    Shard *self = arg;
+    Connection *conn = (Connection *)((char *)node - offsetof(Connection, resume));
+    conn->paused = 0;
+    self->num_paused--;
+    if (service_connection(self, conn) < 0) close_connection(self, conn);
+}
+
+// A connection's idle deadline came. It is pinged once half the timeout has
+// passed since it was last heard from and closed once all of it has; until
+// then it is put back for the time left. Traffic itself only stamps heard,
+// and the wheel catches up when the deadline comes.
+void expire(WheelNode *node, void *arg) {
+    Shard *self = arg;
+    Connection *conn = (Connection *)((char *)node - offsetof(Connection, timer));
+    uint64_t now = metrics_now(), idle = now - conn->heard;
+    if (conn->waiting) {
+        // The reply from the owner shard needs it; look again after that.
+        wheel_add(&self->timers, node, now + WHEEL_TICK_MS * 1000000ULL);
+    } else if (idle >= idle_timeout) {
+        STAT_ADD(self->stats.idle_closed, 1);
+        close_connection(self, conn);
+    } else if (idle >= idle_timeout / 2) {
+        send_response(conn, conn->mode, PING, "");
+        wheel_add(&self->timers, node, conn->heard + idle_timeout);
+    } else {
+        wheel_add(&self->timers, node, conn->heard + idle_timeout / 2);
+    }
+}
+
+void accept_connections(Shard *self, int listen_fd) {
+    while (1) {
+        int new_socket = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK);
+        if (new_socket < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+            return;
+        }
+        add_connection(self, new_socket);
+    }
+}
+
+// A handoff stops every shard and the federation thread here before it
+// touches their state, and lets them go on if it fails.
+static pthread_mutex_t handoff_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t handoff_cond = PTHREAD_COND_INITIALIZER;
+static int handing_off;        // Written under handoff_mutex, read atomically
+static int parked;             // Threads stopped, under handoff_mutex
+
+void park(void) {
+    pthread_mutex_lock(&handoff_mutex);
+    parked++;
+    pthread_cond_broadcast(&handoff_cond);
+    while (handing_off) pthread_cond_wait(&handoff_cond, &handoff_mutex);
+    parked--;
+    pthread_mutex_unlock(&handoff_mutex);
+}
+
+// Handle what other shards sent. One shard's messages arrive in the order it
+// sent them, so a session's members get its messages in the order its owner
+// saw them, and a join is answered only after the messages before it.
+// Returns how many there were.
+int drain_inbox(Shard *self) {
+    ShardMsg *m;
+    int n = 0;
+    while ((m = inbox_next(&self->inbox))) {
+        n++;
+        STAT_ADD(self->stats.shard_messages, 1);
+        switch (m->kind) {
+            case SHARD_JOIN:
+            case SHARD_NEW:
+                owner_join(self, m);
+                m->kind = SHARD_REPLY;
+                post(&shards[m->from].inbox, m);
+                continue; // Now the reply
+            case SHARD_LEAVE:
+                owner_leave(self, m->from, m->session_id);
+                break;
+            case SHARD_MESSAGE:
+                fan_out(self, m->session_id, m->frame, m->from >= 0, m->at);
+                break;
+            case SHARD_DELIVER:
+                deliver(self, m->session_id, m->frame, m->at);
+                for (int mode = 0; mode < 2; mode++) msgbuf_unref(m->frame[mode]);
+                break;
+            case SHARD_NOTIFY:
+                notify(self, m->frame);
+                for (int mode = 0; mode < 2; mode++) msgbuf_unref(m->frame[mode]);
+                break;
+            case SHARD_REPLY: {
+                Connection *conn = m->conn;
+                finish_join(self, m);
+                conn->waiting = 0;
+                // Once a handoff has begun, the rest of its input is left
+                // for the new process.
+                if (__atomic_load_n(&handing_off, __ATOMIC_ACQUIRE)) break;
+                if (service_connection(self, conn) < 0) close_connection(self, conn);
+                break;
+            }
+            case SHARD_HANDOFF:
+                park();
+                break;
+        }
+        release_shard_msg(self, m);
+    }
+    return n;
+}
+
+void *shard_main(void *arg) {
+    Shard *self = arg;
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        int timeout = self->num_paused ? THROTTLE_TICK_MS : idle_timeout ? WHEEL_TICK_MS : -1;
+        int n = epoll_wait(self->epfd, events, MAX_EVENTS, timeout);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == &listen_event) {
+                accept_connections(self, self->listen_fd);
+            } else if (ptr == &extra_listen_event) {
+                for (int j = 0; j < self->num_extra_fds; j++) accept_connections(self, self->extra_fds[j]);
+            } else if (ptr == &inbox_event) {
+                drain_inbox(self);
+            } else {
+                // A connection waiting on another shard is serviced when the
+                // answer comes; edge-triggered events it misses until then
+                // are caught up by reading to EAGAIN.
+                Connection *conn = ptr;
+                if (conn->closed || conn->waiting) continue;
+                if (service_connection(self, conn) < 0) close_connection(self, conn);
+            }
+        }
+        if (idle_timeout) wheel_advance(&self->timers, metrics_now(), expire, self);
+        if (self->num_paused) wheel_advance(&self->resumes, metrics_now(), resume, self);
+
+        while (self->reap) {
+            Connection *conn = self->reap;
+            self->reap = conn->next;
+            outq_destroy(&conn->out);
+            free(conn);
+        }
+    }
+    return NULL;
+}
+
+// A listening socket on port. shared: one of the shards' sockets, which
+// all bind the same port.
+int open_listener(const char *port, int shared) {
+    int server_fd;
+    struct sockaddr_in address;
+    int opt = 1;
+
+    if ((server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+        perror("socket failed");
+        exit(EXIT_FAILURE);
+    }
+
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) ||
+        (shared && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)))) {
+        perror("setsockopt");
+        exit(EXIT_FAILURE);
+    }
+
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(atoi(port));
+
+    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        perror("bind failed");
+        exit(EXIT_FAILURE);
+    }
+
+    if (listen(server_fd, SOMAXCONN) < 0) {
+        perror("listen");
+        exit(EXIT_FAILURE);
+    }
+    return server_fd;
+}
+
+// A hot upgrade: a new server started with the same -U connects to the
+// running one, which stops its threads and sends over that socket, one
+// packet per record, its listening sockets, its sessions with their
+// history, and each connection's socket with its user, its session and the
+// bytes it had not yet parsed or written. The new server takes up where the
+// old one stopped and acknowledges, and the old one exits. Clients see no
+// more than a pause. Links to other nodes are not handed over; they are
+// dialed again and resynced.
+#define HANDOFF_LISTENER 1     // fd: the listening socket of shard value, -1 for peers,
+                               // -2 for the admin port. Past the last shard: one kept
+                               // from an older server with more shards
+#define HANDOFF_SESSION 2      // A session keeping value messages, bytes bytes, of history
+#define HANDOFF_HISTORY 3      // data: a message in the last session's history, binary
+#define HANDOFF_CONNECTION 4   // fd: a client, its user's wire format in value. data:
+                               // its unparsed input
+#define HANDOFF_OUTPUT 5       // data: bytes not yet written to the last connection
+#define HANDOFF_END 6
+
+typedef struct {
+    int kind;
+    int value;
+    int bytes;                 // SESSION: bytes of history it keeps
+    int mode;                  // CONNECTION: wire format of its last command
+    int subscribed;            // CONNECTION: gets presence events
+    char name[MAX_NAME];       // SESSION: its name. CONNECTION: its user, "" if none
+    char session[MAX_NAME];    // CONNECTION: its user's session, "" if none
+} HandoffRecord;
+
+// A record received, kept until the shards are set up to take it.
 typedef struct {
-    unsigned int type;
-    unsigned int size;
-    unsigned char source[MAX_NAME];
-    unsigned char data[MAX_DATA];
-} Message;
+    HandoffRecord rec;
+    int fd;                    // Passed with it, -1 if none
+    char *data;
+    size_t len;
+} Inherited;
+
+static Inherited *inherited;
+static int num_inherited;
+
+// Send a record and its data, passing fd along unless it is -1. Returns -1
+// if the new server is gone.
+int send_record(int sock, const HandoffRecord *rec, const char *data, size_t len, int fd) {
+    struct iovec iov[2] = { { (void *)rec, sizeof(*rec) }, { (void *)data, len } };
+    union {
+        struct cmsghdr header;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = len ? 2 : 1 };
+    if (fd >= 0) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    while (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0) {
+        if (errno != EINTR) {
+            perror("sendmsg");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Receive a record, its data into data (INBUF_SIZE bytes) and the socket
+// passed with it into *fd. Returns the data's length, -1 if the old server
+// is gone or sent something else.
+ssize_t recv_record(int sock, HandoffRecord *rec, char *data, int *fd) {
+    struct iovec iov[2] = { { rec, sizeof(*rec) }, { data, INBUF_SIZE } };
+    union {
+        struct cmsghdr header;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2, .msg_control = control.buf,
+                          .msg_controllen = sizeof(control.buf) };
+    ssize_t n;
+    while ((n = recvmsg(sock, &msg, 0)) < 0 && errno == EINTR);
+    *fd = -1;
+    struct cmsghdr *cmsg = n >= 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    if (n < (ssize_t)sizeof(*rec) || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        if (*fd >= 0) close(*fd);
+        return -1;
+    }
+    return n - sizeof(*rec);
+}
 
-typedef struct {
-    char id[MAX_NAME];
-    char password[MAX_NAME];
-    int socket;
-    char session[MAX_NAME];
-    int active;
-} Client;
+// Old side. Stop every thread that changes state and finish what they had
+// sent each other, so nothing is half done.
+void stop_threads(void) {
+    int threads = num_shards + (federation ? 1 : 0);
+    pthread_mutex_lock(&handoff_mutex);
+    __atomic_store_n(&handing_off, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&handoff_mutex);
+    for (int i = 0; i < num_shards; i++) post(&shards[i].inbox, new_shard_msg(SHARD_HANDOFF, -1));
+    if (federation) post(&federation->inbox, new_shard_msg(SHARD_HANDOFF, -1));
+    pthread_mutex_lock(&handoff_mutex);
+    while (parked < threads) pthread_cond_wait(&handoff_cond, &handoff_mutex);
+    pthread_mutex_unlock(&handoff_mutex);
+
+    // A join answered here may post its reply to another shard.
+    int busy = 1;
+    while (busy) {
+        busy = 0;
+        for (int i = 0; i < num_shards; i++) {
+            if (drain_inbox(&shards[i]) > 0) busy = 1;
+        }
+    }
+}
+
+// Carry on after a failed handoff, with the input left unread meanwhile.
+void resume_threads(void) {
+    __atomic_store_n(&handing_off, 0, __ATOMIC_RELEASE);
+    for (int i = 0; i < num_shards; i++) {
+        Connection *conn = shards[i].open;
+        while (conn) {
+            Connection *next = conn->open_next;
+            if (service_connection(&shards[i], conn) < 0) close_connection(&shards[i], conn);
+            conn = next;
+        }
+    }
+    pthread_mutex_lock(&handoff_mutex);
+    pthread_cond_broadcast(&handoff_cond);
+    pthread_mutex_unlock(&handoff_mutex);
+}
 
 typedef struct {
-    char session_id[MAX_NAME];
-    Client* participants[MAX_CLIENTS];
-    int count;
-} Session;
+    int sock;
+    int rc;
+} PendingOutput;
 
-Client clients[MAX_CLIENTS];
-Session sessions[MAX_SESSIONS];
-pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t sessions_mutex = PTHREAD_MUTEX_INITIALIZER;
+void send_output(void *arg, const char *data, size_t len) {
+    PendingOutput *out = arg;
+    HandoffRecord rec = { .kind = HANDOFF_OUTPUT };
+    if (out->rc == 0) out->rc = send_record(out->sock, &rec, data, len, -1);
+}
 
-const Client valid_clients[] = {
-    {"a", "1", -1, "", 0},
-    {"b", "2", -1, "", 0},
-    {"c", "3", -1, "", 0},
-    {"d", "4", -1, "", 0},
-};
-const int num_valid_clients = 4;
+// Old side, with the threads stopped. Returns 0 once the new server has
+// acknowledged all of it.
+int hand_off(int sock) {
+    HandoffRecord rec;
+    for (int i = -2; i < num_shards; i++) {
+        int fd = i == -2 ? admin_fd : i == -1 ? (federation ? federation->listen_fd : -1) : shards[i].listen_fd;
+        if (fd < 0) continue;
+        memset(&rec, 0, sizeof(rec));
+        rec.kind = HANDOFF_LISTENER;
+        rec.value = i;
+        if (send_record(sock, &rec, NULL, 0, fd) < 0) return -1;
+    }
+    // Numbered on from the shards', so a newer server with more shards
+    // gives them each one of these before opening any.
+    int extra = num_shards;
+    for (int i = 0; i < num_shards; i++) {
+        for (int j = 0; j < shards[i].num_extra_fds; j++) {
+            memset(&rec, 0, sizeof(rec));
+            rec.kind = HANDOFF_LISTENER;
+            rec.value = extra++;
+            if (send_record(sock, &rec, NULL, 0, shards[i].extra_fds[j]) < 0) return -1;
+        }
+    }
 
-void serialize_message(Message *msg, char *buffer) {
-    snprintf(buffer, BUF_SIZE, "%u:%u:%s:%s\n", 
-            msg->type, msg->size, msg->source, msg->data);
-}
-
-ssize_t read_line(int sockfd, char *buffer, size_t maxlen) {
-    size_t n = 0;
-    char c;
-    while (n < maxlen - 1) {
-        ssize_t rc = recv(sockfd, &c, 1, 0);
-        if (rc == 1) {
-            buffer[n++] = c;
-            if (c == '\n') break;
-        } else if (rc == 0) {
-            break; // Connection closed
-        } else {
-            return -1; // Error
+    for (int i = 0; i < num_shards; i++) {
+        Shard *shard = &shards[i];
+        for (int handle = 0; handle < shard->sessions.next; handle++) {
+            Session *sess = slab_get(&shard->sessions, handle);
+            if (!sess->session_id[0]) continue;
+            memset(&rec, 0, sizeof(rec));
+            rec.kind = HANDOFF_SESSION;
+            rec.value = sess->history_limit;
+            rec.bytes = sess->history_byte_limit;
+            strcpy(rec.name, sess->session_id);
+            if (send_record(sock, &rec, NULL, 0, -1) < 0) return -1;
+            rec.kind = HANDOFF_HISTORY;
+            for (int j = 0; j < sess->history_count; j++) {
+                MsgBuf *frame = sess->history[(sess->history_start + j) % sess->history_limit].frame[WIRE_BINARY];
+                if (send_record(sock, &rec, frame->data, frame->len, -1) < 0) return -1;
+            }
+        }
+    }
+
+    for (int i = 0; i < num_shards; i++) {
+        for (Connection *conn = shards[i].open; conn; conn = conn->open_next) {
+            outq_flush(&conn->out, conn->fd); // What it takes now need not be carried over
+            memset(&rec, 0, sizeof(rec));
+            rec.kind = HANDOFF_CONNECTION;
+            rec.mode = conn->mode;
+            if (conn->client) {
+                strcpy(rec.name, conn->client->id);
+                rec.value = conn->client->mode;
+                rec.subscribed = conn->subscribed;
+                if (conn->replica) strcpy(rec.session, conn->replica->session_id);
+            }
+            if (send_record(sock, &rec, conn->in.buf + conn->in.start, conn->in.end - conn->in.start, conn->fd) < 0) {
+                return -1;
+            }
+            PendingOutput out = { sock, 0 };
+            outq_pending(&conn->out, send_output, &out);
+            if (out.rc < 0) return -1;
         }
     }
-    buffer[n] = '\0';
-    return n;
-}
 
-void deserialize_message(char *buffer, Message *msg) {
-    sscanf(buffer, "%u:%u:%[^:]:%[^\n]", 
-          &msg->type, &msg->size, msg->source, msg->data);
+    memset(&rec, 0, sizeof(rec));
+    rec.kind = HANDOFF_END;
+    if (send_record(sock, &rec, NULL, 0, -1) < 0) return -1;
+    char ack;
+    ssize_t n;
+    while ((n = recv(sock, &ack, 1, 0)) < 0 && errno == EINTR);
+    return n == 1 ? 0 : -1;
 }
 
-int find_client_index(char *id) {
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (clients[i].active && strcmp(clients[i].id, id) == 0) {
-            return i;
+// Wait for a newer server on the -U socket and hand everything to it.
+void *upgrade_main(void *arg) {
+    int listen_fd = *(int *)arg;
+    while (1) {
+        int sock = accept(listen_fd, NULL, NULL);
+        if (sock < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) perror("accept");
+            continue;
         }
+        stop_threads();
+        // The new server opens the log once this one has let go of it.
+        if (msglog) msglog_close(msglog);
+        if (hand_off(sock) == 0) {
+            printf("Handed over to the new server\n");
+            exit(EXIT_SUCCESS);
+        }
+        fprintf(stderr, "Handoff failed, carrying on\n");
+        close(sock);
+        if (msglog) {
+            msglog_open(msglog, msglog->dir, msglog->keep_segments, msglog->keep_per_session, msglog->sessions.max);
+        }
+        resume_threads();
     }
-    return -1;
+    return NULL;
+}
+
+int listen_for_upgrade(const char *path) {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(address.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd < 0) {
+        perror("socket failed");
+        exit(EXIT_FAILURE);
+    }
+    unlink(path); // Left by the server this one took over from, or one that died
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        perror("bind failed");
+        exit(EXIT_FAILURE);
+    }
+    if (listen(fd, 1) < 0) {
+        perror("listen");
+        exit(EXIT_FAILURE);
+    }
+    return fd;
 }
 
-int find_session_index(char *session_id) {
-    for (int i = 0; i < MAX_SESSIONS; i++) {
-        if (strlen(sessions[i].session_id) > 0 && 
-            strcmp(sessions[i].session_id, session_id) == 0) {
-            return i;
+// New side. Ask the server at path, if one is running, for its state, and
+// keep what it sends until the shards are set up. Returns 0 if none answered.
+int take_over(const char *path) {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (sock < 0) {
+        perror("socket failed");
+        exit(EXIT_FAILURE);
+    }
+    if (connect(sock, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        close(sock);
+        return 0;
+    }
+
+    int capacity = 0;
+    char data[INBUF_SIZE];
+    while (1) {
+        if (num_inherited == capacity) {
+            capacity = capacity ? 2 * capacity : 64;
+            inherited = realloc(inherited, capacity * sizeof(Inherited));
+            if (!inherited) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        Inherited *h = &inherited[num_inherited];
+        ssize_t len = recv_record(sock, &h->rec, data, &h->fd);
+        if (len < 0) {
+            // The old server carries on.
+            fprintf(stderr, "Handoff from %s failed\n", path);
+            exit(EXIT_FAILURE);
         }
+        if (h->rec.kind == HANDOFF_END) break;
+        h->data = malloc(len ? len : 1);
+        if (!h->data) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(h->data, data, len);
+        h->len = len;
+        num_inherited++;
+    }
+    if (send(sock, "", 1, MSG_NOSIGNAL) != 1) {
+        perror("send");
+        exit(EXIT_FAILURE);
+    }
+    close(sock);
+    return 1;
+}
+
+// The listening socket handed over for a shard (-1 for peers, -2 for the
+// admin port), -1 if none.
+int inherited_listener(int which) {
+    for (int i = 0; i < num_inherited; i++) {
+        Inherited *h = &inherited[i];
+        if (h->rec.kind != HANDOFF_LISTENER || h->rec.value != which || h->fd < 0) continue;
+        int fd = h->fd;
+        h->fd = -1;
+        return fd;
     }
     return -1;
 }
 
-void broadcast_message(Message *msg, char *session_id) {
-    pthread_mutex_lock(&sessions_mutex);
-    int session_idx = find_session_index(session_id);
-    if (session_idx == -1) {
-        pthread_mutex_unlock(&sessions_mutex);
-        return;
+// Serve a handed over connection on a shard, logged in and in its session
+// as it was.
+Connection *adopt_connection(Shard *self, Inherited *h) {
+    Connection *conn = add_connection(self, h->fd);
+    if (!conn) return NULL;
+    conn->mode = h->rec.mode;
+    memcpy(conn->in.buf, h->data, h->len);
+    conn->in.end = h->len;
+    if (!h->rec.name[0]) return conn;
+
+    statlock_lock(&clients_mutex);
+    int index = slab_alloc(&client_slab);
+    if (index != -1) {
+        Client *c = slab_get(&client_slab, index);
+        *c = valid_clients[0];
+        c->socket = conn->fd;
+        c->active = 1;
+        c->mode = h->rec.value;
+        c->handle = index;
+        strcpy(c->id, h->rec.name);
+        registry_insert(&client_registry, c->id, index);
+        conn->client = c;
     }
+    statlock_unlock(&clients_mutex);
+    if (!conn->client) return conn; // More users than -c allows here; it stays, logged out
+    STAT_ADD(self->stats.logins, 1);
 
-    char buffer[BUF_SIZE];
-    serialize_message(msg, buffer);
-    
-    Session *sess = &sessions[session_idx];
-    for (int i = 0; i < sess->count; i++) {
-        if (sess->participants[i]->socket != -1) {
-            send(sess->participants[i]->socket, buffer, strlen(buffer), 0);
+    if (h->rec.session[0]) {
+        Shard *owner = &shards[owner_of(h->rec.session)];
+        Session *sess = find_session(owner, h->rec.session);
+        if (!sess) {
+            sess = create_session(owner, h->rec.session, -1, -1);
+            if (sess) load_history(sess);
+        }
+        if (sess) {
+            sess->count++;
+            sess->on_shard[self->id]++;
+            add_member(self, conn, h->rec.session);
+            strcpy(conn->client->session, h->rec.session);
         }
     }
-    pthread_mutex_unlock(&sessions_mutex);
+    publish_user(conn->client->id, conn->client->session, 0);
+    if (h->rec.subscribed) add_subscriber(self, conn);
+    return conn;
 }
 
-void remove_from_session(int client_index) {
-    pthread_mutex_lock(&sessions_mutex);
-    Client *client = &clients[client_index];
-    if (strlen(client->session) == 0) {
-        pthread_mutex_unlock(&sessions_mutex);
+// Poll another socket on the port. Its shard is not running yet. There are
+// never more sockets on the port than MAX_SHARDS, one per shard of the
+// server that opened them.
+void add_extra_listener(Shard *shard, int fd) {
+    if (shard->num_extra_fds == MAX_SHARDS) {
+        close(fd);
         return;
     }
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &extra_listen_event };
+    if (epoll_ctl(shard->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+    shard->extra_fds[shard->num_extra_fds++] = fd;
+}
 
-    int session_idx = find_session_index(client->session);
-    if (session_idx == -1) {
-        pthread_mutex_unlock(&sessions_mutex);
-        return;
+// New side, with the shards set up but not yet running. Connections are
+// spread over the shards in turn.
+void adopt_inherited(void) {
+    Session *sess = NULL;
+    Connection *conn = NULL;
+    int next = 0, next_listener = 0;
+    for (int i = 0; i < num_inherited; i++) {
+        Inherited *h = &inherited[i];
+        switch (h->rec.kind) {
+            case HANDOFF_LISTENER:
+                // Not taken: the old server had more shards, or took links
+                // from peers or had an admin port. A client socket stays
+                // open, as the kernel goes on handing it connections, some
+                // perhaps already waiting; the shards poll it in turn.
+                if (h->fd < 0) break;
+                if (h->rec.value < 0) {
+                    close(h->fd);
+                    break;
+                }
+                add_extra_listener(&shards[next_listener], h->fd);
+                next_listener = (next_listener + 1) % num_shards;
+                break;
+            case HANDOFF_SESSION: {
+                Shard *owner = &shards[owner_of(h->rec.name)];
+                sess = find_session(owner, h->rec.name);
+                // Its history is what the old server had in memory, which
+                // follows as HISTORY records.
+                if (!sess) sess = create_session(owner, h->rec.name, h->rec.value, h->rec.bytes);
+                break;
+            }
+            case HANDOFF_HISTORY:
+                if (sess) restore_message(sess, h->data, h->len);
+                break;
+            case HANDOFF_CONNECTION:
+                conn = adopt_connection(&shards[next], h);
+                next = (next + 1) % num_shards;
+                break;
+            case HANDOFF_OUTPUT:
+                if (conn) conn_send(conn, h->data, h->len);
+                break;
+        }
+        free(h->data);
     }
+    free(inherited);
+    inherited = NULL;
+    num_inherited = 0;
 
-    Session *sess = &sessions[session_idx];
-    for (int i = 0; i < sess->count; i++) {
-        if (sess->participants[i] == client) {
-            // Shift remaining participants
-            for (int j = i; j < sess->count - 1; j++) {
-                sess->participants[j] = sess->participants[j+1];
+    // Sessions whose members could not all be taken over may be empty.
+    for (int i = 0; i < num_shards; i++) {
+        for (int handle = 0; handle < shards[i].sessions.next; handle++) {
+            sess = slab_get(&shards[i].sessions, handle);
+            if (!sess->session_id[0]) continue;
+            if (sess->count > 0) {
+                publish_session(sess->session_id, sess->count);
+            } else {
+                close_session(&shards[i], sess);
             }
-            sess->count--;
-            break;
         }
     }
+}
+
+void init_shard(Shard *shard, int id, const char *port) {
+    shard->id = id;
+    shard->epfd = epoll_create1(0);
+    if (shard->epfd < 0) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+    shard->listen_fd = inherited_listener(id);
+    if (shard->listen_fd < 0) shard->listen_fd = open_listener(port, 1);
+    inbox_init(&shard->inbox, shard->epfd, &inbox_event);
+    mpsc_init(&shard->returns);
+    statlock_init(&shard->lock);
+    wheel_init(&shard->timers, WHEEL_SLOTS, WHEEL_TICK_MS * 1000000ULL, metrics_now());
+    wheel_init(&shard->resumes, THROTTLE_SLOTS, THROTTLE_TICK_MS * 1000000ULL, metrics_now());
+    slab_init(&shard->sessions, sizeof(Session), max_sessions, NULL);
+    registry_init(&shard->session_registry, SLAB_OBJECTS);
+    // Its connections may be in sessions that any shard owns.
+    int replicas = max_sessions > INT_MAX / num_shards ? INT_MAX : max_sessions * num_shards;
+    slab_init(&shard->replicas, sizeof(Replica), replicas, NULL);
+    registry_init(&shard->replica_registry, SLAB_OBJECTS);
 
-    if (sess->count == 0) {
-        memset(sess, 0, sizeof(Session));
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &listen_event };
+    if (epoll_ctl(shard->epfd, EPOLL_CTL_ADD, shard->listen_fd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
     }
-    memset(client->session, 0, MAX_NAME);
-    pthread_mutex_unlock(&sessions_mutex);
 }
 
-void *client_handler(void *arg) {
-    int client_socket = *((int *)arg);
-    char buffer[BUF_SIZE];
-    Message msg, response;
+void peer_send(Peer *p, unsigned int type, const char *source, const char *data) {
+    char buffer[MAX_FRAME];
+    size_t len = encode_message(buffer, WIRE_BINARY, type, source, strlen(source), data, strlen(data));
+    MsgBuf *buf = msgbuf_copy(buffer, len);
+    if (!buf) return;
+    outq_send(&p->out, p->fd, buf, OUTQ_DISCONNECT);
+    msgbuf_unref(buf);
+}
 
-    while (1) {
-        ssize_t bytes = read_line(client_socket, buffer, sizeof(buffer));
-        if (bytes <= 0) break;
-
-        deserialize_message(buffer, &msg);
-        memset(&response, 0, sizeof(Message));
-
-        switch (msg.type) {
-            case 1: { // LOGIN
-                int valid = 0;
-                for (int i = 0; i < num_valid_clients; i++) {
-                    if (strcmp(valid_clients[i].id, msg.source) == 0 &&
-                        strcmp(valid_clients[i].password, msg.data) == 0) {
-                        valid = 1;
-                        break;
-                    }
-                }
+// Send a frame to every peer that has said HELLO.
+void peer_broadcast(Federation *fed, unsigned int type, const char *source, const char *data) {
+    for (int i = 0; i < MAX_PEERS; i++) {
+        if (fed->peers[i].up) peer_send(&fed->peers[i], type, source, data);
+    }
+}
 
-                pthread_mutex_lock(&clients_mutex);
-                if (valid && find_client_index(msg.source) == -1) {
-                    int index = -1;
-                    for (int i = 0; i < MAX_CLIENTS; i++) {
-                        if (!clients[i].active) {
-                            index = i;
-                            clients[i] = valid_clients[0]; // Copy valid client
-                            clients[i].socket = client_socket;
-                            clients[i].active = 1;
-                            strcpy(clients[i].id, msg.source);
-                            break;
-                        }
-                    }
-                    response.type = (index != -1) ? 2 : 3; // LO_ACK/LO_NAK
-                    if (index == -1) strcpy(response.data, "Server full");
-                } else {
-                    response.type = 3; // LO_NAK
-                    strcpy(response.data, "Invalid credentials");
-                }
-                pthread_mutex_unlock(&clients_mutex);
-                break;
-            }
+void peer_open(Federation *fed, Peer *p, int fd) {
+    p->fd = fd;
+    p->up = 0;
+    p->route[0] = p->routed[0] = '\0';
+    inbuf_init(&p->in);
+    outq_init(&p->out, PEER_OUTQ_LIMIT);
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = p };
+    if (epoll_ctl(fed->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+    char id[16];
+    snprintf(id, sizeof(id), "%d", node_id);
+    peer_send(p, PEER_HELLO, id, "");
+}
 
-            // In client_handler() switch-case:
-            case 4: { // EXIT (logout)
-                pthread_mutex_lock(&clients_mutex);
-                int client_idx = find_client_index(msg.source);
-                if (client_idx != -1) {
-                    // Remove from session
-                    remove_from_session(client_idx);
-                    // Clear client data
-                    clients[client_idx].active = 0;
-                    clients[client_idx].socket = -1;
-                    memset(clients[client_idx].session, 0, MAX_NAME);
-                }
-                pthread_mutex_unlock(&clients_mutex);
+// Forget what a peer reported. Called with cluster_lock held.
+void peer_forget(Peer *p) {
+    for (int i = 0; i < p->users.next; i++) {
+        RemoteUser *u = slab_get(&p->users, i);
+        if (!u->id[0]) continue;
+        presence_user_remove(&presence, u->id);
+        user_event(NULL, u->id, "offline");
+        registry_remove(&p->user_registry, u->id);
+        memset(u->id, 0, MAX_NAME);
+        slab_free(&p->users, u->handle);
+    }
+    for (int i = 0; i < p->sessions.next; i++) {
+        RemoteSession *rs = slab_get(&p->sessions, i);
+        if (!rs->session_id[0]) continue;
+        presence_session_remote(&presence, rs->session_id, -1, -rs->count);
+        registry_remove(&p->session_registry, rs->session_id);
+        memset(rs->session_id, 0, MAX_NAME);
+        slab_free(&p->sessions, rs->handle);
+    }
+}
 
-                // Acknowledge logout
-                Message response = {0};
-                response.type = 4; // EXIT_ACK
-                char res_buffer[BUF_SIZE];
-                serialize_message(&response, res_buffer);
-                send(client_socket, res_buffer, strlen(res_buffer), 0);
+// Drop a link. A dialed peer is dialed again later; an accepted one frees
+// its slot.
+void peer_close(Federation *fed, Peer *p) {
+    statlock_lock(&cluster_lock);
+    p->up = 0;
+    peer_forget(p);
+    statlock_unlock(&cluster_lock);
+    outq_close(&p->out);
+    epoll_ctl(fed->epfd, EPOLL_CTL_DEL, p->fd, NULL);
+    close(p->fd);
+    outq_destroy(&p->out);
+    p->fd = -1;
+    if (!p->dialed) p->node = -1;
+}
 
-                // Do NOT close the socket or exit the thread
-                break;
-            }
+void peer_dial(Federation *fed, Peer *p) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        perror("socket");
+        return;
+    }
+    if (connect(fd, (struct sockaddr *)&p->address, sizeof(p->address)) < 0 && errno != EINPROGRESS) {
+        close(fd);
+        return;
+    }
+    // HELLO waits in the queue until the connection is made; if it fails,
+    // the hangup closes the link.
+    peer_open(fed, p, fd);
+}
 
-            case 5: { // JOIN
-                pthread_mutex_lock(&clients_mutex);
-                int client_idx = find_client_index(msg.source);
-                pthread_mutex_unlock(&clients_mutex);
+// Tell a peer that just said HELLO everything it should know about us.
+// Changes made meanwhile are queued behind this and sent after it.
+void peer_sync(Peer *p) {
+    statlock_lock(&clients_mutex);
+    for (int i = 0; i < client_slab.next; i++) {
+        Client *c = slab_get(&client_slab, i);
+        if (c->active) peer_send(p, PEER_USER, c->id, c->session);
+    }
+    statlock_unlock(&clients_mutex);
+    for (int s = 0; s < num_shards; s++) {
+        Shard *shard = &shards[s];
+        statlock_lock(&shard->lock);
+        for (int i = 0; i < shard->sessions.next; i++) {
+            Session *sess = slab_get(&shard->sessions, i);
+            if (!sess->session_id[0]) continue;
+            char count[16];
+            snprintf(count, sizeof(count), "%d", sess->count);
+            peer_send(p, PEER_SESSION, sess->session_id, count);
+        }
+        statlock_unlock(&shard->lock);
+    }
+}
 
-                pthread_mutex_lock(&sessions_mutex);
-                int session_idx = find_session_index(msg.data);
-                
-                if (client_idx == -1) {
-                    response.type = 7; // JN_NAK
-                    strcpy(response.data, "Not logged in");
-                }
-                else if (session_idx == -1) {
-                    response.type = 7; // JN_NAK
-                    strcpy(response.data, "Session not found");
-                }
-                else if (strlen(clients[client_idx].session) > 0) {
-                    response.type = 7; // JN_NAK
-                    strcpy(response.data, "Already in session");
-                }
-                else {
-                    Session *sess = &sessions[session_idx];
-                    if (sess->count < MAX_CLIENTS) {
-                        pthread_mutex_lock(&clients_mutex);
-                        sess->participants[sess->count++] = &clients[client_idx];
-                        strcpy(clients[client_idx].session, sess->session_id);
-                        pthread_mutex_unlock(&clients_mutex);
-                        
-                        response.type = 6; // JN_ACK
-                        strcpy(response.data, sess->session_id);
-                    } else {
-                        response.type = 7; // JN_NAK
-                        strcpy(response.data, "Session full");
-                    }
-                }
-                pthread_mutex_unlock(&sessions_mutex);
+// The first frame on a link names the node at the other end. Two nodes that
+// dial each other keep only the link the lower id dialed. Returns -1 if this
+// link should go.
+int peer_hello(Federation *fed, Peer *p, MessageView *msg) {
+    if (msg->type != PEER_HELLO) return -1;
+    int node = atoi(msg->source);
+    if (node == node_id) return -1; // Ourselves
+    int dialer = p->dialed ? node_id : node;
+    for (int i = 0; i < MAX_PEERS; i++) {
+        Peer *q = &fed->peers[i];
+        if (q == p || q->fd == -1 || q->node != node) continue;
+        int other = q->dialed ? node_id : node;
+        if (other == dialer || other < dialer) return -1;
+        peer_close(fed, q);
+    }
+    p->node = node;
+    statlock_lock(&cluster_lock);
+    p->up = 1;
+    statlock_unlock(&cluster_lock);
+    peer_sync(p);
+    return 0;
+}
+
+// Record a user or session a peer reported. Called with cluster_lock held.
+void peer_record(Peer *p, MessageView *msg) {
+    switch (msg->type) {
+        case PEER_USER:
+        case PEER_USER_GONE: {
+            int handle = registry_find(&p->user_registry, msg->source);
+            if (msg->type == PEER_USER_GONE) {
+                if (handle == -1) break;
+                RemoteUser *u = slab_get(&p->users, handle);
+                presence_user_remove(&presence, u->id);
+                user_event(NULL, u->id, "offline");
+                registry_remove(&p->user_registry, u->id);
+                memset(u->id, 0, MAX_NAME);
+                slab_free(&p->users, handle);
                 break;
             }
-            // In client_handler() switch-case:
-            case 8: { // LEAVE_SESS
-                pthread_mutex_lock(&clients_mutex);
-                int client_idx = find_client_index(msg.source);
-                if (client_idx == -1) {
-                    // Not logged in
-                    response.type = 3; // LO_NAK
-                    strcpy(response.data, "Not logged in");
-                } else if (strlen(clients[client_idx].session) == 0) {
-                    // Not in a session
-                    response.type = 7; // JN_NAK
-                    strcpy(response.data, "Not in any session");
-                } else {
-                    // Remove from session
-                    remove_from_session(client_idx);
-                    response.type = 8; // LEAVE_SESS_ACK
-                    strcpy(response.data, "Left session successfully");
-                }
-                pthread_mutex_unlock(&clients_mutex);
-                break;
+            if (handle == -1) {
+                handle = slab_alloc(&p->users);
+                if (handle == -1) break;
+                RemoteUser *u = slab_get(&p->users, handle);
+                strcpy(u->id, msg->source);
+                u->handle = handle;
+                registry_insert(&p->user_registry, u->id, handle);
+                user_event(NULL, u->id, "online");
             }
-            case 9: { // NEW_SESS
-                pthread_mutex_lock(&clients_mutex);
-                int client_idx = find_client_index(msg.source);
-                if (client_idx != -1 && strlen(clients[client_idx].session) > 0) {
-                    pthread_mutex_unlock(&clients_mutex);
-                    response.type = 7; // JN_NAK
-                    strcpy(response.data, "Already in a session");
-                    break;
-                }
-                pthread_mutex_unlock(&clients_mutex);
-
-                pthread_mutex_lock(&sessions_mutex);
-                int session_idx = find_session_index(msg.data);
-                if (session_idx != -1) {
-                    // Session already exists, reject the request
-                    response.type = 7; // JN_NAK
-                    strcpy(response.data, "Session already exists");
-                } else {
-                    // Session doesn't exist, create it
-                    int created = 0;
-                    for (int i = 0; i < MAX_SESSIONS; i++) {
-                        if (strlen(sessions[i].session_id) == 0) {
-                            strcpy(sessions[i].session_id, msg.data);
-                            sessions[i].count = 0;
-
-                            pthread_mutex_lock(&clients_mutex);
-                            if (client_idx != -1) {
-                                sessions[i].participants[sessions[i].count++] = &clients[client_idx];
-                                strcpy(clients[client_idx].session, sessions[i].session_id);
-                            }
-                            pthread_mutex_unlock(&clients_mutex);
-
-                            response.type = 10; // NS_ACK
-                            //strcpy(response.source, "CLIENT"); //testing of client field
-                            strcpy(response.data, sessions[i].session_id);
-                            created = 1;
-                            break;
-                        }
-                    }
-                    if (!created) {
-                        response.type = 7; // JN_NAK
-                        strcpy(response.data, "Max sessions reached");
-                    }
-                }
-                pthread_mutex_unlock(&sessions_mutex);
+            RemoteUser *u = slab_get(&p->users, handle);
+            snprintf(u->session, MAX_NAME, "%s", msg->data);
+            presence_user_set(&presence, u->id, u->session);
+            break;
+        }
+        case PEER_SESSION:
+        case PEER_SESSION_GONE: {
+            int handle = registry_find(&p->session_registry, msg->source);
+            if (msg->type == PEER_SESSION_GONE) {
+                if (handle == -1) break;
+                RemoteSession *rs = slab_get(&p->sessions, handle);
+                presence_session_remote(&presence, rs->session_id, -1, -rs->count);
+                registry_remove(&p->session_registry, rs->session_id);
+                memset(rs->session_id, 0, MAX_NAME);
+                slab_free(&p->sessions, handle);
                 break;
             }
+            if (handle == -1) {
+                handle = slab_alloc(&p->sessions);
+                if (handle == -1) break;
+                RemoteSession *rs = slab_get(&p->sessions, handle);
+                strcpy(rs->session_id, msg->source);
+                rs->handle = handle;
+                rs->count = 0;
+                registry_insert(&p->session_registry, rs->session_id, handle);
+                presence_session_remote(&presence, rs->session_id, 1, 0);
+            }
+            RemoteSession *rs = slab_get(&p->sessions, handle);
+            int count = atoi(msg->data);
+            presence_session_remote(&presence, rs->session_id, 0, count - rs->count);
+            rs->count = count;
+            break;
+        }
+    }
+}
 
-            case 11: // MESSAGE
-                pthread_mutex_lock(&clients_mutex);
-                int client_idx = find_client_index(msg.source);
-                if (client_idx != -1 && strlen(clients[client_idx].session) > 0) {
-                    broadcast_message(&msg, clients[client_idx].session);
-                }
-                pthread_mutex_unlock(&clients_mutex);
-                break;
+// Handle one frame from a peer. Returns -1 once the link should be dropped.
+int peer_frame(Federation *fed, Peer *p, MessageView *msg) {
+    if (msg->mode != WIRE_BINARY) return -1;
+    if (!p->up) return peer_hello(fed, p, msg);
 
-            
-
-            case 12: { // QUERY
-                pthread_mutex_lock(&clients_mutex);
-                pthread_mutex_lock(&sessions_mutex);
-                
-                char list[BUF_SIZE] = {0};
-                // Build list with \n
-                strcat(list, "=== Online Users ===\n");
-                for (int i = 0; i < MAX_CLIENTS; i++) {
-                    if (clients[i].active) {
-                        char user_entry[100];
-                        snprintf(user_entry, sizeof(user_entry), 
-                                "- %s (in %s)\n", 
-                                clients[i].id, clients[i].session);
-                        strcat(list, user_entry);
-                    }
-                }
-                strcat(list, "\n=== Active Sessions ===\n");
-                for (int i = 0; i < MAX_SESSIONS; i++) {
-                    if (strlen(sessions[i].session_id) > 0) {
-                        char session_entry[100];
-                        snprintf(session_entry, sizeof(session_entry), 
-                                "- %s (%d participants)\n", 
-                                sessions[i].session_id, sessions[i].count);
-                        strcat(list, session_entry);
-                    }
-                }
+    switch (msg->type) {
+        case PEER_USER:
+        case PEER_USER_GONE:
+        case PEER_SESSION:
+        case PEER_SESSION_GONE:
+            statlock_lock(&cluster_lock);
+            peer_record(p, msg);
+            statlock_unlock(&cluster_lock);
+            return 0;
 
-                // Replace newlines with ~
-                for (char *p = list; *p; p++) {
-                    if (*p == '\n') *p = '~';
-                }
+        case PEER_ROUTE:
+            strcpy(p->route, msg->source);
+            return 0;
 
-                response.type = 13;
-                response.size = strlen(list);
-                strcpy(response.source, "SERVER");
-                strncpy(response.data, list, MAX_DATA);
+        case 11: // MESSAGE or a member's presence event, for the session named by the last ROUTE
+        case PRESENCE_EVENT: {
+            if (!p->route[0]) return -1;
+            // The session's owner sends it to the members here and not
+            // back out to other nodes.
+            ShardMsg *m = new_shard_msg(SHARD_MESSAGE, -1);
+            strcpy(m->session_id, p->route);
+            m->at = metrics_now();
+            if (encode_frames(m->frame, msg->type, msg->source, msg->source_len, msg->data, msg->data_len) < 0) {
+                release_shard_msg(NULL, m);
+                return 0;
+            }
+            post(&shards[owner_of(m->session_id)].inbox, m);
+            return 0;
+        }
+
+        default:
+            return -1;
+    }
+}
+
+int peer_service(Federation *fed, Peer *p) {
+    if (outq_flush(&p->out, p->fd) < 0) return -1;
+    while (1) {
+        MessageView msg;
+        int rc;
+        while ((rc = inbuf_next(&p->in, &msg)) > 0) {
+            if (peer_frame(fed, p, &msg) < 0) return -1;
+        }
+        if (rc < 0) return -1;
+
+        ssize_t n = inbuf_fill(&p->in, p->fd);
+        if (n == 0) return -1;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+    }
+}
 
-                pthread_mutex_unlock(&sessions_mutex);
-                pthread_mutex_unlock(&clients_mutex);
+// Pass on what the shards reported.
+void drain_federation(Federation *fed) {
+    ShardMsg *m;
+    while ((m = inbox_next(&fed->inbox))) {
+        switch (m->kind) {
+            case FED_USER:
+                peer_broadcast(fed, PEER_USER, m->data, m->session_id);
+                break;
+            case FED_USER_GONE:
+                peer_broadcast(fed, PEER_USER_GONE, m->data, "");
+                break;
+            case FED_SESSION: {
+                char count[16];
+                snprintf(count, sizeof(count), "%d", m->count);
+                peer_broadcast(fed, m->count < 0 ? PEER_SESSION_GONE : PEER_SESSION,
+                               m->session_id, m->count < 0 ? "" : count);
                 break;
             }
-            case 14: { // QUIT
-                pthread_mutex_lock(&clients_mutex);
-                int client_idx = find_client_index(msg.source);
-                if (client_idx != -1) {
-                    // Remove from session
-                    remove_from_session(client_idx);
-                    // Clear client data
-                    clients[client_idx].active = 0;
-                    clients[client_idx].socket = -1;
-                    memset(clients[client_idx].session, 0, MAX_NAME);
+            case FED_MESSAGE:
+                // Once per node with members, however many it has.
+                for (int i = 0; i < MAX_PEERS; i++) {
+                    Peer *p = &fed->peers[i];
+                    if (!p->up) continue;
+                    int handle = registry_find(&p->session_registry, m->session_id);
+                    if (handle == -1 || ((RemoteSession *)slab_get(&p->sessions, handle))->count <= 0) continue;
+                    if (strcmp(p->routed, m->session_id) != 0) {
+                        strcpy(p->routed, m->session_id);
+                        peer_send(p, PEER_ROUTE, m->session_id, "");
+                    }
+                    outq_send(&p->out, p->fd, m->frame[WIRE_BINARY], OUTQ_DISCONNECT);
                 }
-                pthread_mutex_unlock(&clients_mutex);
-
-                // Acknowledge quit
-                Message response = {0};
-                response.type = 14; // QUIT_ACK
-                char res_buffer[BUF_SIZE];
-                serialize_message(&response, res_buffer);
-                send(client_socket, res_buffer, strlen(res_buffer), 0);
-
-                // Close the socket and exit the thread
-                close(client_socket);
-                pthread_exit(NULL);
+                msgbuf_unref(m->frame[WIRE_BINARY]);
                 break;
-            }
+            case SHARD_HANDOFF:
+                park();
+                break;
+        }
+        release_shard_msg(NULL, m);
+    }
+}
 
-            default:
-                response.type = 3;
-                strcpy(response.data, "Unknown command");
+// Dial the peers that are down, unless another link already reaches the
+// same node.
+void dial_peers(Federation *fed) {
+    for (int i = 0; i < fed->num_dialed; i++) {
+        Peer *p = &fed->peers[i];
+        if (p->fd != -1) continue;
+        int reached = 0;
+        for (int j = 0; j < MAX_PEERS; j++) {
+            if (fed->peers[j].up && p->node != -1 && fed->peers[j].node == p->node) reached = 1;
         }
+        if (!reached) peer_dial(fed, p);
+    }
+}
 
-        if (response.type != 0) {
-            char res_buffer[BUF_SIZE];
-            serialize_message(&response, res_buffer);
-            send(client_socket, res_buffer, strlen(res_buffer), 0);
+void accept_peers(Federation *fed) {
+    while (1) {
+        int fd = accept4(fed->listen_fd, NULL, NULL, SOCK_NONBLOCK);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+            return;
+        }
+        Peer *p = NULL;
+        for (int i = fed->num_dialed; i < MAX_PEERS && !p; i++) {
+            if (fed->peers[i].fd == -1) p = &fed->peers[i];
+        }
+        if (!p) {
+            close(fd);
+            continue;
         }
+        peer_open(fed, p, fd);
     }
+}
 
-    // Cleanup
-    pthread_mutex_lock(&clients_mutex);
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (clients[i].socket == client_socket) {
-            remove_from_session(i);
-            clients[i].active = 0;
-            break;
+void *federation_main(void *arg) {
+    Federation *fed = arg;
+    struct epoll_event events[MAX_EVENTS];
+    struct timespec last, now;
+    clock_gettime(CLOCK_MONOTONIC, &last);
+    dial_peers(fed);
+    while (1) {
+        int n = epoll_wait(fed->epfd, events, MAX_EVENTS, fed->num_dialed ? PEER_RETRY_MS : -1);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == &peer_listen_event) {
+                accept_peers(fed);
+            } else if (ptr == &inbox_event) {
+                drain_federation(fed);
+            } else {
+                Peer *p = ptr;
+                // An earlier event in this batch may have closed it.
+                if (p->fd != -1 && peer_service(fed, p) < 0) peer_close(fed, p);
+            }
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - last.tv_sec) * 1000 + (now.tv_nsec - last.tv_nsec) / 1000000 >= PEER_RETRY_MS) {
+            dial_peers(fed);
+            last = now;
         }
     }
-    pthread_mutex_unlock(&clients_mutex);
-    close(client_socket);
-    pthread_exit(NULL);
+    return NULL;
 }
 
+// Look up host:port for a peer given with -p.
+void add_peer(Federation *fed, char *spec) {
+    char *colon = strrchr(spec, ':');
+    if (!colon || fed->num_dialed == MAX_PEERS) {
+        fprintf(stderr, "Bad peer %s\n", spec);
+        exit(EXIT_FAILURE);
+    }
+    *colon = '\0';
+    struct addrinfo hints = {0}, *res;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(spec, colon + 1, &hints, &res) != 0) {
+        fprintf(stderr, "Unknown peer %s\n", spec);
+        exit(EXIT_FAILURE);
+    }
+    Peer *p = &fed->peers[fed->num_dialed++];
+    memcpy(&p->address, res->ai_addr, sizeof(p->address));
+    p->dialed = 1;
+    freeaddrinfo(res);
+}
 
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]);
+Federation *init_federation(void) {
+    Federation *fed = calloc(1, sizeof(Federation));
+    if (!fed) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    fed->epfd = epoll_create1(0);
+    if (fed->epfd < 0) {
+        perror("epoll_create1");
         exit(EXIT_FAILURE);
     }
+    fed->listen_fd = -1;
+    inbox_init(&fed->inbox, fed->epfd, &inbox_event);
+    for (int i = 0; i < MAX_PEERS; i++) {
+        Peer *p = &fed->peers[i];
+        p->fd = -1;
+        p->node = -1;
+        slab_init(&p->users, sizeof(RemoteUser), max_clients, NULL);
+        registry_init(&p->user_registry, SLAB_OBJECTS);
+        slab_init(&p->sessions, sizeof(RemoteSession), max_sessions, NULL);
+        registry_init(&p->session_registry, SLAB_OBJECTS);
+    }
+    return fed;
+}
 
-    int server_fd, new_socket;
-    struct sockaddr_in address;
-    int opt = 1;
-    int addrlen = sizeof(address);
+void listen_for_peers(Federation *fed, const char *port) {
+    fed->listen_fd = inherited_listener(-1);
+    if (fed->listen_fd < 0) fed->listen_fd = open_listener(port, 0);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &peer_listen_event };
+    if (epoll_ctl(fed->epfd, EPOLL_CTL_ADD, fed->listen_fd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static const char *const command_names[STAT_COMMANDS] = {
+    [0] = "other", [1] = "login", [4] = "exit", [5] = "join", [8] = "leave_sess",
+    [9] = "new_sess", [11] = "message", [12] = "query", [14] = "quit",
+    [15] = "subscribe", [PING] = "ping", [PONG] = "pong",
+};
 
-    memset(clients, 0, sizeof(clients));
-    memset(sessions, 0, sizeof(sessions));
+void write_counter(FILE *out, const char *name, const char *type, const char *help, unsigned long long value) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n", name, help, name, type, name, value);
+}
 
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-        perror("socket failed");
-        exit(EXIT_FAILURE);
+// Everything the admin port shows, summed over shards.
+void write_metrics(FILE *out) {
+    Stats sum;
+    memset(&sum, 0, sizeof(sum));
+    LockStats locks[5];
+    memset(locks, 0, sizeof(locks));
+    for (int i = 0; i < num_shards; i++) {
+        Stats *st = &shards[i].stats;
+        for (int t = 0; t < STAT_COMMANDS; t++) sum.commands[t] += STAT_GET(st->commands[t]);
+        sum.bytes_in += STAT_GET(st->bytes_in);
+        sum.bytes_out += STAT_GET(st->bytes_out);
+        sum.accepted += STAT_GET(st->accepted);
+        sum.closed += STAT_GET(st->closed);
+        sum.logins += STAT_GET(st->logins);
+        sum.logouts += STAT_GET(st->logouts);
+        sum.idle_closed += STAT_GET(st->idle_closed);
+        sum.throttled += STAT_GET(st->throttled);
+        sum.flood_dropped += STAT_GET(st->flood_dropped);
+        sum.flood_closed += STAT_GET(st->flood_closed);
+        sum.session_dropped += STAT_GET(st->session_dropped);
+        sum.sessions_opened += STAT_GET(st->sessions_opened);
+        sum.sessions_closed += STAT_GET(st->sessions_closed);
+        hist_read(&st->command, &sum.command);
+        hist_read(&st->broadcast, &sum.broadcast);
+        statlock_read(&shards[i].lock, &locks[1]);
     }
+    statlock_read(&clients_mutex, &locks[0]);
+    statlock_read(&cluster_lock, &locks[2]);
+    statlock_read(&presence.lock, &locks[3]);
+    if (msglog) statlock_read(&msglog->lock, &locks[4]);
 
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
-        perror("setsockopt");
-        exit(EXIT_FAILURE);
+    fprintf(out, "# HELP chat_commands_total Commands handled, by type.\n# TYPE chat_commands_total counter\n");
+    for (int t = 0; t < STAT_COMMANDS; t++) {
+        if (command_names[t]) fprintf(out, "chat_commands_total{command=\"%s\"} %llu\n", command_names[t], sum.commands[t]);
+    }
+    write_counter(out, "chat_bytes_in_total", "counter", "Bytes received from clients.", sum.bytes_in);
+    write_counter(out, "chat_bytes_out_total", "counter", "Bytes queued to clients.", sum.bytes_out);
+    write_counter(out, "chat_connections_accepted_total", "counter", "Client connections accepted.", sum.accepted);
+    write_counter(out, "chat_connections", "gauge", "Client connections open.", sum.accepted - sum.closed);
+    write_counter(out, "chat_users", "gauge", "Users logged in on this node.", sum.logins - sum.logouts);
+    write_counter(out, "chat_idle_closed_total", "counter", "Connections closed after the idle timeout.",
+                  sum.idle_closed);
+    write_counter(out, "chat_throttled_total", "counter", "Times a connection over its rate limits was paused.",
+                  sum.throttled);
+    write_counter(out, "chat_flood_dropped_total", "counter", "Commands discarded over a connection's rate limits.",
+                  sum.flood_dropped);
+    write_counter(out, "chat_flood_closed_total", "counter", "Connections closed over their rate limits.",
+                  sum.flood_closed);
+    write_counter(out, "chat_session_dropped_total", "counter", "Messages discarded over a session's rate limits.",
+                  sum.session_dropped);
+    write_counter(out, "chat_sessions", "gauge", "Sessions open on this node.", sum.sessions_opened - sum.sessions_closed);
+    fprintf(out, "# HELP chat_shard_messages_total Messages a shard took from its inbox.\n"
+                 "# TYPE chat_shard_messages_total counter\n");
+    for (int i = 0; i < num_shards; i++) {
+        fprintf(out, "chat_shard_messages_total{shard=\"%d\"} %llu\n", i, STAT_GET(shards[i].stats.shard_messages));
+    }
+    if (federation) {
+        int up = 0;
+        statlock_lock(&cluster_lock);
+        for (int i = 0; i < MAX_PEERS; i++) up += federation->peers[i].up;
+        statlock_unlock(&cluster_lock);
+        write_counter(out, "chat_peers", "gauge", "Links to other nodes that are up.", up);
     }
+    metrics_write_hist(out, "chat_command_seconds", "Time to handle one command.", &sum.command);
+    metrics_write_hist(out, "chat_broadcast_seconds",
+                       "Time from a MESSAGE arriving to one shard having queued it to its members.", &sum.broadcast);
+    // Sessions are guarded by their owner shard's lock; those are summed.
+    if (msglog) {
+        write_counter(out, "chat_log_records_total", "counter", "Messages written to the log.",
+                      STAT_GET(msglog->appended));
+        write_counter(out, "chat_log_commits_total", "counter", "Batches synced to disk, one fdatasync each.",
+                      STAT_GET(msglog->commits));
+        write_counter(out, "chat_log_bytes_total", "counter", "Bytes written to the log.", STAT_GET(msglog->bytes));
+        write_counter(out, "chat_log_compacted_total", "counter",
+                      "Records copied forward when an old segment was deleted.", STAT_GET(msglog->compacted));
+    }
+    const char *const names[5] = { "clients", "sessions", "cluster", "presence", "log" };
+    metrics_write_locks(out, names, locks, msglog ? 5 : 4);
+}
 
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(atoi(argv[1]));
+// Serve the metrics over HTTP, one request per connection. It runs on its
+// own thread and only reads counters, so a scrape never stalls a shard.
+void *admin_main(void *arg) {
+    int listen_fd = *(int *)arg;
+    while (1) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) perror("accept");
+            continue;
+        }
+        struct timeval timeout = { 1, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        char request[1024];
+        ssize_t n = recv(fd, request, sizeof(request) - 1, 0);
+        if (n <= 0) {
+            close(fd);
+            continue;
+        }
+        request[n] = '\0';
 
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-        perror("bind failed");
+        char *body = NULL;
+        size_t body_len = 0;
+        FILE *out = open_memstream(&body, &body_len);
+        if (!out) {
+            close(fd);
+            continue;
+        }
+        int found = strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0;
+        if (found) {
+            write_metrics(out);
+        } else {
+            fprintf(out, "Not found\n");
+        }
+        fclose(out);
+
+        char header[256];
+        int header_len = snprintf(header, sizeof(header),
+                                  "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                  "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+                                  found ? "200 OK" : "404 Not Found", body_len);
+        if (send(fd, header, header_len, MSG_NOSIGNAL) == header_len) send(fd, body, body_len, MSG_NOSIGNAL);
+        free(body);
+        close(fd);
+    }
+    return NULL;
+}
+
+// The number given to -m, -w, -M or -W, UINT64_MAX unless it is all digits
+// and fits a token bucket.
+uint64_t parse_rate(const char *arg) {
+    if (*arg < '0' || *arg > '9') return UINT64_MAX;
+    char *end;
+    errno = 0;
+    unsigned long long rate = strtoull(arg, &end, 10);
+    if (*end || errno == ERANGE || rate > RATE_MAX) return UINT64_MAX;
+    return rate;
+}
+
+int main(int argc, char *argv[]) {
+    // -r sets the number of shards (one event loop thread each, one per CPU
+    // by default), -c the most users at once and -s the most sessions per
+    // shard, -q and -b the outbound queue length and what happens when it
+    // fills. -t closes connections silent for that many seconds (0 never).
+    // -m and -w limit the commands and bytes a second from one connection,
+    // -M and -W the messages and bytes a second in one session (0 for no
+    // limit), and -x says what happens to a connection over its limits.
+    // -u open lets any user name log in, for load tests. -a serves
+    // metrics over HTTP on another port. -i makes this node part of a
+    // cluster: it takes links from other nodes on the -l port and dials each
+    // -p host:port. -U takes over from the server listening on that Unix
+    // socket, if any, and then listens there for the next upgrade.
+    num_shards = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_shards > MAX_SHARDS) num_shards = MAX_SHARDS;
+    if (num_shards < 1) num_shards = 1;
+    char *peer_port = NULL;
+    char *admin_port = NULL;
+    char *log_dir = NULL;
+    int log_segments = DEFAULT_LOG_SEGMENTS;
+    char *peer_specs[MAX_PEERS];
+    int num_peer_specs = 0;
+    int argi = 1;
+    while (argi + 1 < argc && argv[argi][0] == '-') {
+        if (strcmp(argv[argi], "-i") == 0) {
+            node_id = atoi(argv[argi + 1]);
+        } else if (strcmp(argv[argi], "-a") == 0) {
+            admin_port = argv[argi + 1];
+        } else if (strcmp(argv[argi], "-L") == 0) {
+            log_dir = argv[argi + 1];
+        } else if (strcmp(argv[argi], "-m") == 0) {
+            command_limit.rate = command_limit.burst = parse_rate(argv[argi + 1]);
+        } else if (strcmp(argv[argi], "-w") == 0) {
+            byte_limit.rate = byte_limit.burst = parse_rate(argv[argi + 1]);
+        } else if (strcmp(argv[argi], "-M") == 0) {
+            session_limit.rate = session_limit.burst = parse_rate(argv[argi + 1]);
+        } else if (strcmp(argv[argi], "-W") == 0) {
+            session_byte_limit.rate = session_byte_limit.burst = parse_rate(argv[argi + 1]);
+        } else if (strcmp(argv[argi], "-x") == 0) {
+            if (strcmp(argv[argi + 1], "throttle") == 0) {
+                flood_action = FLOOD_THROTTLE;
+            } else if (strcmp(argv[argi + 1], "drop") == 0) {
+                flood_action = FLOOD_DROP;
+            } else if (strcmp(argv[argi + 1], "disconnect") == 0) {
+                flood_action = FLOOD_DISCONNECT;
+            } else {
+                break;
+            }
+        } else if (strcmp(argv[argi], "-t") == 0) {
+            idle_timeout = strtoull(argv[argi + 1], NULL, 10) * 1000000000ULL;
+        } else if (strcmp(argv[argi], "-U") == 0) {
+            upgrade_path = argv[argi + 1];
+        } else if (strcmp(argv[argi], "-k") == 0) {
+            log_segments = atoi(argv[argi + 1]);
+        } else if (strcmp(argv[argi], "-l") == 0) {
+            peer_port = argv[argi + 1];
+        } else if (strcmp(argv[argi], "-p") == 0 && num_peer_specs < MAX_PEERS) {
+            peer_specs[num_peer_specs++] = argv[argi + 1];
+        } else if (strcmp(argv[argi], "-r") == 0) {
+            num_shards = atoi(argv[argi + 1]);
+        } else if (strcmp(argv[argi], "-c") == 0) {
+            max_clients = atoi(argv[argi + 1]);
+        } else if (strcmp(argv[argi], "-s") == 0) {
+            max_sessions = atoi(argv[argi + 1]);
+        } else if (strcmp(argv[argi], "-H") == 0) {
+            default_history = atoi(argv[argi + 1]);
+        } else if (strcmp(argv[argi], "-u") == 0) {
+            if (strcmp(argv[argi + 1], "open") != 0) break;
+            open_login = 1;
+        } else if (strcmp(argv[argi], "-q") == 0) {
+            outq_limit = atoi(argv[argi + 1]);
+        } else if (strcmp(argv[argi], "-b") == 0) {
+            if (strcmp(argv[argi + 1], "drop") == 0) {
+                backpressure = OUTQ_DROP_OLDEST;
+            } else if (strcmp(argv[argi + 1], "disconnect") == 0) {
+                backpressure = OUTQ_DISCONNECT;
+            } else {
+                break;
+            }
+        } else {
+            break;
+        }
+        argi += 2;
+    }
+    if (argc - argi != 1 || num_shards <= 0 || num_shards > MAX_SHARDS || outq_limit <= 0 ||
+        max_clients <= 0 || max_sessions <= 0 || default_history < 0 || default_history > HISTORY_MAX || log_segments <= 0 ||
+        command_limit.rate > RATE_MAX || byte_limit.rate > RATE_MAX ||
+        session_limit.rate > RATE_MAX || session_byte_limit.rate > RATE_MAX ||
+        (node_id < 0 && (peer_port || num_peer_specs))) {
+        fprintf(stderr, "Usage: %s [-r shards] [-c max_clients] [-s max_sessions] [-H history] [-L log_dir [-k segments]] "
+                "[-u open] [-q queue_limit] [-b drop|disconnect] [-t idle_seconds] "
+                "[-m commands/s] [-w bytes/s] [-M session_messages/s] [-W session_bytes/s] "
+                "[-x throttle|drop|disconnect] [-a admin_port] [-U upgrade_socket] "
+                "[-i node_id [-l peer_port] [-p host:port]...] <port>\n",
+                argv[0]);
         exit(EXIT_FAILURE);
     }
 
-    if (listen(server_fd, 10) < 0) {
-        perror("listen");
+    slab_init(&client_slab, sizeof(Client), max_clients, NULL);
+    registry_init(&client_registry, SLAB_OBJECTS);
+    // Room for everyone here and on every peer.
+    int nodes = node_id >= 0 ? 1 + MAX_PEERS : 1;
+    presence_init(&presence, nodes * max_clients, (num_shards + nodes - 1) * max_sessions);
+
+    // Before the log is opened, which the old server closes first.
+    int took_over = upgrade_path && take_over(upgrade_path);
+
+    if (log_dir) {
+        // Before any shard runs, so the first sessions already find their
+        // history in it.
+        msglog = calloc(1, sizeof(MsgLog));
+        if (!msglog) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        int indexed = max_sessions > INT_MAX / num_shards ? INT_MAX : max_sessions * num_shards;
+        msglog_open(msglog, log_dir, log_segments, default_history, indexed);
+    }
+
+    if (node_id >= 0) {
+        federation = init_federation();
+        if (peer_port) listen_for_peers(federation, peer_port);
+        for (int i = 0; i < num_peer_specs; i++) add_peer(federation, peer_specs[i]);
+    }
+
+    shards = calloc(num_shards, sizeof(Shard));
+    if (!shards) {
+        perror("calloc");
         exit(EXIT_FAILURE);
     }
+    for (int i = 0; i < num_shards; i++) init_shard(&shards[i], i, argv[argi]);
+    if (admin_port) {
+        // Not shared: a second server on the port would take half its
+        // scrapes. An upgrade hands the old server's socket over instead.
+        admin_fd = inherited_listener(-2);
+        if (admin_fd < 0) admin_fd = open_listener(admin_port, 0);
+    }
+    if (took_over) adopt_inherited();
+    for (int i = 0; i < num_shards; i++) {
+        if (pthread_create(&shards[i].thread, NULL, shard_main, &shards[i]) != 0) {
+            perror("could not create shard thread");
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    printf("Server listening on port %s\n", argv[1]);
+    if (federation && pthread_create(&federation->thread, NULL, federation_main, federation) != 0) {
+        perror("could not create federation thread");
+        exit(EXIT_FAILURE);
+    }
 
-    while (1) {
-        if ((new_socket = accept(server_fd, (struct sockaddr *)&address, 
-                                 (socklen_t*)&addrlen)) < 0) {
-            perror("accept");
-            continue;
+    if (admin_port) {
+        pthread_t admin_thread;
+        int flags = fcntl(admin_fd, F_GETFL);
+        fcntl(admin_fd, F_SETFL, flags & ~O_NONBLOCK); // The admin thread blocks in accept()
+        if (pthread_create(&admin_thread, NULL, admin_main, &admin_fd) != 0) {
+            perror("could not create admin thread");
+            exit(EXIT_FAILURE);
         }
+        pthread_detach(admin_thread);
+    }
 
-        pthread_t thread_id;
-        if (pthread_create(&thread_id, NULL, client_handler, (void *)&new_socket) < 0) {
-            perror("could not create thread");
-            close(new_socket);
+    static int upgrade_fd;
+    if (upgrade_path) {
+        pthread_t upgrade_thread;
+        upgrade_fd = listen_for_upgrade(upgrade_path);
+        if (pthread_create(&upgrade_thread, NULL, upgrade_main, &upgrade_fd) != 0) {
+            perror("could not create upgrade thread");
+            exit(EXIT_FAILURE);
         }
-        pthread_detach(thread_id);
+        pthread_detach(upgrade_thread);
     }
 
+    printf("Server listening on port %s%s\n", argv[argi], took_over ? ", taken over" : "");
+
+    for (int i = 0; i < num_shards; i++) pthread_join(shards[i].thread, NULL);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,48 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "slab.h"
+
+void slab_init(Slab *s, size_t object_size, int max, void (*init)(void *object)) {
+    s->object_size = object_size;
+    s->max = max;
+    s->slabs = calloc((max + SLAB_OBJECTS - 1) / SLAB_OBJECTS, sizeof(char *));
+    if (!s->slabs) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    s->next = 0;
+    s->free = NULL;
+    s->num_free = s->free_cap = 0;
+    s->init = init;
+}
+
+int slab_alloc(Slab *s) {
+    if (s->num_free > 0) return s->free[--s->num_free];
+    if (s->next == s->max) return -1;
+
+    int handle = s->next;
+    if (!s->slabs[handle >> SLAB_SHIFT]) {
+        char *slab = calloc(SLAB_OBJECTS, s->object_size);
+        if (!slab) return -1;
+        if (s->init) {
+            for (int i = 0; i < SLAB_OBJECTS; i++) s->init(slab + i * s->object_size);
+        }
+        s->slabs[handle >> SLAB_SHIFT] = slab;
+    }
+    s->next++;
+    return handle;
+}
+
+void slab_free(Slab *s, int handle) {
+    if (s->num_free == s->free_cap) {
+        int cap = s->free_cap ? 2 * s->free_cap : SLAB_OBJECTS;
+        int *free_list = realloc(s->free, cap * sizeof(int));
+        if (!free_list) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        s->free = free_list;
+        s->free_cap = cap;
+    }
+    s->free[s->num_free++] = handle;
+}
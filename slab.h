@@ -0,0 +1,35 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+// Fixed-size objects named by small integer handles. Objects are carved from
+// slabs allocated as the pool grows, so memory follows the number of objects
+// ever live at once, and an object never moves: its address stays valid for
+// readers that do not hold the allocator's lock. Freed handles are reused.
+// Not thread-safe; callers hold whatever lock guards allocation.
+#define SLAB_SHIFT 8
+#define SLAB_OBJECTS (1 << SLAB_SHIFT) // Objects per slab
+
+typedef struct {
+    size_t object_size;
+    int max;                   // Handles stay below this
+    char **slabs;              // Directory for max objects, filled on demand
+    int next;                  // Handles below this have been handed out before
+    int *free;                 // Stack of released handles
+    int num_free;
+    int free_cap;
+    void (*init)(void *object); // Called once per object, when its slab is made
+} Slab;
+
+void slab_init(Slab *s, size_t object_size, int max, void (*init)(void *object));
+// A handle for an unused object, -1 once max are in use. A fresh object is
+// zeroed and initialized; a reused one is as slab_free() found it.
+int slab_alloc(Slab *s);
+void slab_free(Slab *s, int handle);
+
+static inline void *slab_get(const Slab *s, int handle) {
+    return s->slabs[handle >> SLAB_SHIFT] + (size_t)(handle & (SLAB_OBJECTS - 1)) * s->object_size;
+}
+
+#endif
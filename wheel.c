@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "wheel.h"
+
+void wheel_init(TimerWheel *w, int num_slots, uint64_t tick, uint64_t now) {
+    w->slots = malloc(num_slots * sizeof(WheelNode));
+    if (!w->slots) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < num_slots; i++) w->slots[i].prev = w->slots[i].next = &w->slots[i];
+    w->num_slots = num_slots;
+    w->tick = tick;
+    w->now = now / tick;
+}
+
+void wheel_remove(WheelNode *node) {
+    if (!node->next) return;
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = node->next = NULL;
+}
+
+void wheel_add(TimerWheel *w, WheelNode *node, uint64_t deadline) {
+    wheel_remove(node);
+    uint64_t tick = deadline / w->tick;
+    if (tick < w->now) tick = w->now; // Already due: fires with the next tick
+    WheelNode *head = &w->slots[tick % w->num_slots];
+    node->deadline = deadline;
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+void wheel_advance(TimerWheel *w, uint64_t now, void (*fn)(WheelNode *node, void *arg), void *arg) {
+    uint64_t to = now / w->tick; // Every tick before this one is over
+    // Past a whole turn, every slot is looked at once.
+    if (to - w->now > (uint64_t)w->num_slots) w->now = to - w->num_slots;
+    while (w->now < to) {
+        WheelNode *head = &w->slots[w->now % w->num_slots];
+        w->now++; // What fn adds already due goes to a tick still to come
+        // Take the slot's list out first, so what is added back waits for
+        // the next turn.
+        WheelNode pending = *head;
+        if (pending.next == head) continue;
+        pending.next->prev = pending.prev->next = &pending;
+        head->prev = head->next = head;
+        while (pending.next != &pending) {
+            WheelNode *node = pending.next;
+            wheel_remove(node);
+            if (node->deadline <= now) {
+                fn(node, arg);
+            } else {
+                wheel_add(w, node, node->deadline); // A later turn's
+            }
+        }
+    }
+}
@@ -0,0 +1,32 @@
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include <stdint.h>
+
+// Hashed timer wheel of intrusive nodes, for one thread. A timer goes into
+// the slot of the tick its deadline falls in, so adding or removing one
+// costs the same however many there are, and advancing the clock looks only
+// at the slots of the ticks that passed. Deadlines further out than one turn
+// of the wheel wait in their slot for the turns in between.
+typedef struct WheelNode {
+    struct WheelNode *prev, *next; // NULL while not scheduled
+    uint64_t deadline;
+} WheelNode;
+
+typedef struct {
+    WheelNode *slots;          // List heads, one per tick of a turn
+    int num_slots;
+    uint64_t tick;             // Length of a tick, in the caller's time unit
+    uint64_t now;              // First tick not yet over
+} TimerWheel;
+
+void wheel_init(TimerWheel *w, int num_slots, uint64_t tick, uint64_t now);
+// Schedule node for deadline, or move it there if it already is.
+void wheel_add(TimerWheel *w, WheelNode *node, uint64_t deadline);
+void wheel_remove(WheelNode *node);
+// Move the clock to now and call fn on every node whose deadline fell in a
+// tick that is over, unscheduled first so fn may add it again. A timer
+// fires at most a tick late.
+void wheel_advance(TimerWheel *w, uint64_t now, void (*fn)(WheelNode *node, void *arg), void *arg);
+
+#endif